@@ -33,6 +33,45 @@ inline bool is_transparent(const VoxelLibrary &lib, int voxel_id) {
 	return true;
 }
 
+// Values to add to the index of a voxel in order to get given neighbor
+struct NeighborLuts {
+	int sides[Cube::SIDE_COUNT];
+	int edges[Cube::EDGE_COUNT];
+	int corners[Cube::CORNER_COUNT];
+
+	// Edge and corner neighbors are combinations of side neighbors
+	void update(int left, int right, int back, int front, int bottom, int top) {
+		sides[Cube::SIDE_LEFT] = left;
+		sides[Cube::SIDE_RIGHT] = right;
+		sides[Cube::SIDE_BACK] = back;
+		sides[Cube::SIDE_FRONT] = front;
+		sides[Cube::SIDE_BOTTOM] = bottom;
+		sides[Cube::SIDE_TOP] = top;
+
+		edges[Cube::EDGE_BOTTOM_BACK] = bottom + back;
+		edges[Cube::EDGE_BOTTOM_FRONT] = bottom + front;
+		edges[Cube::EDGE_BOTTOM_LEFT] = bottom + left;
+		edges[Cube::EDGE_BOTTOM_RIGHT] = bottom + right;
+		edges[Cube::EDGE_BACK_LEFT] = back + left;
+		edges[Cube::EDGE_BACK_RIGHT] = back + right;
+		edges[Cube::EDGE_FRONT_LEFT] = front + left;
+		edges[Cube::EDGE_FRONT_RIGHT] = front + right;
+		edges[Cube::EDGE_TOP_BACK] = top + back;
+		edges[Cube::EDGE_TOP_FRONT] = top + front;
+		edges[Cube::EDGE_TOP_LEFT] = top + left;
+		edges[Cube::EDGE_TOP_RIGHT] = top + right;
+
+		corners[Cube::CORNER_BOTTOM_BACK_LEFT] = bottom + back + left;
+		corners[Cube::CORNER_BOTTOM_BACK_RIGHT] = bottom + back + right;
+		corners[Cube::CORNER_BOTTOM_FRONT_RIGHT] = bottom + front + right;
+		corners[Cube::CORNER_BOTTOM_FRONT_LEFT] = bottom + front + left;
+		corners[Cube::CORNER_TOP_BACK_LEFT] = top + back + left;
+		corners[Cube::CORNER_TOP_BACK_RIGHT] = top + back + right;
+		corners[Cube::CORNER_TOP_FRONT_RIGHT] = top + front + right;
+		corners[Cube::CORNER_TOP_FRONT_LEFT] = top + front + left;
+	}
+};
+
 } // namespace
 
 VoxelMesherBlocky::VoxelMesherBlocky() :
@@ -55,106 +94,44 @@ void VoxelMesherBlocky::set_occlusion_enabled(bool enable) {
 	_bake_occlusion = enable;
 }
 
-void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &buffer, int padding) {
-	//uint64_t time_before = OS::get_singleton()->get_ticks_usec();
-
-	ERR_FAIL_COND(_library.is_null());
-	ERR_FAIL_COND(padding < MINIMUM_PADDING);
-
-	const int channel = VoxelBuffer::CHANNEL_TYPE;
+template <typename Type_T>
+void VoxelMesherBlocky::build_internal(const VoxelBuffer &buffer, const Type_T *type_buffer, int padding) {
 
 	const VoxelLibrary &library = **_library;
 
-	for (unsigned int i = 0; i < MAX_MATERIALS; ++i) {
-		Arrays &a = _arrays[i];
-		a.positions.clear();
-		a.normals.clear();
-		a.uvs.clear();
-		a.colors.clear();
-		a.indices.clear();
-	}
-
 	float baked_occlusion_darkness;
 	if (_bake_occlusion)
 		baked_occlusion_darkness = _baked_occlusion_darkness / 3.0;
 
-	// The technique is Culled faces.
-	// Could be improved with greedy meshing: https://0fps.net/2012/06/30/meshing-in-a-minecraft-game/
-	// However I don't feel it's worth it yet:
-	// - Not so much gain for organic worlds with lots of texture variations
-	// - Works well with cubes but not with any shape
-	// - Slower
-	// => Could be implemented in a separate class?
-
 	// Data must be padded, hence the off-by-one
 	Vector3i min = Vector3i(padding);
 	Vector3i max = buffer.get_size() - Vector3i(padding);
 
 	int index_offset = 0;
 
-	// Iterate 3D padded data to extract voxel faces.
-	// This is the most intensive job in this class, so all required data should be as fit as possible.
-
-	// The buffer we receive MUST be dense (i.e not compressed, and channels allocated).
-	// That means we can use raw pointers to voxel data inside instead of using the higher-level getters,
-	// and then save a lot of time.
-
-	uint8_t *type_buffer = buffer.get_channel_raw(channel);
-	//       _
-	//      | \
-	//     /\ \\
-	//    / /|\\\
-	//    | |\ \\\
-	//    | \_\ \\|
-	//    |    |  )
-	//     \   |  |
-	//      \    /
-	if (type_buffer == nullptr) {
-		// No data to read, the channel is probably uniform
-		// TODO This is an invalid behavior IF sending a full block of uniformly opaque cubes,
-		// however not likely for terrains because with neighbor padding, such a case means no face would be generated anyways
-		return;
-	}
+	//CRASH_COND(memarr_len(type_buffer) != buffer.get_volume() * sizeof(Type_T));
 
-	//CRASH_COND(memarr_len(type_buffer) != buffer.get_volume() * sizeof(uint8_t));
+	// Voxel indexes are sums of per-axis offsets, so the same code works with all layouts.
+	// See VoxelBuffer::get_index_offsets().
+	const Vector3i size = buffer.get_size();
+	_index_offsets.resize(size.x + size.y + size.z);
+	unsigned int *offsets = _index_offsets.data();
+	buffer.get_index_offsets(offsets, offsets + size.x, offsets + size.x + size.y);
+	const unsigned int *x_offsets = offsets;
+	const unsigned int *y_offsets = offsets + size.x;
+	const unsigned int *z_offsets = offsets + size.x + size.y;
 
 	// Build lookup tables so to speed up voxel access.
 	// These are values to add to an address in order to get given neighbor.
-
-	int row_size = buffer.get_size().y;
-	int deck_size = buffer.get_size().x * row_size;
-
-	int side_neighbor_lut[Cube::SIDE_COUNT];
-	side_neighbor_lut[Cube::SIDE_LEFT] = row_size;
-	side_neighbor_lut[Cube::SIDE_RIGHT] = -row_size;
-	side_neighbor_lut[Cube::SIDE_BACK] = -deck_size;
-	side_neighbor_lut[Cube::SIDE_FRONT] = deck_size;
-	side_neighbor_lut[Cube::SIDE_BOTTOM] = -1;
-	side_neighbor_lut[Cube::SIDE_TOP] = 1;
-
-	int edge_neighbor_lut[Cube::EDGE_COUNT];
-	edge_neighbor_lut[Cube::EDGE_BOTTOM_BACK] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_BACK];
-	edge_neighbor_lut[Cube::EDGE_BOTTOM_FRONT] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_FRONT];
-	edge_neighbor_lut[Cube::EDGE_BOTTOM_LEFT] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_LEFT];
-	edge_neighbor_lut[Cube::EDGE_BOTTOM_RIGHT] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_RIGHT];
-	edge_neighbor_lut[Cube::EDGE_BACK_LEFT] = side_neighbor_lut[Cube::SIDE_BACK] + side_neighbor_lut[Cube::SIDE_LEFT];
-	edge_neighbor_lut[Cube::EDGE_BACK_RIGHT] = side_neighbor_lut[Cube::SIDE_BACK] + side_neighbor_lut[Cube::SIDE_RIGHT];
-	edge_neighbor_lut[Cube::EDGE_FRONT_LEFT] = side_neighbor_lut[Cube::SIDE_FRONT] + side_neighbor_lut[Cube::SIDE_LEFT];
-	edge_neighbor_lut[Cube::EDGE_FRONT_RIGHT] = side_neighbor_lut[Cube::SIDE_FRONT] + side_neighbor_lut[Cube::SIDE_RIGHT];
-	edge_neighbor_lut[Cube::EDGE_TOP_BACK] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_BACK];
-	edge_neighbor_lut[Cube::EDGE_TOP_FRONT] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_FRONT];
-	edge_neighbor_lut[Cube::EDGE_TOP_LEFT] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_LEFT];
-	edge_neighbor_lut[Cube::EDGE_TOP_RIGHT] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_RIGHT];
-
-	int corner_neighbor_lut[Cube::CORNER_COUNT];
-	corner_neighbor_lut[Cube::CORNER_BOTTOM_BACK_LEFT] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_BACK] + side_neighbor_lut[Cube::SIDE_LEFT];
-	corner_neighbor_lut[Cube::CORNER_BOTTOM_BACK_RIGHT] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_BACK] + side_neighbor_lut[Cube::SIDE_RIGHT];
-	corner_neighbor_lut[Cube::CORNER_BOTTOM_FRONT_RIGHT] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_FRONT] + side_neighbor_lut[Cube::SIDE_RIGHT];
-	corner_neighbor_lut[Cube::CORNER_BOTTOM_FRONT_LEFT] = side_neighbor_lut[Cube::SIDE_BOTTOM] + side_neighbor_lut[Cube::SIDE_FRONT] + side_neighbor_lut[Cube::SIDE_LEFT];
-	corner_neighbor_lut[Cube::CORNER_TOP_BACK_LEFT] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_BACK] + side_neighbor_lut[Cube::SIDE_LEFT];
-	corner_neighbor_lut[Cube::CORNER_TOP_BACK_RIGHT] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_BACK] + side_neighbor_lut[Cube::SIDE_RIGHT];
-	corner_neighbor_lut[Cube::CORNER_TOP_FRONT_RIGHT] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_FRONT] + side_neighbor_lut[Cube::SIDE_RIGHT];
-	corner_neighbor_lut[Cube::CORNER_TOP_FRONT_LEFT] = side_neighbor_lut[Cube::SIDE_TOP] + side_neighbor_lut[Cube::SIDE_FRONT] + side_neighbor_lut[Cube::SIDE_LEFT];
+	// In linear layout they are the same for all voxels.
+	// In bricks they depend on where the voxel is in its brick, so they are updated for each voxel that needs them.
+	const bool linear = buffer.get_layout() == VoxelBuffer::LAYOUT_LINEAR;
+	NeighborLuts luts;
+	if (linear) {
+		const int row_size = size.y;
+		const int deck_size = size.x * row_size;
+		luts.update(row_size, -row_size, -deck_size, deck_size, -1, 1);
+	}
 
 	//uint64_t time_prep = OS::get_singleton()->get_ticks_usec() - time_before;
 	//time_before = OS::get_singleton()->get_ticks_usec();
@@ -164,13 +141,21 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &bu
 			for (unsigned int y = min.y; y < max.y; ++y) {
 				// min and max are chosen such that you can visit 1 neighbor away from the current voxel without size check
 
-				// TODO In this intensive routine, there is a way to make voxel access fastest by getting a pointer to the channel,
-				// and using offset lookup to get neighbors rather than going through get_voxel validations
-				int voxel_index = y + x * row_size + z * deck_size;
+				int voxel_index = x_offsets[x] + y_offsets[y] + z_offsets[z];
 				int voxel_id = type_buffer[voxel_index];
 
 				if (voxel_id != 0 && library.has_voxel(voxel_id)) {
 
+					if (!linear) {
+						luts.update(
+								int(x_offsets[x + 1]) - int(x_offsets[x]),
+								int(x_offsets[x - 1]) - int(x_offsets[x]),
+								int(z_offsets[z - 1]) - int(z_offsets[z]),
+								int(z_offsets[z + 1]) - int(z_offsets[z]),
+								int(y_offsets[y - 1]) - int(y_offsets[y]),
+								int(y_offsets[y + 1]) - int(y_offsets[y]));
+					}
+
 					const Voxel &voxel = library.get_voxel_const(voxel_id);
 
 					Arrays &arrays = _arrays[voxel.get_material_id()];
@@ -186,7 +171,7 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &bu
 
 						if (vertex_count != 0) {
 
-							int neighbor_voxel_id = type_buffer[voxel_index + side_neighbor_lut[side]];
+							int neighbor_voxel_id = type_buffer[voxel_index + luts.sides[side]];
 
 							// TODO Better face visibility test
 							if (is_face_visible(library, voxel, neighbor_voxel_id)) {
@@ -201,7 +186,7 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &bu
 
 									for (unsigned int j = 0; j < 4; ++j) {
 										unsigned int edge = Cube::g_side_edges[side][j];
-										int edge_neighbor_id = type_buffer[voxel_index + edge_neighbor_lut[edge]];
+										int edge_neighbor_id = type_buffer[voxel_index + luts.edges[edge]];
 										if (!is_transparent(library, edge_neighbor_id)) {
 											shaded_corner[Cube::g_edge_corners[edge][0]] += 1;
 											shaded_corner[Cube::g_edge_corners[edge][1]] += 1;
@@ -212,7 +197,7 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &bu
 										if (shaded_corner[corner] == 2) {
 											shaded_corner[corner] = 3;
 										} else {
-											int corner_neigbor_id = type_buffer[voxel_index + corner_neighbor_lut[corner]];
+											int corner_neigbor_id = type_buffer[voxel_index + luts.corners[corner]];
 											if (!is_transparent(library, corner_neigbor_id)) {
 												shaded_corner[corner] += 1;
 											}
@@ -223,8 +208,8 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &bu
 								PoolVector<Vector3>::Read rv = positions.read();
 								PoolVector<Vector2>::Read rt = voxel.get_model_side_uv(side).read();
 
-								// Subtracting 1 because the data is padded
-								Vector3 pos(x - 1, y - 1, z - 1);
+								// Subtracting padding so the mesh starts at the origin
+								Vector3 pos(x - padding, y - padding, z - padding);
 
 								// Append vertices of the faces in one go, don't use push_back
 
@@ -312,7 +297,7 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &bu
 						PoolVector<Vector3>::Read rn = voxel.get_model_normals().read();
 						PoolVector<Vector2>::Read rt = voxel.get_model_uv().read();
 
-						Vector3 pos(x - 1, y - 1, z - 1);
+						Vector3 pos(x - padding, y - padding, z - padding);
 
 						for (unsigned int i = 0; i < vertex_count; ++i) {
 							arrays.normals.push_back(rn[i]);
@@ -339,6 +324,74 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &bu
 			}
 		}
 	}
+}
+
+void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelBuffer &buffer, int padding) {
+	//uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+
+	ERR_FAIL_COND(_library.is_null());
+	ERR_FAIL_COND(padding < MINIMUM_PADDING);
+
+	const int channel = VoxelBuffer::CHANNEL_TYPE;
+
+	for (unsigned int i = 0; i < MAX_MATERIALS; ++i) {
+		Arrays &a = _arrays[i];
+		a.positions.clear();
+		a.normals.clear();
+		a.uvs.clear();
+		a.colors.clear();
+		a.indices.clear();
+	}
+
+	// The technique is Culled faces.
+	// Could be improved with greedy meshing: https://0fps.net/2012/06/30/meshing-in-a-minecraft-game/
+	// However I don't feel it's worth it yet:
+	// - Not so much gain for organic worlds with lots of texture variations
+	// - Works well with cubes but not with any shape
+	// - Slower
+	// => Could be implemented in a separate class?
+
+	// Iterate 3D padded data to extract voxel faces.
+	// This is the most intensive job in this class, so all required data should be as fit as possible.
+
+	// The buffer we receive MUST be dense (i.e not compressed, and channels allocated).
+	// That means we can use raw pointers to voxel data inside instead of using the higher-level getters,
+	// and then save a lot of time.
+
+	ERR_FAIL_COND(buffer.get_channel_compression(channel) == VoxelBuffer::COMPRESSION_PALETTE);
+
+	const uint8_t *type_buffer = buffer.get_channel_raw(channel);
+	//       _
+	//      | \
+	//     /\ \\
+	//    / /|\\\
+	//    | |\ \\\
+	//    | \_\ \\|
+	//    |    |  )
+	//     \   |  |
+	//      \    /
+	if (type_buffer == nullptr) {
+		// No data to read, the channel is probably uniform
+		// TODO This is an invalid behavior IF sending a full block of uniformly opaque cubes,
+		// however not likely for terrains because with neighbor padding, such a case means no face would be generated anyways
+		return;
+	}
+
+	// Voxel types are read as they are stored, so the same code is generated for each channel depth
+	switch (buffer.get_channel_depth(channel)) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			build_internal(buffer, type_buffer, padding);
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			build_internal(buffer, reinterpret_cast<const uint16_t *>(type_buffer), padding);
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			build_internal(buffer, reinterpret_cast<const uint32_t *>(type_buffer), padding);
+			break;
+		default:
+			ERR_PRINT("Unsupported channel depth");
+			return;
+	}
 
 	//uint64_t time_meshing = OS::get_singleton()->get_ticks_usec() - time_before;
 	//time_before = OS::get_singleton()->get_ticks_usec();
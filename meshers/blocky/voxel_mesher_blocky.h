@@ -44,8 +44,13 @@ private:
 		std::vector<int> indices;
 	};
 
+	template <typename Type_T>
+	void build_internal(const VoxelBuffer &buffer, const Type_T *type_buffer, int padding);
+
 	Ref<VoxelLibrary> _library;
 	Arrays _arrays[MAX_MATERIALS];
+	// Per-axis parts of voxel indexes in the buffer being meshed, re-used between builds
+	std::vector<unsigned int> _index_offsets;
 	float _baked_occlusion_darkness;
 	bool _bake_occlusion;
 
@@ -2,7 +2,7 @@
 #define HERMITE_VALUE_H
 
 #include "../../util/utility.h"
-#include "../../voxel_buffer.h"
+#include "../voxel_isolevel_reader.h"
 #include <core/math/vector3.h>
 
 namespace dmc {
@@ -17,20 +17,21 @@ struct HermiteValue {
 	}
 };
 
-inline float get_isolevel_clamped(const VoxelBuffer &voxels, unsigned int x, unsigned int y, unsigned int z) {
+inline float get_isolevel_clamped(const VoxelIsolevelReader &voxels, unsigned int x, unsigned int y, unsigned int z) {
 
 	x = x >= voxels.get_size().x ? voxels.get_size().x - 1 : x;
 	y = y >= voxels.get_size().y ? voxels.get_size().y - 1 : y;
 	z = z >= voxels.get_size().z ? voxels.get_size().z - 1 : z;
 
-	return voxels.get_voxel(x, y, z, VoxelBuffer::CHANNEL_ISOLEVEL);
+	// Scaled so the gradient keeps the same magnitude as with raw 8-bit values, whatever the channel depth is
+	return 128.f * voxels(x, y, z);
 }
 
-inline HermiteValue get_hermite_value(const VoxelBuffer &voxels, unsigned int x, unsigned int y, unsigned int z) {
+inline HermiteValue get_hermite_value(const VoxelIsolevelReader &voxels, unsigned int x, unsigned int y, unsigned int z) {
 
 	HermiteValue v;
 
-	v.value = voxels.get_voxel_f(x, y, z, VoxelBuffer::CHANNEL_ISOLEVEL);
+	v.value = voxels(x, y, z);
 
 	Vector3 gradient;
 
@@ -43,7 +44,7 @@ inline HermiteValue get_hermite_value(const VoxelBuffer &voxels, unsigned int x,
 	return v;
 }
 
-inline HermiteValue get_interpolated_hermite_value(const VoxelBuffer &voxels, Vector3 pos) {
+inline HermiteValue get_interpolated_hermite_value(const VoxelIsolevelReader &voxels, Vector3 pos) {
 
 	int x0 = static_cast<int>(pos.x);
 	int y0 = static_cast<int>(pos.y);
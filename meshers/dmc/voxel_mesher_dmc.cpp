@@ -19,7 +19,7 @@ const float SQRT3 = 1.7320508075688772;
 // Helper to access padded voxel data
 struct VoxelAccess {
 
-	const VoxelBuffer &buffer;
+	const VoxelIsolevelReader buffer;
 	const Vector3i offset;
 
 	VoxelAccess(const VoxelBuffer &p_buffer, Vector3i p_offset) :
@@ -47,7 +47,6 @@ bool can_split(Vector3i node_origin, int node_size, const VoxelAccess &voxels, f
 
 	Vector3i origin = node_origin + voxels.offset;
 	int step = node_size;
-	int channel = VoxelBuffer::CHANNEL_ISOLEVEL;
 
 	// Don't split if nothing is inside, i.e isolevel distance is greater than the size of the cube we are in
 	Vector3i center_pos = node_origin + Vector3i(node_size / 2);
@@ -58,15 +57,15 @@ bool can_split(Vector3i node_origin, int node_size, const VoxelAccess &voxels, f
 
 	// Fighting with Clang-format here /**/
 
-	float v0 = voxels.buffer.get_voxel_f(origin.x, /*  */ origin.y, /*  */ origin.z, /*  */ channel); // 0
-	float v1 = voxels.buffer.get_voxel_f(origin.x + step, origin.y, /*  */ origin.z, /*  */ channel); // 1
-	float v2 = voxels.buffer.get_voxel_f(origin.x + step, origin.y, /*  */ origin.z + step, channel); // 2
-	float v3 = voxels.buffer.get_voxel_f(origin.x, /*  */ origin.y, /*  */ origin.z + step, channel); // 3
+	float v0 = voxels.buffer(origin.x, /*  */ origin.y, /*  */ origin.z); // 0
+	float v1 = voxels.buffer(origin.x + step, origin.y, /*  */ origin.z); // 1
+	float v2 = voxels.buffer(origin.x + step, origin.y, /*  */ origin.z + step); // 2
+	float v3 = voxels.buffer(origin.x, /*  */ origin.y, /*  */ origin.z + step); // 3
 
-	float v4 = voxels.buffer.get_voxel_f(origin.x, /*  */ origin.y + step, origin.z, /*  */ channel); // 4
-	float v5 = voxels.buffer.get_voxel_f(origin.x + step, origin.y + step, origin.z, /*  */ channel); // 5
-	float v6 = voxels.buffer.get_voxel_f(origin.x + step, origin.y + step, origin.z + step, channel); // 6
-	float v7 = voxels.buffer.get_voxel_f(origin.x, /*  */ origin.y + step, origin.z + step, channel); // 7
+	float v4 = voxels.buffer(origin.x, /*  */ origin.y + step, origin.z); // 4
+	float v5 = voxels.buffer(origin.x + step, origin.y + step, origin.z); // 5
+	float v6 = voxels.buffer(origin.x + step, origin.y + step, origin.z + step); // 6
+	float v7 = voxels.buffer(origin.x, /*  */ origin.y + step, origin.z + step); // 7
 
 	int hstep = step / 2;
 
@@ -1241,7 +1240,9 @@ inline void polygonize_dual_grid(const DualGrid &grid, const VoxelAccess &voxels
 	}
 }
 
-void polygonize_volume_directly(const VoxelBuffer &voxels, Vector3i min, Vector3i size, MeshBuilder &mesh_builder) {
+void polygonize_volume_directly(const VoxelBuffer &buffer, Vector3i min, Vector3i size, MeshBuilder &mesh_builder) {
+
+	const VoxelIsolevelReader voxels(buffer);
 
 	Vector3 corners[8];
 	HermiteValue values[8];
@@ -1,21 +1,14 @@
 
 #include "voxel_mesher_transvoxel.h"
+#include "../voxel_isolevel_reader.h"
 #include "transvoxel_tables.cpp"
 #include <core/os/os.h>
 
 namespace {
 
-inline float tof(int8_t v) {
-	return static_cast<float>(v) / 256.f;
-}
-
-inline int8_t tos(uint8_t v) {
-	return v - 128;
-}
-
 // Values considered negative have a sign bit of 1
-inline uint8_t sign(int8_t v) {
-	return (v >> 7) & 1;
+inline uint8_t sign(float v) {
+	return v < 0.f ? 1 : 0;
 }
 
 //
@@ -128,7 +121,21 @@ void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned i
 		return;
 	}
 
+	const VoxelBuffer::Depth depth = voxels.get_channel_depth(channel);
+	if (depth != VoxelBuffer::DEPTH_32_BIT) {
+		// Same if all isolevels are on the same side of the threshold.
+		// 32-bit isolevels are floats, which can't be compared as integers.
+		uint32_t min_raw;
+		uint32_t max_raw;
+		voxels.get_channel_min_max(channel, min_raw, max_raw);
+		const uint32_t zero_raw = VoxelBuffer::iso_to_raw(0.f, depth);
+		if (min_raw >= zero_raw || max_raw < zero_raw) {
+			return;
+		}
+	}
+
 	const Vector3i block_size = voxels.get_size();
+	const VoxelIsolevelReader sample(voxels, channel);
 	// TODO No lod yet, but it's planned
 	const int lod_index = 0;
 	const int lod_scale = 1 << lod_index;
@@ -151,16 +158,16 @@ void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned i
 
 				// Get the value of cells.
 				// Negative values are "solid" and positive are "air".
-				// Due to raw cells being unsigned 8-bit, they get converted to signed.
-				int8_t cell_samples[8] = {
-					tos(voxels.get_voxel(pos.x, pos.y, pos.z, channel)),
-					tos(voxels.get_voxel(pos.x + 1, pos.y, pos.z, channel)),
-					tos(voxels.get_voxel(pos.x, pos.y + 1, pos.z, channel)),
-					tos(voxels.get_voxel(pos.x + 1, pos.y + 1, pos.z, channel)),
-					tos(voxels.get_voxel(pos.x, pos.y, pos.z + 1, channel)),
-					tos(voxels.get_voxel(pos.x + 1, pos.y, pos.z + 1, channel)),
-					tos(voxels.get_voxel(pos.x, pos.y + 1, pos.z + 1, channel)),
-					tos(voxels.get_voxel(pos.x + 1, pos.y + 1, pos.z + 1, channel))
+				// Raw cells are unsigned, they get converted to signed isolevels whatever the channel depth is.
+				float cell_samples[8] = {
+					sample(pos.x, pos.y, pos.z),
+					sample(pos.x + 1, pos.y, pos.z),
+					sample(pos.x, pos.y + 1, pos.z),
+					sample(pos.x + 1, pos.y + 1, pos.z),
+					sample(pos.x, pos.y, pos.z + 1),
+					sample(pos.x + 1, pos.y, pos.z + 1),
+					sample(pos.x, pos.y + 1, pos.z + 1),
+					sample(pos.x + 1, pos.y + 1, pos.z + 1)
 				};
 
 				// Concatenate the sign of cell values to obtain the case code.
@@ -191,9 +198,9 @@ void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned i
 
 					Vector3i p = pos + g_corner_dirs[i];
 
-					float nx = tof(tos(voxels.get_voxel(p - Vector3i(1, 0, 0), channel))) - tof(tos(voxels.get_voxel(p + Vector3i(1, 0, 0), channel)));
-					float ny = tof(tos(voxels.get_voxel(p - Vector3i(0, 1, 0), channel))) - tof(tos(voxels.get_voxel(p + Vector3i(0, 1, 0), channel)));
-					float nz = tof(tos(voxels.get_voxel(p - Vector3i(0, 0, 1), channel))) - tof(tos(voxels.get_voxel(p + Vector3i(0, 0, 1), channel)));
+					float nx = sample(p - Vector3i(1, 0, 0)) - sample(p + Vector3i(1, 0, 0));
+					float ny = sample(p - Vector3i(0, 1, 0)) - sample(p + Vector3i(0, 1, 0));
+					float nz = sample(p - Vector3i(0, 0, 1)) - sample(p + Vector3i(0, 0, 1));
 
 					corner_normals[i] = Vector3(nx, ny, nz);
 					corner_normals[i].normalize();
@@ -231,8 +238,8 @@ void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned i
 					ERR_FAIL_COND(v1 <= v0);
 
 					// Get voxel values at the corners
-					int sample0 = cell_samples[v0]; // called d0 in the paper
-					int sample1 = cell_samples[v1]; // called d1 in the paper
+					float sample0 = cell_samples[v0]; // called d0 in the paper
+					float sample1 = cell_samples[v1]; // called d1 in the paper
 
 					// TODO Zero-division is not mentionned in the paper??
 					ERR_FAIL_COND(sample1 == sample0);
@@ -241,7 +248,7 @@ void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned i
 					// Get interpolation position
 					// We use an 8-bit fraction, allowing the new vertex to be located at one of 257 possible
 					// positions  along  the  edge  when  both  endpoints  are included.
-					int t = (sample1 << 8) / (sample1 - sample0);
+					int t = static_cast<int>(256.f * sample1 / (sample1 - sample0));
 
 					float t0 = static_cast<float>(t) / 256.f;
 					float t1 = static_cast<float>(0x0100 - t) / 256.f;
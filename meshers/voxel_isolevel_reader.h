@@ -0,0 +1,53 @@
+#ifndef VOXEL_ISOLEVEL_READER_H
+#define VOXEL_ISOLEVEL_READER_H
+
+#include "../voxel_buffer.h"
+
+// Reads isolevels directly from the channel array when it is dense,
+// instead of going through get_voxel_f() validations for every sample.
+// Indexes are sums of per-axis offsets, so the same code reads linear and brick layouts.
+class VoxelIsolevelReader {
+public:
+	VoxelIsolevelReader(const VoxelBuffer &voxels, unsigned int channel = VoxelBuffer::CHANNEL_ISOLEVEL) :
+			_voxels(voxels),
+			_data(voxels.get_channel_raw(channel)),
+			_depth(voxels.get_channel_depth(channel)),
+			_channel(channel) {
+
+		if (_data) {
+			const Vector3i size = voxels.get_size();
+			_offsets.resize(size.x + size.y + size.z);
+			unsigned int *w = _offsets.ptrw();
+			voxels.get_index_offsets(w, w + size.x, w + size.x + size.y);
+		}
+	}
+
+	// Positions outside the buffer give the default value, like get_voxel_f()
+	inline float operator()(int x, int y, int z) const {
+		if (_data && _voxels.validate_pos(x, y, z)) {
+			const Vector3i &size = _voxels.get_size();
+			const unsigned int *o = _offsets.ptr();
+			const unsigned int i = o[x] + o[size.x + y] + o[size.x + size.y + z];
+			return VoxelBuffer::raw_to_iso(VoxelBuffer::get_raw_value(_data, i, _depth), _depth);
+		}
+		return _voxels.get_voxel_f(x, y, z, _channel);
+	}
+
+	inline float operator()(Vector3i p) const {
+		return operator()(p.x, p.y, p.z);
+	}
+
+	inline const Vector3i &get_size() const {
+		return _voxels.get_size();
+	}
+
+private:
+	const VoxelBuffer &_voxels;
+	const uint8_t *_data;
+	VoxelBuffer::Depth _depth;
+	unsigned int _channel;
+	// X, then Y, then Z offsets, see VoxelBuffer::get_index_offsets()
+	Vector<unsigned int> _offsets;
+};
+
+#endif // VOXEL_ISOLEVEL_READER_H
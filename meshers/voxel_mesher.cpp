@@ -4,6 +4,13 @@ Ref<Mesh> VoxelMesher::build_mesh(Ref<VoxelBuffer> voxels) {
 
 	ERR_FAIL_COND_V(voxels.is_null(), Ref<ArrayMesh>());
 
+	// Meshers read raw channel data
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		if (voxels->get_channel_compression(i) == VoxelBuffer::COMPRESSION_PALETTE) {
+			voxels->decompress_channel(i);
+		}
+	}
+
 	Output output;
 	build(output, **voxels, get_minimum_padding());
 
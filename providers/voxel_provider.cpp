@@ -27,6 +27,33 @@ void VoxelProvider::immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_vo
 	}
 }
 
+void VoxelProvider::emerge_blocks(Vector<BlockRequest> &blocks) {
+	ScriptInstance *script = get_script_instance();
+	if (script && script->has_method("emerge_blocks")) {
+		// Call script to generate all buffers in one go
+		Array requests;
+		for (int i = 0; i < blocks.size(); ++i) {
+			Dictionary r;
+			r["voxels"] = blocks[i].voxels;
+			r["origin_in_voxels"] = blocks[i].origin_in_voxels.to_vec3();
+			requests.append(r);
+		}
+		Variant arg1 = requests;
+		const Variant *args[1] = { &arg1 };
+		script->call_multilevel("emerge_blocks", args, 1);
+		return;
+	}
+	for (int i = 0; i < blocks.size(); ++i) {
+		emerge_block(blocks[i].voxels, blocks[i].origin_in_voxels);
+	}
+}
+
+void VoxelProvider::immerge_blocks(Vector<BlockRequest> &blocks) {
+	for (int i = 0; i < blocks.size(); ++i) {
+		immerge_block(blocks[i].voxels, blocks[i].origin_in_voxels);
+	}
+}
+
 void VoxelProvider::_emerge_block(Ref<VoxelBuffer> out_buffer, Vector3 origin_in_voxels) {
 	emerge_block(out_buffer, Vector3i(origin_in_voxels));
 }
@@ -35,9 +62,24 @@ void VoxelProvider::_immerge_block(Ref<VoxelBuffer> buffer, Vector3 origin_in_vo
 	immerge_block(buffer, Vector3i(origin_in_voxels));
 }
 
+// Requests are dictionaries with "voxels" and "origin_in_voxels" keys
+void VoxelProvider::_emerge_blocks(Array requests) {
+	Vector<BlockRequest> blocks;
+	for (int i = 0; i < requests.size(); ++i) {
+		Dictionary d = requests[i];
+		BlockRequest r;
+		r.voxels = d["voxels"];
+		r.origin_in_voxels = Vector3i(Vector3(d["origin_in_voxels"]));
+		ERR_FAIL_COND(r.voxels.is_null());
+		blocks.push_back(r);
+	}
+	emerge_blocks(blocks);
+}
+
 void VoxelProvider::_bind_methods() {
 	// Note: C++ inheriting classes don't need to re-bind these, because they are bindings that call the actual virtual methods
 
 	ClassDB::bind_method(D_METHOD("emerge_block", "out_buffer", "origin_in_voxels"), &VoxelProvider::_emerge_block);
 	ClassDB::bind_method(D_METHOD("immerge_block", "buffer", "origin_in_voxels"), &VoxelProvider::_immerge_block);
+	ClassDB::bind_method(D_METHOD("emerge_blocks", "requests"), &VoxelProvider::_emerge_blocks);
 }
@@ -7,14 +7,33 @@
 class VoxelProvider : public Resource {
 	GDCLASS(VoxelProvider, Resource)
 public:
+	struct BlockRequest {
+		Ref<VoxelBuffer> voxels;
+		Vector3i origin_in_voxels;
+	};
+
 	virtual void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels);
 	virtual void immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels);
 
+	// Loads several blocks at once, so providers can share setup work between them.
+	// The default implementation loads them one by one.
+	virtual void emerge_blocks(Vector<BlockRequest> &blocks);
+
+	// Saves several blocks at once, which providers can order or group as they like.
+	// The default implementation saves them one by one.
+	// Note: saving happens on a different thread than loading. Both only run at the same time if the provider is thread-safe.
+	virtual void immerge_blocks(Vector<BlockRequest> &blocks);
+
+	// If true, blocks can be loaded and saved by several threads at the same time.
+	// False by default, as scripts can't be assumed to be.
+	virtual bool is_thread_safe() const { return false; }
+
 protected:
 	static void _bind_methods();
 
 	void _emerge_block(Ref<VoxelBuffer> out_buffer, Vector3 origin_in_voxels);
 	void _immerge_block(Ref<VoxelBuffer> buffer, Vector3 origin_in_voxels);
+	void _emerge_blocks(Array requests);
 };
 
 #endif // VOXEL_PROVIDER_H
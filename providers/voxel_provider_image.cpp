@@ -42,15 +42,33 @@ inline float get_height_blurred(Image &im, int x, int y) {
 } // namespace
 
 void VoxelProviderImage::emerge_block(Ref<VoxelBuffer> p_out_buffer, Vector3i origin_in_voxels) {
-
-	int ox = origin_in_voxels.x;
-	int oy = origin_in_voxels.y;
-	int oz = origin_in_voxels.z;
+	ERR_FAIL_COND(_image.is_null());
+	ERR_FAIL_COND(p_out_buffer.is_null());
 
 	Image &image = **_image;
-	VoxelBuffer &out_buffer = **p_out_buffer;
+	image.lock();
+	generate_block(image, **p_out_buffer, origin_in_voxels);
+	image.unlock();
+}
+
+void VoxelProviderImage::emerge_blocks(Vector<BlockRequest> &blocks) {
+	ERR_FAIL_COND(_image.is_null());
 
+	Image &image = **_image;
 	image.lock();
+	for (int i = 0; i < blocks.size(); ++i) {
+		const BlockRequest &r = blocks[i];
+		ERR_CONTINUE(r.voxels.is_null());
+		generate_block(image, **r.voxels, r.origin_in_voxels);
+	}
+	image.unlock();
+}
+
+void VoxelProviderImage::generate_block(Image &image, VoxelBuffer &out_buffer, Vector3i origin_in_voxels) {
+
+	int ox = origin_in_voxels.x;
+	int oy = origin_in_voxels.y;
+	int oz = origin_in_voxels.z;
 
 	int x = 0;
 	int z = 0;
@@ -87,8 +105,6 @@ void VoxelProviderImage::emerge_block(Ref<VoxelBuffer> p_out_buffer, Vector3i or
 		z += 1;
 		x = 0;
 	}
-
-	image.unlock();
 }
 
 void VoxelProviderImage::_bind_methods() {
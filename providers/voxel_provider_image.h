@@ -5,7 +5,8 @@
 #include <core/image.h>
 
 // TODO Rename VoxelProviderHeightmap
-// Provides infinite tiling heightmap based on an image
+// Provides infinite tiling heightmap based on an image.
+// Not thread-safe, because locking an Image isn't.
 class VoxelProviderImage : public VoxelProvider {
 	GDCLASS(VoxelProviderImage, VoxelProvider)
 public:
@@ -18,8 +19,12 @@ public:
 	int get_channel() const;
 
 	void emerge_block(Ref<VoxelBuffer> p_out_buffer, Vector3i origin_in_voxels);
+	// Locks the image only once for all blocks
+	void emerge_blocks(Vector<BlockRequest> &blocks);
 
 private:
+	void generate_block(Image &image, VoxelBuffer &out_buffer, Vector3i origin_in_voxels);
+
 	static void _bind_methods();
 
 private:
@@ -0,0 +1,602 @@
+#include "voxel_provider_region_files.h"
+
+#include <core/io/marshalls.h>
+#include <core/sort.h>
+#include <core/os/dir_access.h>
+
+#ifdef UNIX_ENABLED
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char *REGION_FORMAT_MAGIC = "VXR_";
+const uint8_t REGION_FORMAT_VERSION = 1;
+// Magic, version, block size, region size and one padding byte
+const unsigned int REGION_HEADER_SIZE = 8;
+// Set in the sector count of the block table if the block data is not compressed
+const uint32_t BLOCK_UNCOMPRESSED_FLAG = 1u << 31;
+
+bool are_all_channels_uniform(const VoxelBuffer &buffer) {
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		if (buffer.get_channel_compression(i) != VoxelBuffer::COMPRESSION_UNIFORM) {
+			return false;
+		}
+	}
+	return true;
+}
+
+} // namespace
+
+VoxelProviderRegionFiles::VoxelProviderRegionFiles() :
+		_block_size_pow2(0),
+		_use_counter(0) {
+	_mutex = Mutex::create();
+	_generator_mutex = Mutex::create();
+}
+
+VoxelProviderRegionFiles::~VoxelProviderRegionFiles() {
+	close_all_regions();
+	memdelete(_mutex);
+	memdelete(_generator_mutex);
+}
+
+void VoxelProviderRegionFiles::set_directory(String dirpath) {
+	MutexLock lock(_mutex);
+	if (_directory != dirpath) {
+		close_all_regions();
+		_directory = dirpath;
+	}
+}
+
+String VoxelProviderRegionFiles::get_directory() const {
+	return _directory;
+}
+
+void VoxelProviderRegionFiles::set_generator(Ref<VoxelProvider> generator) {
+	ERR_FAIL_COND(generator.ptr() == this);
+	MutexLock lock(_mutex);
+	_generator = generator;
+}
+
+Ref<VoxelProvider> VoxelProviderRegionFiles::get_generator() const {
+	return _generator;
+}
+
+bool VoxelProviderRegionFiles::is_thread_safe() const {
+	return true;
+}
+
+void VoxelProviderRegionFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels) {
+	ERR_FAIL_COND(out_buffer.is_null());
+
+	bool found;
+	Ref<VoxelProvider> generator;
+	{
+		MutexLock lock(_mutex);
+		found = load_saved_block(**out_buffer, origin_in_voxels);
+		generator = _generator;
+	}
+
+	// Generate blocks that were never saved, outside of the lock as it can be slow
+	if (!found && generator.is_valid()) {
+		if (generator->is_thread_safe()) {
+			generator->emerge_block(out_buffer, origin_in_voxels);
+		} else {
+			MutexLock lock(_generator_mutex);
+			generator->emerge_block(out_buffer, origin_in_voxels);
+		}
+	}
+}
+
+void VoxelProviderRegionFiles::emerge_blocks(Vector<BlockRequest> &blocks) {
+
+	Vector<BlockRequest> blocks_to_generate;
+	Ref<VoxelProvider> generator;
+
+	{
+		MutexLock lock(_mutex);
+		generator = _generator;
+		for (int i = 0; i < blocks.size(); ++i) {
+			const BlockRequest &r = blocks[i];
+			ERR_CONTINUE(r.voxels.is_null());
+			if (!load_saved_block(**r.voxels, r.origin_in_voxels)) {
+				blocks_to_generate.push_back(r);
+			}
+		}
+	}
+
+	// The generator gets the remaining blocks in one batch too
+	if (blocks_to_generate.size() != 0 && generator.is_valid()) {
+		if (generator->is_thread_safe()) {
+			generator->emerge_blocks(blocks_to_generate);
+		} else {
+			MutexLock lock(_generator_mutex);
+			generator->emerge_blocks(blocks_to_generate);
+		}
+	}
+}
+
+bool VoxelProviderRegionFiles::load_saved_block(VoxelBuffer &out_buffer, Vector3i origin_in_voxels) {
+
+	unsigned int block_size_pow2;
+	if (_directory.empty() || !get_block_size_pow2(out_buffer, block_size_pow2)) {
+		return false;
+	}
+
+	const Vector3i bpos(
+			origin_in_voxels.x >> block_size_pow2,
+			origin_in_voxels.y >> block_size_pow2,
+			origin_in_voxels.z >> block_size_pow2);
+
+	Region *region = get_region(get_region_position(bpos), false);
+	if (region == NULL) {
+		return false;
+	}
+
+	const BlockLocation &loc = region->blocks[get_block_index_in_region(bpos)];
+	if (loc.sector_count == 0) {
+		return false;
+	}
+
+	return load_block(*region, loc, out_buffer);
+}
+
+void VoxelProviderRegionFiles::immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels) {
+	ERR_FAIL_COND(buffer.is_null());
+
+	MutexLock lock(_mutex);
+
+	ERR_FAIL_COND(_directory.empty());
+
+	unsigned int block_size_pow2;
+	if (!get_block_size_pow2(**buffer, block_size_pow2)) {
+		return;
+	}
+
+	const Vector3i bpos(
+			origin_in_voxels.x >> block_size_pow2,
+			origin_in_voxels.y >> block_size_pow2,
+			origin_in_voxels.z >> block_size_pow2);
+
+	Region *region = save_block(**buffer, bpos);
+	if (region != NULL) {
+		region->file->flush();
+	}
+}
+
+namespace {
+
+struct BlockToSave {
+	Vector3i block_pos;
+	Vector3i region_pos;
+	unsigned int block_index; // In the region
+	int request_index;
+};
+
+// Groups blocks by region, and orders them like in the block table
+struct BlockToSaveComparator {
+	inline bool operator()(const BlockToSave &a, const BlockToSave &b) const {
+		if (a.region_pos.z != b.region_pos.z) {
+			return a.region_pos.z < b.region_pos.z;
+		}
+		if (a.region_pos.x != b.region_pos.x) {
+			return a.region_pos.x < b.region_pos.x;
+		}
+		if (a.region_pos.y != b.region_pos.y) {
+			return a.region_pos.y < b.region_pos.y;
+		}
+		return a.block_index < b.block_index;
+	}
+};
+
+} // namespace
+
+void VoxelProviderRegionFiles::immerge_blocks(Vector<BlockRequest> &blocks) {
+
+	MutexLock lock(_mutex);
+
+	ERR_FAIL_COND(_directory.empty());
+
+	Vector<BlockToSave> to_save;
+
+	for (int i = 0; i < blocks.size(); ++i) {
+		const BlockRequest &r = blocks[i];
+		ERR_CONTINUE(r.voxels.is_null());
+
+		unsigned int block_size_pow2;
+		if (!get_block_size_pow2(**r.voxels, block_size_pow2)) {
+			continue;
+		}
+
+		BlockToSave b;
+		b.block_pos = Vector3i(
+				r.origin_in_voxels.x >> block_size_pow2,
+				r.origin_in_voxels.y >> block_size_pow2,
+				r.origin_in_voxels.z >> block_size_pow2);
+		b.region_pos = get_region_position(b.block_pos);
+		b.block_index = get_block_index_in_region(b.block_pos);
+		b.request_index = i;
+		to_save.push_back(b);
+	}
+
+	SortArray<BlockToSave, BlockToSaveComparator> sorter;
+	sorter.sort(to_save.ptrw(), to_save.size());
+
+	// Each region file gets flushed once, after all its blocks are written
+	for (int i = 0; i < to_save.size(); ++i) {
+		const BlockToSave &b = to_save[i];
+		Region *region = save_block(**blocks[b.request_index].voxels, b.block_pos);
+
+		const bool last_of_region = i + 1 == to_save.size() || to_save[i + 1].region_pos != b.region_pos;
+		if (region != NULL && last_of_region) {
+			region->file->flush();
+		}
+	}
+}
+
+VoxelProviderRegionFiles::Region *VoxelProviderRegionFiles::save_block(const VoxelBuffer &voxels, Vector3i bpos) {
+
+	Region *region = get_region(get_region_position(bpos), true);
+	ERR_FAIL_COND_V(region == NULL, NULL);
+
+	const bool compressed = !are_all_channels_uniform(voxels);
+	if (compressed) {
+		_serializer.serialize_and_compress(voxels, _data);
+	} else {
+		_serializer.serialize(voxels, _data);
+	}
+
+	const uint32_t size = _data.size();
+	const uint32_t sector_count = (size + 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+	const unsigned int block_index = get_block_index_in_region(bpos);
+	BlockLocation &loc = region->blocks[block_index];
+
+	if (loc.sector_count != sector_count) {
+		// Free previous sectors, which could then be re-used by this block if they precede free ones
+		for (uint32_t i = 0; i < loc.sector_count; ++i) {
+			region->sectors_used.write[loc.sector_index + i] = 0;
+		}
+		loc.sector_index = allocate_sectors(*region, sector_count);
+		loc.sector_count = sector_count;
+	}
+	loc.compressed = compressed;
+
+	// The mapping would not see data still buffered by the file, and may not cover its new size
+	unmap_region(*region);
+
+	FileAccess *f = region->file;
+
+	f->seek(loc.sector_index * SECTOR_SIZE);
+	f->store_32(size);
+	f->store_buffer(_data.ptr(), size);
+
+	// Update the table only after the data is written
+	f->seek(REGION_HEADER_SIZE + block_index * 8);
+	f->store_32(loc.sector_index);
+	f->store_32(loc.sector_count | (compressed ? 0 : BLOCK_UNCOMPRESSED_FLAG));
+
+	return region;
+}
+
+bool VoxelProviderRegionFiles::load_block(Region &region, const BlockLocation &loc, VoxelBuffer &out_buffer) {
+
+	const uint64_t offset = (uint64_t)loc.sector_index * SECTOR_SIZE;
+	const uint8_t *data;
+	uint32_t size;
+
+	if (map_region(region)) {
+		// Data is decompressed directly from the mapping, without copying it first
+		ERR_FAIL_COND_V(offset + 4 > region.mapped_size, false);
+		size = decode_uint32(region.mapped_data + offset);
+		ERR_FAIL_COND_V(size + 4 > loc.sector_count * SECTOR_SIZE, false);
+		ERR_FAIL_COND_V(offset + 4 + size > region.mapped_size, false);
+		data = region.mapped_data + offset + 4;
+
+	} else {
+		FileAccess *f = region.file;
+		f->seek(offset);
+		size = f->get_32();
+		ERR_FAIL_COND_V(size + 4 > loc.sector_count * SECTOR_SIZE, false);
+		_data.resize(size);
+		ERR_FAIL_COND_V(f->get_buffer(_data.ptrw(), size) != (int)size, false);
+		data = _data.ptr();
+	}
+
+	if (loc.compressed) {
+		return _serializer.decompress_and_deserialize(data, size, out_buffer);
+	} else {
+		// Only uniform channels, so this just reads their values
+		return _serializer.deserialize(data, size, out_buffer);
+	}
+}
+
+bool VoxelProviderRegionFiles::map_region(Region &region) {
+
+	if (region.mapped_data != NULL) {
+		return true;
+	}
+	if (region.map_failed) {
+		return false;
+	}
+
+#ifdef UNIX_ENABLED
+	const String path = region.file->get_path_absolute();
+	const int fd = path.empty() ? -1 : ::open(path.utf8().get_data(), O_RDONLY);
+	if (fd != -1) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED) {
+				region.mapped_data = (const uint8_t *)p;
+				region.mapped_size = st.st_size;
+			}
+		}
+		// The mapping stays valid after the descriptor is closed
+		::close(fd);
+	}
+#endif
+
+	if (region.mapped_data == NULL) {
+		// Don't try again, buffered reads will be used for this region
+		region.map_failed = true;
+		return false;
+	}
+	return true;
+}
+
+void VoxelProviderRegionFiles::unmap_region(Region &region) {
+#ifdef UNIX_ENABLED
+	if (region.mapped_data != NULL) {
+		munmap((void *)region.mapped_data, region.mapped_size);
+	}
+#endif
+	region.mapped_data = NULL;
+	region.mapped_size = 0;
+}
+
+unsigned int VoxelProviderRegionFiles::get_header_sector_count() {
+	return (REGION_HEADER_SIZE + BLOCKS_PER_REGION * 8 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+Vector3i VoxelProviderRegionFiles::get_region_position(Vector3i bpos) {
+	return Vector3i(
+			bpos.x >> REGION_SIZE_POW2,
+			bpos.y >> REGION_SIZE_POW2,
+			bpos.z >> REGION_SIZE_POW2);
+}
+
+unsigned int VoxelProviderRegionFiles::get_block_index_in_region(Vector3i bpos) {
+	const unsigned int mask = REGION_SIZE - 1;
+	return (bpos.y & mask) + REGION_SIZE * ((bpos.x & mask) + REGION_SIZE * (bpos.z & mask));
+}
+
+uint32_t VoxelProviderRegionFiles::allocate_sectors(Region &region, uint32_t count) {
+
+	// First fit among free sectors
+	uint32_t run_begin = 0;
+	uint32_t run_size = 0;
+	for (int i = 0; i < region.sectors_used.size(); ++i) {
+		if (region.sectors_used[i]) {
+			run_size = 0;
+			continue;
+		}
+		if (run_size == 0) {
+			run_begin = i;
+		}
+		++run_size;
+		if (run_size == count) {
+			break;
+		}
+	}
+
+	if (run_size < count) {
+		// Append at the end of the file. A free run touching the end is extended.
+		if (run_size != 0 && run_begin + run_size != (uint32_t)region.sectors_used.size()) {
+			run_size = 0;
+		}
+		if (run_size == 0) {
+			run_begin = region.sectors_used.size();
+		}
+		region.sectors_used.resize(run_begin + count);
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		region.sectors_used.write[run_begin + i] = 1;
+	}
+
+	return run_begin;
+}
+
+bool VoxelProviderRegionFiles::get_block_size_pow2(const VoxelBuffer &buffer, unsigned int &out_pow2) {
+
+	const Vector3i size = buffer.get_size();
+	ERR_FAIL_COND_V(size.x != size.y || size.x != size.z, false);
+	ERR_FAIL_COND_V(size.x <= 0 || (size.x & (size.x - 1)) != 0, false);
+
+	unsigned int pow2 = 0;
+	while ((1 << pow2) < size.x) {
+		++pow2;
+	}
+
+	// All blocks of a world have the same size, this is also checked against region files when they are opened
+	if (_block_size_pow2 == 0) {
+		_block_size_pow2 = pow2;
+	} else {
+		ERR_FAIL_COND_V(pow2 != _block_size_pow2, false);
+	}
+
+	out_pow2 = pow2;
+	return true;
+}
+
+String VoxelProviderRegionFiles::get_region_file_path(Vector3i rpos) const {
+	return _directory.plus_file("r." + itos(rpos.x) + "." + itos(rpos.y) + "." + itos(rpos.z) + ".vxr");
+}
+
+VoxelProviderRegionFiles::Region *VoxelProviderRegionFiles::get_region(Vector3i rpos, bool create_if_not_found) {
+
+	Region **rptr = _regions.getptr(rpos);
+	if (rptr != NULL) {
+		(*rptr)->last_use = ++_use_counter;
+		return *rptr;
+	}
+
+	if (_regions.size() >= MAX_OPEN_REGIONS) {
+		// Close the least recently used region
+		const Vector3i *key = NULL;
+		const Vector3i *lru_key = NULL;
+		uint32_t lru_use = 0;
+		while ((key = _regions.next(key))) {
+			const Region *region = _regions.get(*key);
+			if (lru_key == NULL || region->last_use < lru_use) {
+				lru_key = key;
+				lru_use = region->last_use;
+			}
+		}
+		const Vector3i lru_pos = *lru_key;
+		close_region(_regions.get(lru_pos));
+		_regions.erase(lru_pos);
+	}
+
+	Region *region = open_region(rpos, create_if_not_found);
+	if (region != NULL) {
+		region->last_use = ++_use_counter;
+		_regions.set(rpos, region);
+	}
+	return region;
+}
+
+VoxelProviderRegionFiles::Region *VoxelProviderRegionFiles::open_region(Vector3i rpos, bool create_if_not_found) {
+
+	const String fpath = get_region_file_path(rpos);
+
+	if (!FileAccess::exists(fpath)) {
+		if (!create_if_not_found) {
+			return NULL;
+		}
+
+		DirAccess *da = DirAccess::create(DirAccess::ACCESS_FILESYSTEM);
+		Error dir_err = da->make_dir_recursive(_directory);
+		memdelete(da);
+		ERR_FAIL_COND_V(dir_err != OK && dir_err != ERR_ALREADY_EXISTS, NULL);
+
+		Error err;
+		FileAccess *f = FileAccess::open(fpath, FileAccess::WRITE, &err);
+		ERR_FAIL_COND_V(f == NULL, NULL);
+
+		// Header followed by an empty block table
+		f->store_buffer((const uint8_t *)REGION_FORMAT_MAGIC, 4);
+		f->store_8(REGION_FORMAT_VERSION);
+		f->store_8(_block_size_pow2);
+		f->store_8(REGION_SIZE_POW2);
+		f->store_8(0);
+		for (unsigned int i = 0; i < BLOCKS_PER_REGION; ++i) {
+			f->store_32(0);
+			f->store_32(0);
+		}
+
+		f->close();
+		memdelete(f);
+	}
+
+	Error err;
+	FileAccess *f = FileAccess::open(fpath, FileAccess::READ_WRITE, &err);
+	ERR_FAIL_COND_V(f == NULL, NULL);
+
+	uint8_t magic[4];
+	f->get_buffer(magic, 4);
+	const uint8_t version = f->get_8();
+	const uint8_t block_size_pow2 = f->get_8();
+	const uint8_t region_size_pow2 = f->get_8();
+	f->get_8();
+
+	if (memcmp(magic, REGION_FORMAT_MAGIC, 4) != 0 || version != REGION_FORMAT_VERSION || region_size_pow2 != REGION_SIZE_POW2) {
+		ERR_PRINTS("Region file has an unsupported format: " + fpath);
+		memdelete(f);
+		return NULL;
+	}
+	if (block_size_pow2 != _block_size_pow2) {
+		ERR_PRINTS("Region file has a different block size: " + fpath);
+		memdelete(f);
+		return NULL;
+	}
+
+	Region *region = memnew(Region);
+	region->file = f;
+	region->mapped_data = NULL;
+	region->mapped_size = 0;
+	region->map_failed = false;
+	region->sectors_used.resize(get_header_sector_count());
+	for (int i = 0; i < region->sectors_used.size(); ++i) {
+		region->sectors_used.write[i] = 1;
+	}
+
+	const uint64_t file_len = f->get_len();
+
+	for (unsigned int i = 0; i < BLOCKS_PER_REGION; ++i) {
+		BlockLocation &loc = region->blocks[i];
+		loc.sector_index = f->get_32();
+		loc.sector_count = f->get_32();
+		loc.compressed = (loc.sector_count & BLOCK_UNCOMPRESSED_FLAG) == 0;
+		loc.sector_count &= ~BLOCK_UNCOMPRESSED_FLAG;
+
+		if (loc.sector_count == 0) {
+			continue;
+		}
+		const uint32_t end = loc.sector_index + loc.sector_count;
+		if (loc.sector_index < get_header_sector_count() || (uint64_t)(end - 1) * SECTOR_SIZE >= file_len) {
+			ERR_PRINTS("Block with invalid location found in region file, ignoring it: " + fpath);
+			loc.sector_count = 0;
+			continue;
+		}
+		if ((uint32_t)region->sectors_used.size() < end) {
+			const int prev_size = region->sectors_used.size();
+			region->sectors_used.resize(end);
+			for (uint32_t j = prev_size; j < end; ++j) {
+				region->sectors_used.write[j] = 0;
+			}
+		}
+		for (uint32_t j = loc.sector_index; j < end; ++j) {
+			region->sectors_used.write[j] = 1;
+		}
+	}
+
+	return region;
+}
+
+void VoxelProviderRegionFiles::close_region(Region *region) {
+	unmap_region(*region);
+	if (region->file != NULL) {
+		region->file->close();
+		memdelete(region->file);
+	}
+	memdelete(region);
+}
+
+void VoxelProviderRegionFiles::close_all_regions() {
+	MutexLock lock(_mutex);
+	const Vector3i *key = NULL;
+	while ((key = _regions.next(key))) {
+		close_region(_regions.get(*key));
+	}
+	_regions.clear();
+}
+
+void VoxelProviderRegionFiles::_bind_methods() {
+
+	ClassDB::bind_method(D_METHOD("set_directory", "directory"), &VoxelProviderRegionFiles::set_directory);
+	ClassDB::bind_method(D_METHOD("get_directory"), &VoxelProviderRegionFiles::get_directory);
+
+	ClassDB::bind_method(D_METHOD("set_generator", "generator"), &VoxelProviderRegionFiles::set_generator);
+	ClassDB::bind_method(D_METHOD("get_generator"), &VoxelProviderRegionFiles::get_generator);
+
+	ClassDB::bind_method(D_METHOD("close_all_regions"), &VoxelProviderRegionFiles::close_all_regions);
+
+	ADD_PROPERTY(PropertyInfo(Variant::STRING, "directory", PROPERTY_HINT_DIR), "set_directory", "get_directory");
+	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "generator", PROPERTY_HINT_RESOURCE_TYPE, "VoxelProvider"), "set_generator", "get_generator");
+}
@@ -0,0 +1,101 @@
+#ifndef VOXEL_PROVIDER_REGION_FILES_H
+#define VOXEL_PROVIDER_REGION_FILES_H
+
+#include "../voxel_block_serializer.h"
+#include "voxel_provider.h"
+
+#include <core/hash_map.h>
+#include <core/os/file_access.h>
+#include <core/os/mutex.h>
+
+// Loads and saves blocks in region files, each containing a cube of blocks.
+// A region file starts with a table giving the location of every block it contains, so they can be found directly.
+// Block data is compressed and stored in fixed-size sectors, which get re-used when blocks are saved again.
+// Blocks that were never saved are obtained from the generator, if any.
+// Where supported, region files are memory-mapped for reading, so loading a block doesn't need read calls.
+class VoxelProviderRegionFiles : public VoxelProvider {
+	GDCLASS(VoxelProviderRegionFiles, VoxelProvider)
+public:
+	static const unsigned int REGION_SIZE_POW2 = 4;
+	static const unsigned int REGION_SIZE = 1 << REGION_SIZE_POW2;
+	static const unsigned int BLOCKS_PER_REGION = REGION_SIZE * REGION_SIZE * REGION_SIZE;
+	static const unsigned int SECTOR_SIZE = 512;
+	static const unsigned int MAX_OPEN_REGIONS = 32;
+
+	VoxelProviderRegionFiles();
+	~VoxelProviderRegionFiles();
+
+	void set_directory(String dirpath);
+	String get_directory() const;
+
+	void set_generator(Ref<VoxelProvider> generator);
+	Ref<VoxelProvider> get_generator() const;
+
+	void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels);
+	void emerge_blocks(Vector<BlockRequest> &blocks);
+	void immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels);
+	void immerge_blocks(Vector<BlockRequest> &blocks);
+	// File access is locked, and so are calls to generators that are not thread-safe.
+	// That doesn't depend on the generator, which can be changed at any time.
+	bool is_thread_safe() const;
+
+	// Closes region files, they will be re-opened when needed
+	void close_all_regions();
+
+private:
+	struct BlockLocation {
+		uint32_t sector_index;
+		uint32_t sector_count; // 0 if the block is not in the region
+		// Blocks where all channels are uniform are tiny, and are stored as-is to skip decompression
+		bool compressed;
+	};
+
+	struct Region {
+		FileAccess *file;
+		// Read-only view of the file, null if not mapped yet. Gets unmapped when the file is written to.
+		const uint8_t *mapped_data;
+		uint64_t mapped_size;
+		bool map_failed;
+		BlockLocation blocks[BLOCKS_PER_REGION];
+		// One entry per sector of the file, 1 if a block uses it
+		Vector<uint8_t> sectors_used;
+		uint32_t last_use;
+	};
+
+	static void _bind_methods();
+
+	Region *get_region(Vector3i rpos, bool create_if_not_found);
+	Region *open_region(Vector3i rpos, bool create_if_not_found);
+	void close_region(Region *region);
+	// Returns false if the block was never saved
+	bool load_saved_block(VoxelBuffer &out_buffer, Vector3i origin_in_voxels);
+	bool load_block(Region &region, const BlockLocation &loc, VoxelBuffer &out_buffer);
+	// Writes the block without flushing the file, returns the region it went to
+	Region *save_block(const VoxelBuffer &voxels, Vector3i bpos);
+	String get_region_file_path(Vector3i rpos) const;
+	bool get_block_size_pow2(const VoxelBuffer &buffer, unsigned int &out_pow2);
+
+	static unsigned int get_header_sector_count();
+	static Vector3i get_region_position(Vector3i bpos);
+	static unsigned int get_block_index_in_region(Vector3i bpos);
+	static uint32_t allocate_sectors(Region &region, uint32_t count);
+	static bool map_region(Region &region);
+	static void unmap_region(Region &region);
+
+private:
+	String _directory;
+	Ref<VoxelProvider> _generator;
+
+	unsigned int _block_size_pow2;
+	HashMap<Vector3i, Region *, Vector3iHasher> _regions;
+	uint32_t _use_counter;
+	VoxelBlockSerializer _serializer;
+	Vector<uint8_t> _data;
+
+	// Emerge and immerge get called from the provider thread, while properties are set from the main thread
+	Mutex *_mutex;
+	// Generators that are not thread-safe are only used by one thread at a time
+	Mutex *_generator_mutex;
+};
+
+#endif // VOXEL_PROVIDER_REGION_FILES_H
@@ -15,6 +15,8 @@ public:
 	VoxelProviderTest();
 
 	virtual void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin);
+	// Generation only reads properties
+	bool is_thread_safe() const { return true; }
 
 	void set_mode(Mode mode);
 	Mode get_mode() const { return _mode; }
@@ -3,19 +3,25 @@
 #include "meshers/dmc/voxel_mesher_dmc.h"
 #include "meshers/transvoxel/voxel_mesher_transvoxel.h"
 #include "providers/voxel_provider_image.h"
+#include "providers/voxel_provider_region_files.h"
 #include "providers/voxel_provider_test.h"
 #include "terrain/voxel_box_mover.h"
+#include "terrain/voxel_lod_map.h"
 #include "terrain/voxel_map.h"
 #include "terrain/voxel_terrain.h"
 #include "voxel_buffer.h"
 #include "voxel_isosurface_tool.h"
 #include "voxel_library.h"
+#include "voxel_memory_pool.h"
 
 void register_voxel_types() {
 
+	VoxelMemoryPool::create_singleton();
+
 	// Storage
 	ClassDB::register_class<VoxelBuffer>();
 	ClassDB::register_class<VoxelMap>();
+	ClassDB::register_class<VoxelLodMap>();
 
 	// Voxel types
 	ClassDB::register_class<Voxel>();
@@ -28,6 +34,7 @@ void register_voxel_types() {
 	ClassDB::register_class<VoxelProvider>();
 	ClassDB::register_class<VoxelProviderTest>();
 	ClassDB::register_class<VoxelProviderImage>();
+	ClassDB::register_class<VoxelProviderRegionFiles>();
 
 	// Helpers
 	ClassDB::register_class<VoxelBoxMover>();
@@ -41,4 +48,5 @@ void register_voxel_types() {
 }
 
 void unregister_voxel_types() {
+	VoxelMemoryPool::destroy_singleton();
 }
@@ -17,16 +17,36 @@ VoxelBlock *VoxelBlock::create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned
 
 VoxelBlock::VoxelBlock() :
 		voxels(NULL),
-		_mesh_update_count(0) {
+		last_access_frame(0),
+		data_version(0),
+		modified(false),
+		_mesh_update_count(0),
+		_mesh_memory_usage(0) {
+}
 
-	VisualServer &vs = *VisualServer::get_singleton();
+VoxelBlock::~VoxelBlock() {
 
+	// Blocks get removed when unloaded, the instance would remain in the scenario otherwise
 	if (_mesh_instance.is_valid()) {
+		VisualServer &vs = *VisualServer::get_singleton();
 		vs.free(_mesh_instance);
 		_mesh_instance = RID();
 	}
 }
 
+// Meshes built by this module have positions, normals, colors and UVs, and 32-bit indices
+static const uint32_t MESH_VERTEX_SIZE = 3 * 4 + 3 * 4 + 4 * 4 + 2 * 4;
+static const uint32_t MESH_INDEX_SIZE = 4;
+
+static uint32_t estimate_mesh_memory_usage(const Mesh &mesh) {
+	uint32_t size = 0;
+	for (int i = 0; i < mesh.get_surface_count(); ++i) {
+		size += mesh.surface_get_array_len(i) * MESH_VERTEX_SIZE;
+		size += mesh.surface_get_array_index_len(i) * MESH_INDEX_SIZE;
+	}
+	return size;
+}
+
 void VoxelBlock::set_mesh(Ref<Mesh> mesh, Ref<World> world) {
 
 	VisualServer &vs = *VisualServer::get_singleton();
@@ -56,6 +76,7 @@ void VoxelBlock::set_mesh(Ref<Mesh> mesh, Ref<World> world) {
 	}
 
 	_mesh = mesh;
+	_mesh_memory_usage = mesh.is_valid() ? estimate_mesh_memory_usage(**mesh) : 0;
 	++_mesh_update_count;
 
 	//	if(_mesh_update_count > 1) {
@@ -83,3 +104,16 @@ void VoxelBlock::set_visible(bool visible) {
 		vs.instance_set_visible(_mesh_instance, visible);
 	}
 }
+
+uint32_t VoxelBlock::get_memory_usage() const {
+	uint32_t size = sizeof(VoxelBlock) + _mesh_memory_usage;
+	if (is_compressed()) {
+		size += compressed_voxels.size();
+	} else {
+		size += voxels->get_memory_usage();
+	}
+	if (edit_mask.is_valid()) {
+		size += edit_mask->get_memory_usage();
+	}
+	return size;
+}
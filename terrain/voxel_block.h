@@ -10,13 +10,43 @@
 // TODO Voxel data should be separated from this
 class VoxelBlock {
 public:
-	Ref<VoxelBuffer> voxels; // SIZE*SIZE*SIZE voxels
+	Ref<VoxelBuffer> voxels; // SIZE*SIZE*SIZE voxels, null while the block is compressed
 	Vector3i pos;
 
+	// Serialized and compressed voxels, when the block hasn't been accessed for a while.
+	// VoxelMap takes care of decompressing it when the block is accessed again.
+	Vector<uint8_t> compressed_voxels;
+
+	// Value of the VoxelMap frame counter the last time the block was accessed
+	uint32_t last_access_frame;
+
+	// Value of the VoxelMap data version counter the last time voxels of the block were modified.
+	// Async results computed from an older version are outdated.
+	uint32_t data_version;
+
+	// True if voxels were edited since the block was loaded or last saved, which means the block needs saving.
+	// Blocks the provider can give back as they are don't need to be saved.
+	bool modified;
+
+	// Only set on blocks created by edits before their voxels got loaded, see VoxelMap::set_streamed().
+	// Voxels of such blocks are only the edits, and this tells which ones were edited: 1 where a channel was written.
+	Ref<VoxelBuffer> edit_mask;
+
+	_FORCE_INLINE_ bool is_compressed() const { return voxels.is_null(); }
+	_FORCE_INLINE_ bool is_waiting_for_voxels() const { return edit_mask.is_valid(); }
+
 	static VoxelBlock *create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned int size);
 
+	~VoxelBlock();
+
 	void set_mesh(Ref<Mesh> mesh, Ref<World> world);
 
+	// Estimation of the memory taken by the mesh, which lives in the VisualServer
+	_FORCE_INLINE_ uint32_t get_mesh_memory_usage() const { return _mesh_memory_usage; }
+
+	// Voxels (compressed or not) and mesh
+	uint32_t get_memory_usage() const;
+
 	void enter_world(World *world);
 	void exit_world();
 	void set_visible(bool visible);
@@ -29,6 +59,7 @@ private:
 	Ref<Mesh> _mesh;
 	RID _mesh_instance;
 	int _mesh_update_count;
+	uint32_t _mesh_memory_usage;
 };
 
 #endif // VOXEL_BLOCK_H
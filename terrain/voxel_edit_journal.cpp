@@ -0,0 +1,242 @@
+#include "voxel_edit_journal.h"
+#include "voxel_map.h"
+
+VoxelEditJournal::VoxelEditJournal() :
+		_transaction_depth(0),
+		_memory_cap(16 * 1024 * 1024),
+		_memory_usage(0) {
+}
+
+void VoxelEditJournal::set_memory_cap(uint64_t bytes) {
+	_memory_cap = bytes;
+	enforce_memory_cap();
+}
+
+void VoxelEditJournal::begin_transaction() {
+	++_transaction_depth;
+}
+
+bool VoxelEditJournal::end_transaction() {
+	ERR_FAIL_COND_V(_transaction_depth == 0, false);
+	--_transaction_depth;
+	return _transaction_depth == 0;
+}
+
+void VoxelEditJournal::read_values(const VoxelBuffer &voxels, Rect3i box, unsigned int channel, Vector<uint32_t> &out_values) {
+	out_values.resize(box.size.x * box.size.y * box.size.z);
+	uint32_t *w = out_values.ptrw();
+	const Vector3i max = box.pos + box.size;
+	Vector3i pos;
+	for (pos.z = box.pos.z; pos.z < max.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < max.x; ++pos.x) {
+			for (pos.y = box.pos.y; pos.y < max.y; ++pos.y) {
+				*w++ = voxels.get_voxel(pos, channel);
+			}
+		}
+	}
+}
+
+void VoxelEditJournal::encode_runs(const Vector<uint32_t> &values, Vector<uint32_t> &out_runs) {
+	out_runs.clear();
+	if (values.size() == 0) {
+		return;
+	}
+	uint32_t value = values[0];
+	uint32_t count = 1;
+	for (int i = 1; i < values.size(); ++i) {
+		if (values[i] == value) {
+			++count;
+		} else {
+			out_runs.push_back(count);
+			out_runs.push_back(value);
+			value = values[i];
+			count = 1;
+		}
+	}
+	out_runs.push_back(count);
+	out_runs.push_back(value);
+}
+
+void VoxelEditJournal::apply_runs(const Vector<uint32_t> &runs, VoxelBuffer &voxels, Rect3i box, unsigned int channel) {
+
+	const Vector3i max = box.pos + box.size;
+
+	if (runs.size() == 2) {
+		// The whole box has the same value
+		voxels.fill_area(runs[1], box.pos, max, channel);
+		return;
+	}
+
+	int run_index = 0;
+	uint32_t remaining = runs.size() != 0 ? runs[0] : 0;
+
+	Vector3i pos;
+	for (pos.z = box.pos.z; pos.z < max.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < max.x; ++pos.x) {
+			for (pos.y = box.pos.y; pos.y < max.y; ++pos.y) {
+				while (remaining == 0) {
+					run_index += 2;
+					ERR_FAIL_COND(run_index >= runs.size());
+					remaining = runs[run_index];
+				}
+				voxels.set_voxel(runs[run_index + 1], pos, channel);
+				--remaining;
+			}
+		}
+	}
+}
+
+void VoxelEditJournal::record(const VoxelBuffer &voxels, Vector3i bpos, Rect3i box, unsigned int channel) {
+	ERR_FAIL_COND(_transaction_depth == 0);
+	ERR_FAIL_INDEX(channel, VoxelBuffer::MAX_CHANNELS);
+
+	const int *index = _open_diff_indexes[channel].getptr(bpos);
+
+	if (index == NULL) {
+		OpenDiff diff;
+		diff.block_pos = bpos;
+		diff.box = box;
+		diff.channel = channel;
+		read_values(voxels, box, channel, diff.old_values);
+		_open_diff_indexes[channel].set(bpos, _open_diffs.size());
+		_open_diffs.push_back(diff);
+		return;
+	}
+
+	OpenDiff &diff = _open_diffs.write[*index];
+	const Rect3i union_box = Rect3i::get_bounding_box(diff.box, box);
+	if (!(union_box != diff.box)) {
+		return;
+	}
+
+	// Voxels outside of the previous box were not modified yet during this transaction,
+	// so their current values are the old ones
+	Vector<uint32_t> values;
+	values.resize(union_box.size.x * union_box.size.y * union_box.size.z);
+	uint32_t *w = values.ptrw();
+	const uint32_t *prev_values = diff.old_values.ptr();
+	const Vector3i max = union_box.pos + union_box.size;
+	Vector3i pos;
+	for (pos.z = union_box.pos.z; pos.z < max.z; ++pos.z) {
+		for (pos.x = union_box.pos.x; pos.x < max.x; ++pos.x) {
+			for (pos.y = union_box.pos.y; pos.y < max.y; ++pos.y) {
+				if (diff.box.contains(pos)) {
+					const Vector3i rpos = pos - diff.box.pos;
+					*w++ = prev_values[rpos.y + diff.box.size.y * (rpos.x + diff.box.size.x * rpos.z)];
+				} else {
+					*w++ = voxels.get_voxel(pos, channel);
+				}
+			}
+		}
+	}
+
+	diff.old_values = values;
+	diff.box = union_box;
+}
+
+static bool are_runs_equal(const Vector<uint32_t> &a, const Vector<uint32_t> &b) {
+	return a.size() == b.size() && memcmp(a.ptr(), b.ptr(), a.size() * sizeof(uint32_t)) == 0;
+}
+
+void VoxelEditJournal::commit(const VoxelMap &map) {
+	ERR_FAIL_COND(_transaction_depth != 0);
+
+	Transaction transaction;
+	transaction.memory_usage = 0;
+
+	Vector<uint32_t> new_values;
+
+	for (int i = 0; i < _open_diffs.size(); ++i) {
+		const OpenDiff &open_diff = _open_diffs[i];
+
+		// Sharing data, no copy involved
+		Ref<VoxelBuffer> voxels = map.get_block_snapshot(open_diff.block_pos);
+		if (voxels.is_null()) {
+			// The block got removed in the meantime
+			continue;
+		}
+
+		Diff diff;
+		diff.block_pos = open_diff.block_pos;
+		diff.box = open_diff.box;
+		diff.channel = open_diff.channel;
+		encode_runs(open_diff.old_values, diff.old_runs);
+		read_values(**voxels, open_diff.box, open_diff.channel, new_values);
+		encode_runs(new_values, diff.new_runs);
+
+		if (are_runs_equal(diff.old_runs, diff.new_runs)) {
+			// Nothing actually changed
+			continue;
+		}
+
+		transaction.memory_usage += sizeof(Diff) + (diff.old_runs.size() + diff.new_runs.size()) * sizeof(uint32_t);
+		transaction.diffs.push_back(diff);
+	}
+
+	_open_diffs.clear();
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		_open_diff_indexes[i].clear();
+	}
+
+	if (transaction.diffs.size() == 0) {
+		return;
+	}
+
+	// New edits make the redo history meaningless
+	for (int i = 0; i < _redo_stack.size(); ++i) {
+		_memory_usage -= _redo_stack[i].memory_usage;
+	}
+	_redo_stack.clear();
+
+	_undo_stack.push_back(transaction);
+	_memory_usage += transaction.memory_usage;
+
+	enforce_memory_cap();
+}
+
+void VoxelEditJournal::enforce_memory_cap() {
+	if (_memory_cap == 0) {
+		return;
+	}
+	// Forget the oldest transactions first
+	int count = 0;
+	while (_memory_usage > _memory_cap && count < _undo_stack.size()) {
+		_memory_usage -= _undo_stack[count].memory_usage;
+		++count;
+	}
+	if (count != 0) {
+		Vector<Transaction> remaining;
+		for (int i = count; i < _undo_stack.size(); ++i) {
+			remaining.push_back(_undo_stack[i]);
+		}
+		_undo_stack = remaining;
+	}
+}
+
+const VoxelEditJournal::Transaction *VoxelEditJournal::pop_undo() {
+	if (_undo_stack.size() == 0) {
+		return NULL;
+	}
+	_redo_stack.push_back(_undo_stack[_undo_stack.size() - 1]);
+	_undo_stack.resize(_undo_stack.size() - 1);
+	return &_redo_stack[_redo_stack.size() - 1];
+}
+
+const VoxelEditJournal::Transaction *VoxelEditJournal::pop_redo() {
+	if (_redo_stack.size() == 0) {
+		return NULL;
+	}
+	_undo_stack.push_back(_redo_stack[_redo_stack.size() - 1]);
+	_redo_stack.resize(_redo_stack.size() - 1);
+	return &_undo_stack[_undo_stack.size() - 1];
+}
+
+void VoxelEditJournal::clear() {
+	_undo_stack.clear();
+	_redo_stack.clear();
+	_open_diffs.clear();
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		_open_diff_indexes[i].clear();
+	}
+	_memory_usage = 0;
+}
@@ -0,0 +1,85 @@
+#ifndef VOXEL_EDIT_JOURNAL_H
+#define VOXEL_EDIT_JOURNAL_H
+
+#include "../math/rect3i.h"
+#include "../voxel_buffer.h"
+
+#include <core/hash_map.h>
+
+class VoxelMap;
+
+// Records edits made to a VoxelMap so they can be undone and redone.
+// Each transaction stores, for every block and channel it modified, the previous and new values
+// of the modified box, run-length encoded. Oldest transactions are forgotten when the memory cap is exceeded.
+class VoxelEditJournal {
+public:
+	struct Diff {
+		Vector3i block_pos;
+		Rect3i box; // Relative to the block
+		unsigned int channel;
+		// Pairs of (count, value), voxels ordered like in VoxelBuffer
+		Vector<uint32_t> old_runs;
+		Vector<uint32_t> new_runs;
+	};
+
+	struct Transaction {
+		Vector<Diff> diffs;
+		uint32_t memory_usage;
+	};
+
+	VoxelEditJournal();
+
+	void set_memory_cap(uint64_t bytes);
+	uint64_t get_memory_cap() const { return _memory_cap; }
+	uint64_t get_memory_usage() const { return _memory_usage; }
+
+	// Transactions can be nested, only the outermost one counts
+	void begin_transaction();
+	// Returns true if the outermost transaction ended, which must then be committed
+	bool end_transaction();
+	bool is_in_transaction() const { return _transaction_depth > 0; }
+
+	// Must be called before voxels of a block get modified, within a transaction
+	void record(const VoxelBuffer &voxels, Vector3i bpos, Rect3i box, unsigned int channel);
+	// Finishes the transaction by reading the new values from the map
+	void commit(const VoxelMap &map);
+
+	bool can_undo() const { return _undo_stack.size() != 0; }
+	bool can_redo() const { return _redo_stack.size() != 0; }
+
+	// Moves the last transaction from one stack to the other and returns it. The caller applies its diffs.
+	const Transaction *pop_undo();
+	const Transaction *pop_redo();
+
+	void clear();
+
+	// Writes values of runs into a box of the buffer
+	static void apply_runs(const Vector<uint32_t> &runs, VoxelBuffer &voxels, Rect3i box, unsigned int channel);
+
+private:
+	struct OpenDiff {
+		Vector3i block_pos;
+		Rect3i box;
+		unsigned int channel;
+		Vector<uint32_t> old_values; // Not encoded yet, one per voxel of the box
+	};
+
+	static void encode_runs(const Vector<uint32_t> &values, Vector<uint32_t> &out_runs);
+	static void read_values(const VoxelBuffer &voxels, Rect3i box, unsigned int channel, Vector<uint32_t> &out_values);
+
+	void enforce_memory_cap();
+
+private:
+	Vector<Transaction> _undo_stack;
+	Vector<Transaction> _redo_stack;
+
+	// Diffs of the current transaction, indexed by block for each channel
+	Vector<OpenDiff> _open_diffs;
+	HashMap<Vector3i, int, Vector3iHasher> _open_diff_indexes[VoxelBuffer::MAX_CHANNELS];
+	int _transaction_depth;
+
+	uint64_t _memory_cap;
+	uint64_t _memory_usage;
+};
+
+#endif // VOXEL_EDIT_JOURNAL_H
@@ -0,0 +1,293 @@
+#include "voxel_lod_map.h"
+
+VoxelLodMap::VoxelLodMap() :
+		_lod_count(0),
+		_isolevel_downsampling(ISOLEVEL_MIN) {
+
+	set_lod_count(1);
+}
+
+void VoxelLodMap::set_lod_count(int count) {
+	ERR_FAIL_COND(count < 1 || count > MAX_LOD);
+
+	// New LODs start empty, so this should be set before blocks get loaded
+	for (int lod = _lod_count; lod < count; ++lod) {
+		Ref<VoxelMap> map;
+		map.instance();
+		if (lod > 0) {
+			for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+				map->set_channel_depth(i, _lods[0]->get_channel_depth(i));
+				map->set_default_voxel(_lods[0]->get_default_voxel(i), i);
+			}
+		}
+		_lods[lod] = map;
+	}
+
+	for (int lod = count; lod < _lod_count; ++lod) {
+		_lods[lod].unref();
+		_dirty_blocks[lod].clear();
+	}
+
+	_lod_count = count;
+	// The last LOD has no parent to update
+	_dirty_blocks[_lod_count - 1].clear();
+}
+
+Ref<VoxelMap> VoxelLodMap::get_lod(int lod) const {
+	ERR_FAIL_INDEX_V(lod, _lod_count, Ref<VoxelMap>());
+	return _lods[lod];
+}
+
+void VoxelLodMap::set_channel_depth(unsigned int channel, VoxelBuffer::Depth depth) {
+	for (int lod = 0; lod < _lod_count; ++lod) {
+		_lods[lod]->set_channel_depth(channel, depth);
+	}
+}
+
+void VoxelLodMap::set_default_voxel(uint32_t value, unsigned int channel) {
+	for (int lod = 0; lod < _lod_count; ++lod) {
+		_lods[lod]->set_default_voxel(value, channel);
+	}
+}
+
+void VoxelLodMap::set_isolevel_downsampling(IsolevelDownsampling mode) {
+	ERR_FAIL_INDEX(mode, 2);
+	_isolevel_downsampling = mode;
+}
+
+void VoxelLodMap::set_voxel(uint32_t value, Vector3i pos, unsigned int channel) {
+	_lods[0]->set_voxel(value, pos, channel);
+	make_block_dirty(_lods[0]->voxel_to_block(pos));
+}
+
+void VoxelLodMap::set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer) {
+	_lods[0]->set_block_buffer(bpos, buffer);
+	make_block_dirty(bpos);
+}
+
+void VoxelLodMap::make_block_dirty(Vector3i bpos) {
+	if (_lod_count > 1) {
+		_dirty_blocks[0].set(bpos, true);
+	}
+}
+
+void VoxelLodMap::make_area_dirty(Rect3i voxel_box) {
+
+	if (voxel_box.size.x <= 0 || voxel_box.size.y <= 0 || voxel_box.size.z <= 0) {
+		return;
+	}
+
+	const VoxelMap &map = **_lods[0];
+	const Vector3i min_bpos = map.voxel_to_block(voxel_box.pos);
+	const Vector3i max_bpos = map.voxel_to_block(voxel_box.pos + voxel_box.size - Vector3i(1)) + Vector3i(1);
+
+	Vector3i bpos;
+	for (bpos.z = min_bpos.z; bpos.z < max_bpos.z; ++bpos.z) {
+		for (bpos.x = min_bpos.x; bpos.x < max_bpos.x; ++bpos.x) {
+			for (bpos.y = min_bpos.y; bpos.y < max_bpos.y; ++bpos.y) {
+				make_block_dirty(bpos);
+			}
+		}
+	}
+}
+
+uint32_t VoxelLodMap::get_voxel(Vector3i pos, int lod, unsigned int channel) {
+	ERR_FAIL_INDEX_V(lod, _lod_count, 0);
+	update(lod);
+	return _lods[lod]->get_voxel(pos, channel);
+}
+
+void VoxelLodMap::get_buffer_copy(int lod, Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask) {
+	ERR_FAIL_INDEX(lod, _lod_count);
+	update(lod);
+	_lods[lod]->get_buffer_copy(min_pos, dst_buffer, channels_mask);
+}
+
+void VoxelLodMap::update(int max_lod) {
+	ERR_FAIL_INDEX(max_lod, _lod_count);
+
+	// Children are all downsampled before their parent gets downsampled in turn
+	Vector<Vector3i> positions;
+	for (int lod = 0; lod < max_lod; ++lod) {
+
+		HashMap<Vector3i, bool, Vector3iHasher> &dirty_blocks = _dirty_blocks[lod];
+		if (dirty_blocks.size() == 0) {
+			continue;
+		}
+
+		positions.clear();
+		const Vector3i *key = NULL;
+		while (key = dirty_blocks.next(key)) {
+			positions.push_back(*key);
+		}
+		dirty_blocks.clear();
+
+		for (int i = 0; i < positions.size(); ++i) {
+			downsample_block(lod, positions[i]);
+		}
+	}
+}
+
+// Most frequent value. Ties are won by anything else than air, so thin layers of matter don't vanish.
+static inline uint32_t get_majority_value(const uint32_t values[8]) {
+	const uint32_t air_type = 0;
+	uint32_t best = values[0];
+	int best_count = 0;
+	for (unsigned int i = 0; i < 8; ++i) {
+		int count = 0;
+		for (unsigned int j = 0; j < 8; ++j) {
+			if (values[j] == values[i]) {
+				++count;
+			}
+		}
+		if (count > best_count || (count == best_count && best == air_type && values[i] != air_type)) {
+			best = values[i];
+			best_count = count;
+		}
+	}
+	return best;
+}
+
+// Downsamples src into an area of dst having half its size, starting at dst_min
+static void downsample_type(const VoxelBuffer &src, VoxelBuffer &dst, Vector3i dst_min, unsigned int channel) {
+	const Vector3i size = src.get_size() / 2;
+	uint32_t values[8];
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < size.y; ++pos.y) {
+				const Vector3i src_pos = pos * 2;
+				for (unsigned int i = 0; i < 8; ++i) {
+					values[i] = src.get_voxel(src_pos.x + (i & 1), src_pos.y + ((i >> 1) & 1), src_pos.z + ((i >> 2) & 1), channel);
+				}
+				dst.set_voxel(get_majority_value(values), dst_min + pos, channel);
+			}
+		}
+	}
+}
+
+static void downsample_isolevel(const VoxelBuffer &src, VoxelBuffer &dst, Vector3i dst_min, unsigned int channel, VoxelLodMap::IsolevelDownsampling mode) {
+	const Vector3i size = src.get_size() / 2;
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < size.y; ++pos.y) {
+				const Vector3i src_pos = pos * 2;
+				// Working on decoded values makes it independent from the depth of the channel
+				real_t min = src.get_voxel_f(src_pos.x, src_pos.y, src_pos.z, channel);
+				real_t sum = min;
+				for (unsigned int i = 1; i < 8; ++i) {
+					const real_t v = src.get_voxel_f(src_pos.x + (i & 1), src_pos.y + ((i >> 1) & 1), src_pos.z + ((i >> 2) & 1), channel);
+					min = MIN(min, v);
+					sum += v;
+				}
+				const Vector3i dst_pos = dst_min + pos;
+				dst.set_voxel_f(mode == VoxelLodMap::ISOLEVEL_MIN ? min : sum / 8.f, dst_pos.x, dst_pos.y, dst_pos.z, channel);
+			}
+		}
+	}
+}
+
+// Other channels have arbitrary meaning, so one voxel out of 8 is kept as-is
+static void downsample_nearest(const VoxelBuffer &src, VoxelBuffer &dst, Vector3i dst_min, unsigned int channel) {
+	const Vector3i size = src.get_size() / 2;
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < size.y; ++pos.y) {
+				dst.set_voxel(src.get_voxel(pos * 2, channel), dst_min + pos, channel);
+			}
+		}
+	}
+}
+
+void VoxelLodMap::downsample_block(int src_lod, Vector3i bpos) {
+
+	VoxelMap &src_map = **_lods[src_lod];
+	VoxelMap &dst_map = **_lods[src_lod + 1];
+
+	Ref<VoxelBuffer> src = src_map.get_block_snapshot(bpos);
+	if (src.is_null()) {
+		// The block was unloaded since it was modified, keep what the parent had
+		return;
+	}
+
+	// Each block covers an octant of its parent
+	const int half_block_size = src_map.get_block_size() / 2;
+	const Vector3i parent_bpos(bpos.x >> 1, bpos.y >> 1, bpos.z >> 1);
+	const Vector3i dst_min = Vector3i(bpos.x & 1, bpos.y & 1, bpos.z & 1) * half_block_size;
+	const Vector3i dst_max = dst_min + Vector3i(half_block_size);
+
+	VoxelBlock *dst_block = dst_map.get_or_create_block(parent_bpos);
+	{
+		RWLockWrite lock(dst_map.get_lock());
+		VoxelBuffer &dst = **dst_block->voxels;
+
+		for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+
+			if (src->is_uniform(channel)) {
+				// Most blocks are, and this keeps the parent compact
+				dst.fill_area(src->get_voxel(0, 0, 0, channel), dst_min, dst_max, channel);
+
+			} else if (channel == VoxelBuffer::CHANNEL_TYPE) {
+				downsample_type(**src, dst, dst_min, channel);
+
+			} else if (channel == VoxelBuffer::CHANNEL_ISOLEVEL) {
+				downsample_isolevel(**src, dst, dst_min, channel, _isolevel_downsampling);
+
+			} else {
+				downsample_nearest(**src, dst, dst_min, channel);
+			}
+		}
+	}
+	dst_map.mark_modified(dst_block);
+
+	++_stats.downsampled_blocks;
+
+	if (src_lod + 2 < _lod_count) {
+		_dirty_blocks[src_lod + 1].set(parent_bpos, true);
+	}
+}
+
+Dictionary VoxelLodMap::get_statistics() const {
+	int dirty_blocks = 0;
+	for (int lod = 0; lod < _lod_count; ++lod) {
+		dirty_blocks += _dirty_blocks[lod].size();
+	}
+	Dictionary d;
+	d["downsampled_blocks"] = _stats.downsampled_blocks;
+	d["dirty_blocks"] = dirty_blocks;
+	return d;
+}
+
+void VoxelLodMap::_get_buffer_copy_binding(int lod, Vector3 min_pos, Ref<VoxelBuffer> dst_buffer, unsigned int channels_mask) {
+	ERR_FAIL_COND(dst_buffer.is_null());
+	get_buffer_copy(lod, Vector3i(min_pos), **dst_buffer, channels_mask);
+}
+
+void VoxelLodMap::_bind_methods() {
+
+	ClassDB::bind_method(D_METHOD("set_lod_count", "count"), &VoxelLodMap::set_lod_count);
+	ClassDB::bind_method(D_METHOD("get_lod_count"), &VoxelLodMap::get_lod_count);
+	ClassDB::bind_method(D_METHOD("get_lod", "lod"), &VoxelLodMap::_get_lod_binding);
+
+	ClassDB::bind_method(D_METHOD("set_channel_depth", "channel", "depth"), &VoxelLodMap::set_channel_depth);
+	ClassDB::bind_method(D_METHOD("set_default_voxel", "value", "channel"), &VoxelLodMap::set_default_voxel);
+
+	ClassDB::bind_method(D_METHOD("set_isolevel_downsampling", "mode"), &VoxelLodMap::set_isolevel_downsampling);
+	ClassDB::bind_method(D_METHOD("get_isolevel_downsampling"), &VoxelLodMap::get_isolevel_downsampling);
+
+	ClassDB::bind_method(D_METHOD("set_voxel", "value", "pos", "channel"), &VoxelLodMap::_set_voxel_binding, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("get_voxel", "pos", "lod", "channel"), &VoxelLodMap::_get_voxel_binding, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("set_block_buffer", "block_pos", "buffer"), &VoxelLodMap::_set_block_buffer_binding);
+	ClassDB::bind_method(D_METHOD("make_block_dirty", "block_pos"), &VoxelLodMap::_make_block_dirty_binding);
+	ClassDB::bind_method(D_METHOD("get_buffer_copy", "lod", "min_pos", "out_buffer", "channels_mask"), &VoxelLodMap::_get_buffer_copy_binding, DEFVAL(1));
+	ClassDB::bind_method(D_METHOD("update"), &VoxelLodMap::_update_binding);
+	ClassDB::bind_method(D_METHOD("get_statistics"), &VoxelLodMap::get_statistics);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "lod_count", PROPERTY_HINT_RANGE, "1,8,1"), "set_lod_count", "get_lod_count");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "isolevel_downsampling", PROPERTY_HINT_ENUM, "Min,Average"), "set_isolevel_downsampling", "get_isolevel_downsampling");
+
+	BIND_ENUM_CONSTANT(ISOLEVEL_MIN);
+	BIND_ENUM_CONSTANT(ISOLEVEL_AVERAGE);
+}
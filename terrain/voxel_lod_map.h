@@ -0,0 +1,87 @@
+#ifndef VOXEL_LOD_MAP_H
+#define VOXEL_LOD_MAP_H
+
+#include "voxel_map.h"
+
+// Stack of VoxelMaps where each level of detail has voxels twice as big as the previous one.
+// Edits are made at LOD0, and are propagated to lower resolutions only when they are needed,
+// by downsampling modified blocks into their parent.
+// Like VoxelMap, it must only be modified by the main thread.
+class VoxelLodMap : public Reference {
+	GDCLASS(VoxelLodMap, Reference)
+public:
+	static const int MAX_LOD = 8;
+
+	enum IsolevelDownsampling {
+		ISOLEVEL_MIN = 0, // Keeps thin features of matter, but makes surfaces grow
+		ISOLEVEL_AVERAGE // Smoother, but thin features can disappear
+	};
+
+	VoxelLodMap();
+
+	void set_lod_count(int count);
+	int get_lod_count() const { return _lod_count; }
+
+	// Maps above LOD0 may not be up to date, call update() before reading them directly
+	Ref<VoxelMap> get_lod(int lod) const;
+
+	// Applies to all LODs
+	void set_channel_depth(unsigned int channel, VoxelBuffer::Depth depth);
+	void set_default_voxel(uint32_t value, unsigned int channel);
+
+	void set_isolevel_downsampling(IsolevelDownsampling mode);
+	IsolevelDownsampling get_isolevel_downsampling() const { return _isolevel_downsampling; }
+
+	// Edits at LOD0
+	void set_voxel(uint32_t value, Vector3i pos, unsigned int channel = 0);
+	void set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer);
+	// Must be called for LOD0 blocks modified without going through this class
+	void make_block_dirty(Vector3i bpos);
+	void make_area_dirty(Rect3i voxel_box);
+
+	// Positions are in voxels of the given LOD. LODs up to this one are updated first.
+	uint32_t get_voxel(Vector3i pos, int lod, unsigned int channel = 0);
+	void get_buffer_copy(int lod, Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask = 1);
+
+	// Propagates modified blocks to all LODs
+	void update() { update(_lod_count - 1); }
+	// Propagates modified blocks up to the given LOD
+	void update(int max_lod);
+
+	struct Stats {
+		uint32_t downsampled_blocks;
+
+		Stats() :
+				downsampled_blocks(0) {}
+	};
+
+	const Stats &get_stats() const { return _stats; }
+	Dictionary get_statistics() const;
+
+private:
+	void downsample_block(int src_lod, Vector3i bpos);
+
+	static void _bind_methods();
+
+	Ref<VoxelMap> _get_lod_binding(int lod) const { return get_lod(lod); }
+	void _set_voxel_binding(int64_t value, Vector3 pos, unsigned int channel) { set_voxel(value, Vector3i(pos), channel); }
+	int64_t _get_voxel_binding(Vector3 pos, int lod, unsigned int channel) { return get_voxel(Vector3i(pos), lod, channel); }
+	void _set_block_buffer_binding(Vector3 bpos, Ref<VoxelBuffer> buffer) { set_block_buffer(Vector3i(bpos), buffer); }
+	void _make_block_dirty_binding(Vector3 bpos) { make_block_dirty(Vector3i(bpos)); }
+	void _get_buffer_copy_binding(int lod, Vector3 min_pos, Ref<VoxelBuffer> dst_buffer, unsigned int channels_mask);
+	void _update_binding() { update(); }
+
+private:
+	Ref<VoxelMap> _lods[MAX_LOD];
+	int _lod_count;
+
+	// Blocks of each LOD modified since they were last downsampled. Used as sets.
+	HashMap<Vector3i, bool, Vector3iHasher> _dirty_blocks[MAX_LOD];
+
+	IsolevelDownsampling _isolevel_downsampling;
+	Stats _stats;
+};
+
+VARIANT_ENUM_CAST(VoxelLodMap::IsolevelDownsampling)
+
+#endif // VOXEL_LOD_MAP_H
@@ -5,13 +5,24 @@
 #include "core/os/os.h"
 
 VoxelMap::VoxelMap() :
-		_last_accessed_block(NULL) {
+		_last_accessed_block(NULL),
+		_frame(0),
+		_cold_block_frames(300),
+		_next_cold_scan_frame(0),
+		_memory_budget(0),
+		_next_budget_check_frame(0),
+		_data_version(0),
+		_streamed(false),
+		_journal_enabled(false) {
 
 	// TODO Make it configurable in editor (with all necessary notifications and updatings!)
 	set_block_size_pow2(4);
 
+	_lock = RWLock::create();
+
 	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
 		_default_voxel[i] = 0;
+		_channel_depths[i] = VoxelBuffer::DEPTH_8_BIT;
 	}
 
 	_default_voxel[VoxelBuffer::CHANNEL_ISOLEVEL] = 255;
@@ -20,6 +31,7 @@ VoxelMap::VoxelMap() :
 VoxelMap::~VoxelMap() {
 	print_line("Destroying VoxelMap");
 	clear();
+	memdelete(_lock);
 }
 
 void VoxelMap::set_block_size_pow2(unsigned int p) {
@@ -32,38 +44,84 @@ void VoxelMap::set_block_size_pow2(unsigned int p) {
 	_block_size_mask = _block_size - 1;
 }
 
-int VoxelMap::get_voxel(Vector3i pos, unsigned int c) {
+uint32_t VoxelMap::get_voxel(Vector3i pos, unsigned int c) {
 	Vector3i bpos = voxel_to_block(pos);
 	VoxelBlock *block = get_block(bpos);
 	if (block == NULL) {
-		return _default_voxel[c];
+		return get_uniform_values(bpos)[c];
 	}
 	return block->voxels->get_voxel(to_local(pos), c);
 }
 
-VoxelBlock *VoxelMap::get_or_create_block_at_voxel_pos(Vector3i pos) {
+Ref<VoxelBuffer> VoxelMap::create_buffer(const uint32_t *values) const {
+	Ref<VoxelBuffer> buffer(memnew(VoxelBuffer));
+	buffer->create(_block_size, _block_size, _block_size);
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		buffer->set_channel_depth(i, _channel_depths[i]);
+	}
+	buffer->set_default_values(values);
+	return buffer;
+}
+
+VoxelBlock *VoxelMap::get_or_create_block(Vector3i bpos) {
 
-	Vector3i bpos = voxel_to_block(pos);
 	VoxelBlock *block = get_block(bpos);
 
 	if (block == NULL) {
 
-		Ref<VoxelBuffer> buffer(memnew(VoxelBuffer));
-		buffer->create(_block_size, _block_size, _block_size);
-		buffer->set_default_values(_default_voxel);
+		// Collapsed blocks get their voxels back
+		const bool collapsed = _uniform_blocks.has(bpos);
+		if (collapsed) {
+			++_stats.uncollapse_count;
+		}
+		Ref<VoxelBuffer> buffer = create_buffer(get_uniform_values(bpos));
 
 		block = VoxelBlock::create(bpos, buffer, _block_size);
+		block->last_access_frame = _frame;
+
+		if (_streamed && !collapsed) {
+			// Voxels of that block are not loaded yet
+			block->edit_mask.instance();
+			block->edit_mask->create(_block_size, _block_size, _block_size);
+			for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+				block->edit_mask->fill(0, i);
+			}
+		}
 
+		// Also removes it from the octree
 		set_block(bpos, block);
 	}
 
 	return block;
 }
 
-void VoxelMap::set_voxel(int value, Vector3i pos, unsigned int c) {
+VoxelBlock *VoxelMap::get_or_create_block_at_voxel_pos(Vector3i pos) {
+	return get_or_create_block(voxel_to_block(pos));
+}
 
-	VoxelBlock *block = get_or_create_block_at_voxel_pos(pos);
-	block->voxels->set_voxel(value, to_local(pos), c);
+void VoxelMap::set_voxel(uint32_t value, Vector3i pos, unsigned int c) {
+
+	const Vector3i bpos = voxel_to_block(pos);
+	if (find_block(bpos) == NULL) {
+		// Don't split collapsed blocks if nothing changes
+		const VoxelUniformOctree::Values *values = _uniform_blocks.find(bpos);
+		if (values && values->channels[c] == value) {
+			return;
+		}
+	}
+
+	VoxelBlock *block = get_or_create_block(bpos);
+	const Vector3i rpos = to_local(pos);
+
+	begin_transaction();
+	record_edit(block, Rect3i(rpos, Vector3i(1)), c);
+	{
+		RWLockWrite lock(_lock);
+		block->voxels->set_voxel(value, rpos, c);
+	}
+	mark_edited(block, Rect3i(rpos, Vector3i(1)), c);
+	mark_modified(block);
+	end_transaction();
 }
 
 float VoxelMap::get_voxel_f(int x, int y, int z, unsigned int c) {
@@ -72,7 +130,7 @@ float VoxelMap::get_voxel_f(int x, int y, int z, unsigned int c) {
 	Vector3i bpos = voxel_to_block(pos);
 	VoxelBlock *block = get_block(bpos);
 	if (block == NULL) {
-		return _default_voxel[c];
+		return VoxelBuffer::raw_to_iso(get_uniform_values(bpos)[c], _channel_depths[c]);
 	}
 	Vector3i lpos = to_local(pos);
 	return block->voxels->get_voxel_f(lpos.x, lpos.y, lpos.z, c);
@@ -83,30 +141,371 @@ void VoxelMap::set_voxel_f(real_t value, int x, int y, int z, unsigned int c) {
 	Vector3i pos(x, y, z);
 	VoxelBlock *block = get_or_create_block_at_voxel_pos(pos);
 	Vector3i lpos = to_local(pos);
-	block->voxels->set_voxel_f(value, lpos.x, lpos.y, lpos.z, c);
+
+	begin_transaction();
+	record_edit(block, Rect3i(lpos, Vector3i(1)), c);
+	{
+		RWLockWrite lock(_lock);
+		block->voxels->set_voxel_f(value, lpos.x, lpos.y, lpos.z, c);
+	}
+	mark_edited(block, Rect3i(lpos, Vector3i(1)), c);
+	mark_modified(block);
+	end_transaction();
 }
 
-void VoxelMap::set_default_voxel(int value, unsigned int channel) {
+struct BlockEdit {
+	Vector3i bpos;
+	int index;
+};
+
+// Orders edits by block, keeping the original order within each block
+struct BlockEditComparator {
+	inline bool operator()(const BlockEdit &a, const BlockEdit &b) const {
+		if (a.bpos.z != b.bpos.z) {
+			return a.bpos.z < b.bpos.z;
+		}
+		if (a.bpos.x != b.bpos.x) {
+			return a.bpos.x < b.bpos.x;
+		}
+		if (a.bpos.y != b.bpos.y) {
+			return a.bpos.y < b.bpos.y;
+		}
+		return a.index < b.index;
+	}
+};
+
+void VoxelMap::set_voxels(const Vector<Edit> &edits, Vector<Rect3i> *out_boxes) {
+
+	Vector<BlockEdit> order;
+	order.resize(edits.size());
+	for (int i = 0; i < edits.size(); ++i) {
+		BlockEdit &be = order.write[i];
+		be.bpos = voxel_to_block(edits[i].position);
+		be.index = i;
+	}
+
+	SortArray<BlockEdit, BlockEditComparator> sorter;
+	sorter.sort(order.ptrw(), order.size());
+
+	begin_transaction();
+
+	int i = 0;
+	while (i < order.size()) {
+
+		const Vector3i bpos = order[i].bpos;
+		VoxelBlock *block = get_or_create_block_at_voxel_pos(block_to_voxel(bpos));
+
+		// Find the area and channels modified in this block first
+		Vector3i min_pos = to_local(edits[order[i].index].position);
+		Vector3i max_pos = min_pos;
+		unsigned int channels_mask = 0;
+		int end = i;
+
+		for (; end < order.size() && order[end].bpos == bpos; ++end) {
+			const Edit &edit = edits[order[end].index];
+			ERR_CONTINUE(edit.channel >= VoxelBuffer::MAX_CHANNELS);
+			const Vector3i rpos = to_local(edit.position);
+			min_pos = Vector3i(MIN(min_pos.x, rpos.x), MIN(min_pos.y, rpos.y), MIN(min_pos.z, rpos.z));
+			max_pos = Vector3i(MAX(max_pos.x, rpos.x), MAX(max_pos.y, rpos.y), MAX(max_pos.z, rpos.z));
+			channels_mask |= (1 << edit.channel);
+		}
+
+		const Rect3i box(min_pos, max_pos - min_pos + Vector3i(1));
+
+		if (_journal_enabled) {
+			for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+				if (((1 << channel) & channels_mask) != 0) {
+					record_edit(block, box, channel);
+				}
+			}
+		}
+
+		{
+			RWLockWrite lock(_lock);
+			VoxelBuffer &voxels = **block->voxels;
+
+			for (; i < end; ++i) {
+				const Edit &edit = edits[order[i].index];
+				const Vector3i rpos = to_local(edit.position);
+				voxels.set_voxel(edit.value, rpos, edit.channel);
+				mark_edited(block, Rect3i(rpos, Vector3i(1)), edit.channel);
+			}
+		}
+		mark_modified(block);
+
+		if (out_boxes) {
+			out_boxes->push_back(Rect3i(block_to_voxel(bpos) + box.pos, box.size));
+		}
+	}
+
+	end_transaction();
+}
+
+// Part of a box that is inside a block
+static Rect3i get_block_intersection(Vector3i min_pos, Vector3i max_pos, Vector3i block_pos_in_voxels, int block_size) {
+	const Vector3i block_max_pos = block_pos_in_voxels + Vector3i(block_size);
+	const Vector3i min(
+			MAX(min_pos.x, block_pos_in_voxels.x),
+			MAX(min_pos.y, block_pos_in_voxels.y),
+			MAX(min_pos.z, block_pos_in_voxels.z));
+	const Vector3i max(
+			MIN(max_pos.x, block_max_pos.x),
+			MIN(max_pos.y, block_max_pos.y),
+			MIN(max_pos.z, block_max_pos.z));
+	return Rect3i(min, max - min);
+}
+
+void VoxelMap::fill_area(uint32_t value, Rect3i box, unsigned int channel, Vector<Rect3i> *out_boxes) {
 	ERR_FAIL_INDEX(channel, VoxelBuffer::MAX_CHANNELS);
-	_default_voxel[channel] = value;
+
+	if (box.size.x <= 0 || box.size.y <= 0 || box.size.z <= 0) {
+		return;
+	}
+
+	const Vector3i max_pos = box.pos + box.size;
+	const Vector3i min_block_pos = voxel_to_block(box.pos);
+	const Vector3i max_block_pos = voxel_to_block(max_pos - Vector3i(1)) + Vector3i(1);
+
+	begin_transaction();
+
+	Vector3i bpos;
+	for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
+		for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
+			for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
+
+				const Vector3i offset = block_to_voxel(bpos);
+				const Rect3i area = get_block_intersection(box.pos, max_pos, offset, _block_size);
+				VoxelBlock *block = get_or_create_block_at_voxel_pos(offset);
+				record_edit(block, Rect3i(area.pos - offset, area.size), channel);
+				{
+					RWLockWrite lock(_lock);
+					block->voxels->fill_area(value, area.pos - offset, area.pos + area.size - offset, channel);
+				}
+				mark_edited(block, Rect3i(area.pos - offset, area.size), channel);
+				mark_modified(block);
+
+				if (out_boxes) {
+					out_boxes->push_back(area);
+				}
+			}
+		}
+	}
+
+	end_transaction();
 }
 
-int VoxelMap::get_default_voxel(unsigned int channel) {
+void VoxelMap::paste(Vector3i min_pos, const VoxelBuffer &src_buffer, unsigned int channels_mask, Vector<Rect3i> *out_boxes) {
+
+	const Vector3i size = src_buffer.get_size();
+	if (size.x == 0 || size.y == 0 || size.z == 0) {
+		return;
+	}
+
+	for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+		if (((1 << channel) & channels_mask) != 0) {
+			// Values are copied as-is
+			ERR_FAIL_COND(src_buffer.get_channel_depth(channel) != _channel_depths[channel]);
+		}
+	}
+
+	const Vector3i max_pos = min_pos + size;
+	const Vector3i min_block_pos = voxel_to_block(min_pos);
+	const Vector3i max_block_pos = voxel_to_block(max_pos - Vector3i(1)) + Vector3i(1);
+
+	begin_transaction();
+
+	Vector3i bpos;
+	for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
+		for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
+			for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
+
+				const Vector3i offset = block_to_voxel(bpos);
+				const Rect3i area = get_block_intersection(min_pos, max_pos, offset, _block_size);
+				VoxelBlock *block = get_or_create_block_at_voxel_pos(offset);
+				if (_journal_enabled) {
+					for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+						if (((1 << channel) & channels_mask) != 0) {
+							record_edit(block, Rect3i(area.pos - offset, area.size), channel);
+						}
+					}
+				}
+				{
+					RWLockWrite lock(_lock);
+					for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+						if (((1 << channel) & channels_mask) != 0) {
+							// If the buffer covers the whole block, data gets shared instead of copied
+							block->voxels->copy_from(src_buffer, area.pos - min_pos, area.pos + area.size - min_pos, area.pos - offset, channel);
+						}
+					}
+				}
+				for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+					if (((1 << channel) & channels_mask) != 0) {
+						mark_edited(block, Rect3i(area.pos - offset, area.size), channel);
+					}
+				}
+				mark_modified(block);
+
+				if (out_boxes) {
+					out_boxes->push_back(area);
+				}
+			}
+		}
+	}
+	end_transaction();
+}
+
+void VoxelMap::set_journal_enabled(bool enabled) {
+	_journal_enabled = enabled;
+	if (!enabled) {
+		_journal.clear();
+	}
+}
+
+void VoxelMap::begin_transaction() {
+	_journal.begin_transaction();
+}
+
+void VoxelMap::end_transaction() {
+	if (_journal.end_transaction() && _journal_enabled) {
+		_journal.commit(*this);
+	}
+}
+
+bool VoxelMap::undo(Vector<Rect3i> *out_boxes) {
+	ERR_FAIL_COND_V(_journal.is_in_transaction(), false);
+	const VoxelEditJournal::Transaction *transaction = _journal.pop_undo();
+	if (transaction == NULL) {
+		return false;
+	}
+	apply_transaction(*transaction, true, out_boxes);
+	return true;
+}
+
+bool VoxelMap::redo(Vector<Rect3i> *out_boxes) {
+	ERR_FAIL_COND_V(_journal.is_in_transaction(), false);
+	const VoxelEditJournal::Transaction *transaction = _journal.pop_redo();
+	if (transaction == NULL) {
+		return false;
+	}
+	apply_transaction(*transaction, false, out_boxes);
+	return true;
+}
+
+void VoxelMap::apply_transaction(const VoxelEditJournal::Transaction &transaction, bool restore_old_values, Vector<Rect3i> *out_boxes) {
+
+	// Channels of the same block are merged, so each block is reported once
+	HashMap<Vector3i, Rect3i, Vector3iHasher> block_boxes;
+
+	for (int i = 0; i < transaction.diffs.size(); ++i) {
+		const VoxelEditJournal::Diff &diff = transaction.diffs[i];
+
+		if (!has_block(diff.block_pos)) {
+			// Voxels of the block were lost when it got unloaded
+			continue;
+		}
+
+		// Diffs are written directly, so they don't get recorded again
+		VoxelBlock *block = get_or_create_block(diff.block_pos);
+		{
+			RWLockWrite lock(_lock);
+			VoxelEditJournal::apply_runs(restore_old_values ? diff.old_runs : diff.new_runs, **block->voxels, diff.box, diff.channel);
+		}
+		mark_edited(block, diff.box, diff.channel);
+		mark_modified(block);
+
+		Rect3i *box = block_boxes.getptr(diff.block_pos);
+		if (box) {
+			*box = Rect3i::get_bounding_box(*box, diff.box);
+		} else {
+			block_boxes.set(diff.block_pos, diff.box);
+		}
+	}
+
+	if (out_boxes) {
+		const Vector3i *key = NULL;
+		while (key = block_boxes.next(key)) {
+			const Rect3i &box = block_boxes.get(*key);
+			out_boxes->push_back(Rect3i(block_to_voxel(*key) + box.pos, box.size));
+		}
+	}
+}
+
+void VoxelMap::set_default_voxel(uint32_t value, unsigned int channel) {
+	ERR_FAIL_INDEX(channel, VoxelBuffer::MAX_CHANNELS);
+	RWLockWrite lock(_lock);
+	_default_voxel[channel] = MIN(value, VoxelBuffer::get_depth_max_value(_channel_depths[channel]));
+}
+
+uint32_t VoxelMap::get_default_voxel(unsigned int channel) {
 	ERR_FAIL_INDEX_V(channel, VoxelBuffer::MAX_CHANNELS, 0);
 	return _default_voxel[channel];
 }
 
+struct ConvertUniformValues {
+	unsigned int channel;
+	VoxelBuffer::Depth src_depth;
+	VoxelBuffer::Depth dst_depth;
+
+	ConvertUniformValues(unsigned int p_channel, VoxelBuffer::Depth p_src_depth, VoxelBuffer::Depth p_dst_depth) :
+			channel(p_channel),
+			src_depth(p_src_depth),
+			dst_depth(p_dst_depth) {}
+
+	inline void operator()(VoxelUniformOctree::Values &values) {
+		values.channels[channel] = VoxelBuffer::convert_value_depth(values.channels[channel], src_depth, dst_depth, channel);
+	}
+};
+
+void VoxelMap::set_channel_depth(unsigned int channel, VoxelBuffer::Depth depth) {
+	ERR_FAIL_INDEX(channel, VoxelBuffer::MAX_CHANNELS);
+	ERR_FAIL_INDEX(depth, VoxelBuffer::DEPTH_COUNT);
+
+	if (_channel_depths[channel] == depth) {
+		return;
+	}
+
+	RWLockWrite lock(_lock);
+
+	const VoxelBuffer::Depth prev_depth = _channel_depths[channel];
+	_default_voxel[channel] = VoxelBuffer::convert_value_depth(_default_voxel[channel], prev_depth, depth, channel);
+	_channel_depths[channel] = depth;
+
+	const Vector3i *key = NULL;
+	while (key = _blocks.next(key)) {
+		VoxelBlock *block = _blocks.get(*key);
+		// Compressed blocks get converted when decompressed
+		if (!block->is_compressed()) {
+			block->voxels->set_channel_depth(channel, depth);
+		}
+	}
+
+	_uniform_blocks.for_all_values(ConvertUniformValues(channel, prev_depth, depth));
+
+	// Recorded values have the previous format
+	_journal.clear();
+}
+
+VoxelBuffer::Depth VoxelMap::get_channel_depth(unsigned int channel) const {
+	ERR_FAIL_INDEX_V(channel, VoxelBuffer::MAX_CHANNELS, VoxelBuffer::DEPTH_8_BIT);
+	return _channel_depths[channel];
+}
+
 VoxelBlock *VoxelMap::get_block(Vector3i bpos) {
+	VoxelBlock *block;
 	if (_last_accessed_block && _last_accessed_block->pos == bpos) {
-		return _last_accessed_block;
+		block = _last_accessed_block;
+	} else {
+		block = find_block(bpos);
+		if (block == NULL) {
+			return NULL;
+		}
+		_last_accessed_block = block;
 	}
-	VoxelBlock **p = _blocks.getptr(bpos);
-	if (p) {
-		_last_accessed_block = *p;
-		CRASH_COND(_last_accessed_block == NULL); // The map should not contain null blocks
-		return _last_accessed_block;
+	block->last_access_frame = _frame;
+	if (block->is_compressed()) {
+		decompress_block(block);
 	}
-	return NULL;
+	return block;
 }
 
 void VoxelMap::set_block(Vector3i bpos, VoxelBlock *block) {
@@ -114,72 +513,279 @@ void VoxelMap::set_block(Vector3i bpos, VoxelBlock *block) {
 	if (_last_accessed_block == NULL || _last_accessed_block->pos == bpos) {
 		_last_accessed_block = block;
 	}
+	// The block is new, but it isn't an edit
+	block->data_version = ++_data_version;
+	RWLockWrite lock(_lock);
 	_blocks.set(bpos, block);
+	if (_grid_box.contains(bpos)) {
+		_grid.write[get_grid_index(bpos)] = block;
+	}
+	// A position is either collapsed or has a block, never both
+	_uniform_blocks.remove(bpos);
 }
 
-void VoxelMap::set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer) {
+void VoxelMap::set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer, bool modified) {
 	ERR_FAIL_COND(buffer.is_null());
-	VoxelBlock *block = get_block(bpos);
+
+	// Does nothing if the buffer already has the right format
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		buffer->set_channel_depth(i, _channel_depths[i]);
+	}
+	VoxelBlock *block = find_block(bpos);
 	if (block == NULL) {
 		block = VoxelBlock::create(bpos, *buffer, _block_size);
+		block->last_access_frame = _frame;
+		block->modified = modified;
 		set_block(bpos, block);
+	} else if (block->is_waiting_for_voxels()) {
+		// The block only has edits made before its voxels were loaded, they go on top of them
+		if (block->is_compressed()) {
+			decompress_block(block);
+		}
+		Ref<VoxelBuffer> edit_mask = block->edit_mask;
+		RWLockWrite lock(_lock);
+		apply_edits(**block->voxels, **edit_mask, **buffer);
+		block->voxels = buffer;
+		block->edit_mask.unref();
+		block->last_access_frame = _frame;
+		mark_modified(block);
 	} else {
+		// Previous voxels are replaced, no need to decompress them
+		RWLockWrite lock(_lock);
+		if (block->is_compressed()) {
+			--_stats.compressed_blocks;
+			_stats.compressed_memory -= block->compressed_voxels.size();
+			block->compressed_voxels.clear();
+		}
 		block->voxels = buffer;
+		block->last_access_frame = _frame;
+		mark_modified(block);
+		// Previous edits are gone too
+		block->modified = modified;
+	}
+}
+
+void VoxelMap::apply_edits(const VoxelBuffer &edits, const VoxelBuffer &edit_mask, VoxelBuffer &dst) {
+
+	const Vector3i size = dst.get_size();
+	ERR_FAIL_COND(edits.get_size() != size);
+
+	for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+
+		if (edit_mask.is_uniform(channel)) {
+			if (edit_mask.get_voxel(0, 0, 0, channel) != 0) {
+				// The whole channel was edited
+				dst.copy_from(edits, channel);
+			}
+			continue;
+		}
+
+		Vector3i pos;
+		for (pos.z = 0; pos.z < size.z; ++pos.z) {
+			for (pos.x = 0; pos.x < size.x; ++pos.x) {
+				for (pos.y = 0; pos.y < size.y; ++pos.y) {
+					if (edit_mask.get_voxel(pos, channel) != 0) {
+						dst.set_voxel(edits.get_voxel(pos, channel), pos, channel);
+					}
+				}
+			}
+		}
 	}
 }
 
 bool VoxelMap::has_block(Vector3i pos) const {
-	return /*(_last_accessed_block != NULL && _last_accessed_block->pos == pos) ||*/ _blocks.has(pos);
+	return find_block(pos) != NULL || _uniform_blocks.has(pos);
+}
+
+bool VoxelMap::is_block_loaded(Vector3i bpos) const {
+	const VoxelBlock *block = find_block(bpos);
+	if (block == NULL) {
+		return _uniform_blocks.has(bpos);
+	}
+	return !block->is_waiting_for_voxels();
+}
+
+uint32_t VoxelMap::get_block_data_version(Vector3i bpos) const {
+	const VoxelBlock *block = find_block(bpos);
+	return block ? block->data_version : 0;
+}
+
+bool VoxelMap::is_block_modified(Vector3i bpos) const {
+	const VoxelBlock *block = find_block(bpos);
+	return block != NULL && block->modified && !block->is_waiting_for_voxels();
+}
+
+void VoxelMap::set_block_modified(Vector3i bpos, bool modified) {
+	VoxelBlock *block = find_block(bpos);
+	ERR_FAIL_COND(block == NULL);
+	block->modified = modified;
+}
+
+bool VoxelMap::collapse_block(Vector3i bpos) {
+
+	VoxelBlock *block = get_block(bpos);
+	if (block == NULL) {
+		return _uniform_blocks.has(bpos);
+	}
+	if (block->modified) {
+		return false;
+	}
+
+	VoxelUniformOctree::Values values;
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		if (!block->voxels->is_uniform(i)) {
+			return false;
+		}
+		values.channels[i] = block->voxels->get_voxel(0, 0, 0, i);
+	}
+
+	{
+		// Readers see either the block or its values
+		RWLockWrite lock(_lock);
+		_uniform_blocks.set(bpos, values);
+	}
+	remove_block(bpos, NoAction());
+	++_stats.collapse_count;
+	return true;
 }
 
 bool VoxelMap::is_block_surrounded(Vector3i pos) const {
 	for (unsigned int i = 0; i < Cube::MOORE_NEIGHBORING_3D_COUNT; ++i) {
 		Vector3i bpos = pos + Cube::g_moore_neighboring_3d[i];
-		if (!has_block(bpos)) {
+		if (!is_block_loaded(bpos)) {
 			return false;
 		}
 	}
 	return true;
 }
 
-void VoxelMap::get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask) {
+void VoxelMap::set_grid_box(Rect3i box) {
+
+	if (box.size.x <= 0 || box.size.y <= 0 || box.size.z <= 0) {
+		RWLockWrite lock(_lock);
+		_grid.clear();
+		_grid_box = Rect3i();
+		return;
+	}
+
+	if (!(box != _grid_box)) {
+		return;
+	}
+
+	RWLockWrite lock(_lock);
+
+	const Rect3i prev_box = _grid_box;
+	const bool resized = box.size != prev_box.size;
+
+	if (resized) {
+		_grid_size = Vector3i(next_power_of_2(box.size.x), next_power_of_2(box.size.y), next_power_of_2(box.size.z));
+		_grid_mask = _grid_size - Vector3i(1, 1, 1);
+		_grid.resize(_grid_size.x * _grid_size.y * _grid_size.z);
+	}
+
+	_grid_box = box;
+
+	// Slots of positions that were already in the box still hold the right block.
+	// The others may hold a block that left the box and wrapped to the same slot.
+	Vector3i max = box.pos + box.size;
+	Vector3i bpos;
+	for (bpos.z = box.pos.z; bpos.z < max.z; ++bpos.z) {
+		for (bpos.y = box.pos.y; bpos.y < max.y; ++bpos.y) {
+			for (bpos.x = box.pos.x; bpos.x < max.x; ++bpos.x) {
+				if (resized || !prev_box.contains(bpos)) {
+					VoxelBlock **p = _blocks.getptr(bpos);
+					_grid.write[get_grid_index(bpos)] = p ? *p : NULL;
+				}
+			}
+		}
+	}
+}
+
+void VoxelMap::get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask) const {
 
-	Vector3i max_pos = min_pos + dst_buffer.get_size();
+	const Vector3i size = dst_buffer.get_size();
+	if (size.x == 0 || size.y == 0 || size.z == 0) {
+		return;
+	}
 
+	Vector3i max_pos = min_pos + size;
+
+	// Any area can be copied, blocks partially covered are clamped
 	Vector3i min_block_pos = voxel_to_block(min_pos);
 	Vector3i max_block_pos = voxel_to_block(max_pos - Vector3i(1, 1, 1)) + Vector3i(1, 1, 1);
-	// TODO Why is this function limited by this check?
-	ERR_FAIL_COND((max_block_pos - min_block_pos) != Vector3i(3, 3, 3));
 
 	const Vector3i block_size_v(_block_size, _block_size, _block_size);
 
+	// Take snapshots of the blocks first, so the main thread is not blocked while voxels are copied.
+	// Values of blocks without VoxelBlock are kept instead.
+	Vector<Ref<VoxelBuffer> > snapshots;
+	Vector<VoxelUniformOctree::Values> uniform_values;
+	VoxelBuffer::Depth channel_depths[VoxelBuffer::MAX_CHANNELS];
+	{
+		RWLockRead lock(_lock);
+
+		Vector3i bpos;
+		for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
+			for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
+				for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
+					const VoxelBlock *block = find_block(bpos);
+					if (block) {
+						snapshots.push_back(make_snapshot(*block));
+					} else {
+						snapshots.push_back(Ref<VoxelBuffer>());
+						VoxelUniformOctree::Values values;
+						memcpy(values.channels, get_uniform_values(bpos), sizeof(values.channels));
+						uniform_values.push_back(values);
+					}
+				}
+			}
+		}
+
+		for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+			channel_depths[i] = _channel_depths[i];
+		}
+	}
+
 	for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
 
 		if (((1 << channel) & channels_mask) == 0) {
 			continue;
 		}
 
+		// Blocks are copied as-is, so the destination must have the same format.
+		// This does nothing if it already has it.
+		dst_buffer.set_channel_depth(channel, channel_depths[channel]);
+
+		int snapshot_index = 0;
+		int uniform_index = 0;
 		Vector3i bpos;
 		for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
 			for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
 				for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
 
-					VoxelBlock *block = get_block(bpos);
-					if (block) {
+					const Ref<VoxelBuffer> &src_buffer = snapshots[snapshot_index++];
+					Vector3i offset = block_to_voxel(bpos);
 
-						VoxelBuffer &src_buffer = **block->voxels;
-						Vector3i offset = block_to_voxel(bpos);
-						// Note: copy_from takes care of clamping the area if it's on an edge
-						dst_buffer.copy_from(src_buffer,
+					if (src_buffer.is_valid() && src_buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_UNIFORM) {
+						// Note: copy_from takes care of clamping the area if it's on an edge.
+						// If the destination is exactly this block, data gets shared instead of copied.
+						dst_buffer.copy_from(**src_buffer,
 								min_pos - offset,
 								max_pos - offset,
 								offset - min_pos,
 								channel);
 
+					} else if (src_buffer.is_valid()) {
+						// Filling allows the destination to stay compressed
+						dst_buffer.fill_area(
+								src_buffer->get_voxel(0, 0, 0, channel),
+								offset - min_pos,
+								offset - min_pos + block_size_v,
+								channel);
+
 					} else {
-						Vector3i offset = block_to_voxel(bpos);
 						dst_buffer.fill_area(
-								_default_voxel[channel],
+								uniform_values[uniform_index++].channels[channel],
 								offset - min_pos,
 								offset - min_pos + block_size_v,
 								channel);
@@ -190,7 +796,42 @@ void VoxelMap::get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsign
 	}
 }
 
+Ref<VoxelBuffer> VoxelMap::get_block_snapshot(Vector3i bpos) const {
+	RWLockRead lock(_lock);
+	const VoxelBlock *block = find_block(bpos);
+	if (block == NULL) {
+		const VoxelUniformOctree::Values *values = _uniform_blocks.find(bpos);
+		if (values) {
+			// Uniform buffers don't allocate voxels
+			return create_buffer(values->channels);
+		}
+		return Ref<VoxelBuffer>();
+	}
+	return make_snapshot(*block);
+}
+
+Ref<VoxelBuffer> VoxelMap::make_snapshot(const VoxelBlock &block) const {
+
+	if (!block.is_compressed()) {
+		return block.voxels->duplicate();
+	}
+
+	// Only the main thread decompresses blocks in place, and cold blocks are rarely needed by other threads.
+	// The serializer of the map can't be shared either, so a temporary one is used.
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	VoxelBlockSerializer serializer;
+	bool ok = serializer.decompress_and_deserialize(block.compressed_voxels.ptr(), block.compressed_voxels.size(), **buffer);
+	ERR_FAIL_COND_V(!ok, Ref<VoxelBuffer>());
+
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		buffer->set_channel_depth(i, _channel_depths[i]);
+	}
+	return buffer;
+}
+
 void VoxelMap::clear() {
+	RWLockWrite lock(_lock);
 	const Vector3i *key = NULL;
 	while (key = _blocks.next(key)) {
 		VoxelBlock *block_ptr = _blocks.get(*key);
@@ -200,7 +841,204 @@ void VoxelMap::clear() {
 		memdelete(block_ptr);
 	}
 	_blocks.clear();
+	_uniform_blocks.clear();
+	_journal.clear();
+	for (int i = 0; i < _grid.size(); ++i) {
+		_grid.write[i] = NULL;
+	}
 	_last_accessed_block = NULL;
+	_cold_blocks.clear();
+	_stats.compressed_blocks = 0;
+	_stats.compressed_memory = 0;
+}
+
+void VoxelMap::set_cold_block_frames(int frames) {
+	ERR_FAIL_COND(frames < 0);
+	_cold_block_frames = frames;
+	_next_cold_scan_frame = _frame;
+}
+
+void VoxelMap::compress_cold_blocks(uint32_t time_budget_usec) {
+
+	++_frame;
+
+	if (_cold_block_frames == 0) {
+		return;
+	}
+
+	OS &os = *OS::get_singleton();
+	const uint64_t time_before = os.get_ticks_usec();
+
+	if (_cold_blocks.size() == 0) {
+		if (_frame < _next_cold_scan_frame) {
+			return;
+		}
+		// Scanning all blocks is not free, so it's done periodically.
+		// Blocks get compressed at most a quarter of the delay late.
+		_next_cold_scan_frame = _frame + MAX(1, _cold_block_frames / 4);
+
+		const Vector3i *key = NULL;
+		while (key = _blocks.next(key)) {
+			const VoxelBlock *block = _blocks.get(*key);
+			if (!block->is_compressed() && _frame - block->last_access_frame >= (uint32_t)_cold_block_frames) {
+				_cold_blocks.push_back(*key);
+			}
+		}
+	}
+
+	while (_cold_blocks.size() != 0) {
+
+		const Vector3i bpos = _cold_blocks[_cold_blocks.size() - 1];
+		_cold_blocks.resize(_cold_blocks.size() - 1);
+
+		// The block may have been removed or accessed since the scan
+		VoxelBlock **p = _blocks.getptr(bpos);
+		if (p != NULL) {
+			VoxelBlock *block = *p;
+			if (!block->is_compressed() && _frame - block->last_access_frame >= (uint32_t)_cold_block_frames) {
+				compress_block(block);
+			}
+		}
+
+		if (os.get_ticks_usec() - time_before >= time_budget_usec) {
+			break;
+		}
+	}
+}
+
+void VoxelMap::set_memory_budget(uint64_t budget) {
+	_memory_budget = budget;
+	_next_budget_check_frame = _frame;
+}
+
+uint64_t VoxelMap::get_memory_usage() const {
+	uint64_t size = 0;
+	const Vector3i *key = NULL;
+	while (key = _blocks.next(key)) {
+		size += _blocks.get(*key)->get_memory_usage();
+	}
+	return size + _uniform_blocks.get_memory_usage();
+}
+
+struct BlockEvictionCandidate {
+	Vector3i bpos;
+	uint32_t size;
+	uint64_t score;
+};
+
+// Highest scores first
+struct BlockEvictionComparator {
+	inline bool operator()(const BlockEvictionCandidate &a, const BlockEvictionCandidate &b) const {
+		return a.score > b.score;
+	}
+};
+
+bool VoxelMap::get_blocks_over_budget(Vector3i viewer_block_pos, Vector<Vector3i> &out_positions) {
+
+	if (_memory_budget == 0 || _frame < _next_budget_check_frame) {
+		return false;
+	}
+	// Memory usage doesn't change much from one frame to the next
+	_next_budget_check_frame = _frame + 30;
+
+	// How many frames without access a block of distance is worth
+	const uint64_t distance_weight = 60;
+
+	Vector<BlockEvictionCandidate> candidates;
+	candidates.resize(_blocks.size());
+	// Collapsed blocks are not candidates, they take almost nothing
+	uint64_t total_size = _uniform_blocks.get_memory_usage();
+	int i = 0;
+
+	const Vector3i *key = NULL;
+	while (key = _blocks.next(key)) {
+		const VoxelBlock *block = _blocks.get(*key);
+		BlockEvictionCandidate &c = candidates.write[i++];
+		c.bpos = *key;
+		c.size = block->get_memory_usage();
+		c.score = (_frame - block->last_access_frame) + distance_weight * (uint64_t)Math::sqrt((real_t)viewer_block_pos.distance_sq(*key));
+		total_size += c.size;
+	}
+
+	_stats.memory_usage = total_size;
+
+	if (total_size <= _memory_budget) {
+		return true;
+	}
+
+	SortArray<BlockEvictionCandidate, BlockEvictionComparator> sorter;
+	sorter.sort(candidates.ptrw(), candidates.size());
+
+	for (i = 0; i < candidates.size() && total_size > _memory_budget; ++i) {
+		const BlockEvictionCandidate &c = candidates[i];
+		out_positions.push_back(c.bpos);
+		total_size -= c.size;
+	}
+
+	return true;
+}
+
+void VoxelMap::compress_block(VoxelBlock *block) {
+	CRASH_COND(block->is_compressed());
+
+	if (block->voxels->reference_get_count() > 1) {
+		// Something else is using the voxels, it would not see changes made after decompression
+		return;
+	}
+
+	Vector<uint8_t> compressed_voxels;
+	_serializer.serialize_and_compress(**block->voxels, compressed_voxels);
+	{
+		RWLockWrite lock(_lock);
+		block->compressed_voxels = compressed_voxels;
+		block->voxels.unref();
+	}
+
+	++_stats.compressed_blocks;
+	++_stats.compression_count;
+	_stats.compressed_memory += block->compressed_voxels.size();
+	_stats.total_compressed_bytes += block->compressed_voxels.size();
+}
+
+void VoxelMap::decompress_block(VoxelBlock *block) {
+	CRASH_COND(!block->is_compressed());
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	bool ok = _serializer.decompress_and_deserialize(block->compressed_voxels.ptr(), block->compressed_voxels.size(), **buffer);
+	CRASH_COND(!ok);
+
+	// The format of the map may have changed in the meantime
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		buffer->set_channel_depth(i, _channel_depths[i]);
+	}
+
+	--_stats.compressed_blocks;
+	++_stats.decompression_count;
+	_stats.compressed_memory -= block->compressed_voxels.size();
+	_stats.total_decompressed_bytes += block->compressed_voxels.size();
+
+	RWLockWrite lock(_lock);
+	block->voxels = buffer;
+	block->compressed_voxels.clear();
+}
+
+Dictionary VoxelMap::get_statistics() const {
+	Dictionary d;
+	d["compressed_blocks"] = _stats.compressed_blocks;
+	d["compressed_memory"] = _stats.compressed_memory;
+	d["total_compressed_bytes"] = _stats.total_compressed_bytes;
+	d["total_decompressed_bytes"] = _stats.total_decompressed_bytes;
+	d["compression_count"] = _stats.compression_count;
+	d["decompression_count"] = _stats.decompression_count;
+	d["memory_usage"] = _stats.memory_usage;
+	d["memory_budget"] = _memory_budget;
+	d["collapsed_blocks"] = _uniform_blocks.get_block_count();
+	d["collapsed_nodes"] = _uniform_blocks.get_node_count();
+	d["collapse_count"] = _stats.collapse_count;
+	d["uncollapse_count"] = _stats.uncollapse_count;
+	d["journal_memory_usage"] = _journal.get_memory_usage();
+	return d;
 }
 
 void VoxelMap::_bind_methods() {
@@ -211,19 +1049,45 @@ void VoxelMap::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_voxel_f", "value", "x", "y", "z", "c"), &VoxelMap::set_voxel_f, DEFVAL(VoxelBuffer::CHANNEL_ISOLEVEL));
 	ClassDB::bind_method(D_METHOD("get_voxel_v", "pos", "c"), &VoxelMap::_get_voxel_v_binding, DEFVAL(0));
 	ClassDB::bind_method(D_METHOD("set_voxel_v", "value", "pos", "c"), &VoxelMap::_set_voxel_v_binding, DEFVAL(0));
-	ClassDB::bind_method(D_METHOD("get_default_voxel", "channel"), &VoxelMap::get_default_voxel, DEFVAL(0));
-	ClassDB::bind_method(D_METHOD("set_default_voxel", "value", "channel"), &VoxelMap::set_default_voxel, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("get_default_voxel", "channel"), &VoxelMap::_get_default_voxel_binding, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("set_default_voxel", "value", "channel"), &VoxelMap::_set_default_voxel_binding, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("set_channel_depth", "channel", "depth"), &VoxelMap::set_channel_depth);
+	ClassDB::bind_method(D_METHOD("get_channel_depth", "channel"), &VoxelMap::get_channel_depth);
 	ClassDB::bind_method(D_METHOD("has_block", "x", "y", "z"), &VoxelMap::_has_block_binding);
-	ClassDB::bind_method(D_METHOD("get_buffer_copy", "min_pos", "out_buffer", "channel"), &VoxelMap::_get_buffer_copy_binding, DEFVAL(0));
-	ClassDB::bind_method(D_METHOD("set_block_buffer", "block_pos", "buffer"), &VoxelMap::_set_block_buffer_binding);
+	ClassDB::bind_method(D_METHOD("get_buffer_copy", "min_pos", "out_buffer", "channels_mask"), &VoxelMap::_get_buffer_copy_binding, DEFVAL(1));
+	ClassDB::bind_method(D_METHOD("set_block_buffer", "block_pos", "buffer", "modified"), &VoxelMap::_set_block_buffer_binding, DEFVAL(true));
+	ClassDB::bind_method(D_METHOD("is_block_modified", "block_pos"), &VoxelMap::_is_block_modified_binding);
+	ClassDB::bind_method(D_METHOD("set_block_modified", "block_pos", "modified"), &VoxelMap::_set_block_modified_binding);
+	ClassDB::bind_method(D_METHOD("set_streamed", "streamed"), &VoxelMap::set_streamed);
+	ClassDB::bind_method(D_METHOD("is_streamed"), &VoxelMap::is_streamed);
 	ClassDB::bind_method(D_METHOD("voxel_to_block", "voxel_pos"), &VoxelMap::_voxel_to_block_binding);
 	ClassDB::bind_method(D_METHOD("block_to_voxel", "block_pos"), &VoxelMap::_block_to_voxel_binding);
 	ClassDB::bind_method(D_METHOD("get_block_size"), &VoxelMap::get_block_size);
 
+	ClassDB::bind_method(D_METHOD("set_cold_block_frames", "frames"), &VoxelMap::set_cold_block_frames);
+	ClassDB::bind_method(D_METHOD("get_cold_block_frames"), &VoxelMap::get_cold_block_frames);
+	ClassDB::bind_method(D_METHOD("compress_cold_blocks", "time_budget_usec"), &VoxelMap::compress_cold_blocks);
+	ClassDB::bind_method(D_METHOD("get_statistics"), &VoxelMap::get_statistics);
+
+	ClassDB::bind_method(D_METHOD("set_journal_enabled", "enabled"), &VoxelMap::set_journal_enabled);
+	ClassDB::bind_method(D_METHOD("is_journal_enabled"), &VoxelMap::is_journal_enabled);
+	ClassDB::bind_method(D_METHOD("set_journal_memory_cap", "bytes"), &VoxelMap::set_journal_memory_cap);
+	ClassDB::bind_method(D_METHOD("get_journal_memory_cap"), &VoxelMap::get_journal_memory_cap);
+	ClassDB::bind_method(D_METHOD("begin_transaction"), &VoxelMap::begin_transaction);
+	ClassDB::bind_method(D_METHOD("end_transaction"), &VoxelMap::end_transaction);
+	ClassDB::bind_method(D_METHOD("can_undo"), &VoxelMap::can_undo);
+	ClassDB::bind_method(D_METHOD("can_redo"), &VoxelMap::can_redo);
+	ClassDB::bind_method(D_METHOD("undo"), &VoxelMap::_undo_binding);
+	ClassDB::bind_method(D_METHOD("redo"), &VoxelMap::_redo_binding);
+
+	ClassDB::bind_method(D_METHOD("set_memory_budget", "bytes"), &VoxelMap::set_memory_budget);
+	ClassDB::bind_method(D_METHOD("get_memory_budget"), &VoxelMap::get_memory_budget);
+	ClassDB::bind_method(D_METHOD("get_memory_usage"), &VoxelMap::get_memory_usage);
+
 	//ADD_PROPERTY(PropertyInfo(Variant::INT, "iterations"), _SCS("set_iterations"), _SCS("get_iterations"));
 }
 
-void VoxelMap::_get_buffer_copy_binding(Vector3 pos, Ref<VoxelBuffer> dst_buffer_ref, unsigned int channel) {
+void VoxelMap::_get_buffer_copy_binding(Vector3 pos, Ref<VoxelBuffer> dst_buffer_ref, unsigned int channels_mask) const {
 	ERR_FAIL_COND(dst_buffer_ref.is_null());
-	get_buffer_copy(Vector3i(pos), **dst_buffer_ref, channel);
+	get_buffer_copy(Vector3i(pos), **dst_buffer_ref, channels_mask);
 }
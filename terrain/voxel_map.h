@@ -1,12 +1,21 @@
 #ifndef VOXEL_MAP_H
 #define VOXEL_MAP_H
 
+#include "../math/rect3i.h"
+#include "../voxel_block_serializer.h"
 #include "voxel_block.h"
+#include "voxel_edit_journal.h"
+#include "voxel_uniform_octree.h"
 
 #include <core/hash_map.h>
+#include <core/os/rw_lock.h>
 #include <scene/main/node.h>
 
-// Infinite voxel storage by means of octants like Gridmap, within a constant LOD
+// Infinite voxel storage by means of octants like Gridmap, within a constant LOD (see VoxelLodMap for more).
+// Blocks having the same value everywhere and nothing to display can be collapsed into a sparse octree,
+// where they take no memory of their own. They count as loaded, and get a VoxelBlock again when modified.
+// Only the main thread modifies the map, and it holds the write lock while doing so.
+// Other threads can read voxels with get_buffer_copy() and get_block_snapshot(), all other functions are main thread only.
 class VoxelMap : public Reference {
 	GDCLASS(VoxelMap, Reference)
 public:
@@ -42,36 +51,108 @@ public:
 	_FORCE_INLINE_ unsigned int get_block_size_pow2() const { return _block_size_pow2; }
 	_FORCE_INLINE_ unsigned int get_block_size_mask() const { return _block_size_mask; }
 
-	int get_voxel(Vector3i pos, unsigned int c = 0);
-	void set_voxel(int value, Vector3i pos, unsigned int c = 0);
+	uint32_t get_voxel(Vector3i pos, unsigned int c = 0);
+	void set_voxel(uint32_t value, Vector3i pos, unsigned int c = 0);
 
 	float get_voxel_f(int x, int y, int z, unsigned int c = VoxelBuffer::CHANNEL_ISOLEVEL);
 	void set_voxel_f(real_t value, int x, int y, int z, unsigned int c = VoxelBuffer::CHANNEL_ISOLEVEL);
 
-	void set_default_voxel(int value, unsigned int channel = 0);
-	int get_default_voxel(unsigned int channel = 0);
+	struct Edit {
+		Vector3i position;
+		uint32_t value;
+		unsigned int channel;
+	};
+
+	// Batched edits, applied block by block so each block is looked up once.
+	// Blocks are created if they don't exist, like set_voxel() does.
+	// If out_boxes is given, it receives the box of voxels modified in each block.
+	void set_voxels(const Vector<Edit> &edits, Vector<Rect3i> *out_boxes = NULL);
+	void fill_area(uint32_t value, Rect3i box, unsigned int channel, Vector<Rect3i> *out_boxes = NULL);
+	// Copies voxels of the given buffer into the map, starting at min_pos. Channels must have the same depth as the map.
+	void paste(Vector3i min_pos, const VoxelBuffer &src_buffer, unsigned int channels_mask, Vector<Rect3i> *out_boxes = NULL);
+
+	// Edits made with the functions above can be recorded, so they can be undone. Disabled by default.
+	void set_journal_enabled(bool enabled);
+	bool is_journal_enabled() const { return _journal_enabled; }
+	void set_journal_memory_cap(uint64_t bytes) { _journal.set_memory_cap(bytes); }
+	uint64_t get_journal_memory_cap() const { return _journal.get_memory_cap(); }
+
+	// Edits made between these calls are undone together. Calls can be nested.
+	void begin_transaction();
+	void end_transaction();
+
+	bool can_undo() const { return _journal.can_undo(); }
+	bool can_redo() const { return _journal.can_redo(); }
+	// Restores voxels modified by the last transaction. Blocks unloaded since then are skipped.
+	// If out_boxes is given, it receives the box of voxels modified in each block, one per block.
+	bool undo(Vector<Rect3i> *out_boxes = NULL);
+	bool redo(Vector<Rect3i> *out_boxes = NULL);
+
+	void set_default_voxel(uint32_t value, unsigned int channel = 0);
+	uint32_t get_default_voxel(unsigned int channel = 0);
+
+	// All blocks of the map have the same channel depths.
+	// Blocks already in the map are converted, and so are buffers given to set_block_buffer() if needed.
+	void set_channel_depth(unsigned int channel, VoxelBuffer::Depth depth);
+	VoxelBuffer::Depth get_channel_depth(unsigned int channel) const;
 
 	// Gets a copy of all voxels in the area starting at min_pos having the same size as dst_buffer.
-	void get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask = 1);
+	// The area can have any size and position. dst_buffer can be re-used between calls.
+	// Can be called from any thread.
+	void get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask = 1) const;
+
+	// Gets a copy of the voxels of a block, or null if there is no block at this position.
+	// Channel data is shared until either side modifies it, so this is cheap. Can be called from any thread.
+	Ref<VoxelBuffer> get_block_snapshot(Vector3i bpos) const;
+
+	// Must be held for writing by the main thread when it modifies voxels of a block directly
+	RWLock *get_lock() const { return _lock; }
 
 	// Moves the given buffer into a block of the map. The buffer is referenced, no copy is made.
-	void set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer);
+	// modified must be false if the buffer comes from the provider, so the block won't be saved unless edited.
+	// If the block was waiting for its voxels, edits it received are applied to the buffer (see set_streamed).
+	void set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer, bool modified = true);
+
+	// Streamed maps get their blocks from a provider, and edits can reach positions that are not loaded yet.
+	// The block created by such an edit remembers which voxels got edited, and waits for its voxels:
+	// it is not considered modified, and set_block_buffer() applies the edits over the loaded voxels.
+	// Otherwise, edits create blocks filled with default values. Disabled by default.
+	void set_streamed(bool streamed) { _streamed = streamed; }
+	bool is_streamed() const { return _streamed; }
 
 	struct NoAction {
 		inline void operator()(VoxelBlock *block) {}
 	};
 
+	// Collapsed blocks have no VoxelBlock, so the action is not called for them
 	template <typename Action_T>
 	void remove_block(Vector3i bpos, Action_T pre_delete) {
 		if (_last_accessed_block && _last_accessed_block->pos == bpos)
 			_last_accessed_block = NULL;
 		VoxelBlock **pptr = _blocks.getptr(bpos);
-		if (pptr) {
+		if (pptr == NULL) {
+			if (_uniform_blocks.has(bpos)) {
+				RWLockWrite lock(_lock);
+				_uniform_blocks.remove(bpos);
+			}
+		} else {
 			VoxelBlock *block = *pptr;
 			ERR_FAIL_COND(block == NULL);
+			// Note: voxels of the block might be compressed at this point
 			pre_delete(block);
+			if (block->is_compressed()) {
+				--_stats.compressed_blocks;
+				_stats.compressed_memory -= block->compressed_voxels.size();
+			}
+			{
+				RWLockWrite lock(_lock);
+				_blocks.erase(bpos);
+				if (_grid_box.contains(bpos)) {
+					_grid.write[get_grid_index(bpos)] = NULL;
+				}
+			}
+			// Other threads can't find it anymore
 			memdelete(block);
-			_blocks.erase(bpos);
 		}
 	}
 
@@ -105,13 +186,92 @@ public:
 		}
 	}*/
 
+	// Gets a block, decompressing its voxels if needed. Returns NULL for collapsed blocks.
 	VoxelBlock *get_block(Vector3i bpos);
+	// Same as get_block(), but creates the block if it is collapsed or doesn't exist
+	VoxelBlock *get_or_create_block(Vector3i bpos);
 
+	// Collapsed blocks are included
 	bool has_block(Vector3i pos) const;
+	// Same as has_block(), excluding blocks waiting for their voxels
+	bool is_block_loaded(Vector3i bpos) const;
+
+	// Incremented every time voxels of a block are modified through the map, and given to that block.
+	// Collapsed blocks and positions without block have version 0.
+	uint32_t get_data_version() const { return _data_version; }
+	uint32_t get_block_data_version(Vector3i bpos) const;
+	// Must be called when voxels of a block are modified without going through the map
+	_FORCE_INLINE_ void mark_modified(VoxelBlock *block) {
+		block->data_version = ++_data_version;
+		block->modified = true;
+	}
+	// See VoxelBlock::modified. Collapsed blocks and blocks waiting for their voxels are never modified.
+	bool is_block_modified(Vector3i bpos) const;
+	void set_block_modified(Vector3i bpos, bool modified);
+
+	// If all voxels of the block have the same value, moves it to the octree of uniform blocks, deleting its VoxelBlock.
+	// Meant for blocks having nothing to display. Returns true if the block is collapsed.
+	// Modified blocks are not collapsed, because they would no longer be known as needing to be saved.
+	bool collapse_block(Vector3i bpos);
+	bool is_block_collapsed(Vector3i bpos) const { return _uniform_blocks.has(bpos); }
+	// True if all neighbors of the block are loaded
 	bool is_block_surrounded(Vector3i pos) const;
 
+	// Blocks inside this box are also indexed in a grid wrapping around its edges, so looking them up doesn't need hashing.
+	// Meant to follow the area loaded around the viewer: moving it only updates the slots of positions entering it.
+	// An empty box disables the grid.
+	void set_grid_box(Rect3i box);
+	Rect3i get_grid_box() const { return _grid_box; }
+
 	void clear();
 
+	// Blocks not accessed during this many calls to compress_cold_blocks() get compressed. 0 disables compression.
+	void set_cold_block_frames(int frames);
+	int get_cold_block_frames() const { return _cold_block_frames; }
+
+	// Compresses blocks that were not accessed for a while. Should be called once per frame.
+	// Stops when the time budget is exceeded, remaining blocks are handled in the next calls.
+	void compress_cold_blocks(uint32_t time_budget_usec);
+
+	// Maximum amount of memory blocks should take, in bytes. 0 means no limit.
+	void set_memory_budget(uint64_t budget);
+	uint64_t get_memory_budget() const { return _memory_budget; }
+
+	// Bytes used by voxels and meshes of all blocks. Requires to go through all of them.
+	uint64_t get_memory_usage() const;
+
+	// If blocks take more memory than the budget, finds which ones should be unloaded to fit in it.
+	// Blocks far from the viewer and not accessed for a while go first.
+	// Checking requires to go through all blocks, so it's only done every few calls. Returns true if it was done.
+	bool get_blocks_over_budget(Vector3i viewer_block_pos, Vector<Vector3i> &out_positions);
+
+	struct Stats {
+		int compressed_blocks; // How many blocks are currently compressed
+		uint64_t compressed_memory; // How many bytes compressed blocks are currently using
+		uint64_t total_compressed_bytes; // How many bytes were produced by compressions so far
+		uint64_t total_decompressed_bytes; // How many bytes were read by decompressions so far
+		uint32_t compression_count;
+		uint32_t decompression_count;
+		uint64_t memory_usage; // Bytes used by blocks, as of the last budget check
+		uint32_t collapse_count;
+		uint32_t uncollapse_count;
+
+		Stats() :
+				compressed_blocks(0),
+				compressed_memory(0),
+				total_compressed_bytes(0),
+				total_decompressed_bytes(0),
+				compression_count(0),
+				decompression_count(0),
+				memory_usage(0),
+				collapse_count(0),
+				uncollapse_count(0) {}
+	};
+
+	const Stats &get_stats() const { return _stats; }
+	Dictionary get_statistics() const;
+
+	// Voxels of blocks passed to this function are not decompressed, use get_block() if you need them
 	template <typename Op_T>
 	void for_all_blocks(Op_T op) {
 		const Vector3i *key = NULL;
@@ -126,36 +286,121 @@ public:
 private:
 	void set_block(Vector3i bpos, VoxelBlock *block);
 	VoxelBlock *get_or_create_block_at_voxel_pos(Vector3i pos);
+	Ref<VoxelBuffer> create_buffer(const uint32_t *values) const;
+
+	// Must be called within a transaction, before voxels of the block get modified
+	_FORCE_INLINE_ void record_edit(const VoxelBlock *block, Rect3i box, unsigned int channel) {
+		if (_journal_enabled) {
+			_journal.record(**block->voxels, block->pos, box, channel);
+		}
+	}
+
+	// Must be called when voxels of a block get modified, so blocks waiting for their voxels know which ones to keep
+	_FORCE_INLINE_ void mark_edited(VoxelBlock *block, Rect3i box, unsigned int channel) {
+		if (block->edit_mask.is_valid()) {
+			block->edit_mask->fill_area(1, box.pos, box.pos + box.size, channel);
+		}
+	}
+
+	static void apply_edits(const VoxelBuffer &edits, const VoxelBuffer &edit_mask, VoxelBuffer &dst);
+
+	void apply_transaction(const VoxelEditJournal::Transaction &transaction, bool restore_old_values, Vector<Rect3i> *out_boxes);
+
+	// Values of voxels in a block without VoxelBlock, collapsed or not loaded
+	_FORCE_INLINE_ const uint32_t *get_uniform_values(Vector3i bpos) const {
+		const VoxelUniformOctree::Values *values = _uniform_blocks.find(bpos);
+		return values ? values->channels : _default_voxel;
+	}
+
+	// Finds a block without touching it. Returns NULL if there is none at this position.
+	_FORCE_INLINE_ VoxelBlock *find_block(Vector3i bpos) const {
+		if (_grid_box.contains(bpos)) {
+			return _grid[get_grid_index(bpos)];
+		}
+		VoxelBlock *const *p = _blocks.getptr(bpos);
+		return p ? *p : NULL;
+	}
+
+	// Grid dimensions are powers of two, so positions wrap with a mask
+	_FORCE_INLINE_ unsigned int get_grid_index(Vector3i bpos) const {
+		return (bpos.x & _grid_mask.x) + _grid_size.x * ((bpos.y & _grid_mask.y) + _grid_size.y * (bpos.z & _grid_mask.z));
+	}
 
 	void set_block_size_pow2(unsigned int p);
 
+	void compress_block(VoxelBlock *block);
+	void decompress_block(VoxelBlock *block);
+
+	// Must be called with the lock held
+	Ref<VoxelBuffer> make_snapshot(const VoxelBlock &block) const;
+
 	static void _bind_methods();
 
-	_FORCE_INLINE_ int _get_voxel_binding(int x, int y, int z, unsigned int c = 0) { return get_voxel(Vector3i(x, y, z), c); }
-	_FORCE_INLINE_ void _set_voxel_binding(int value, int x, int y, int z, unsigned int c = 0) { set_voxel(value, Vector3i(x, y, z), c); }
-	_FORCE_INLINE_ int _get_voxel_v_binding(Vector3 pos, unsigned int c = 0) { return get_voxel(Vector3i(pos), c); }
-	_FORCE_INLINE_ void _set_voxel_v_binding(int value, Vector3 pos, unsigned int c = 0) { set_voxel(value, Vector3i(pos), c); }
+	_FORCE_INLINE_ int64_t _get_voxel_binding(int x, int y, int z, unsigned int c = 0) { return get_voxel(Vector3i(x, y, z), c); }
+	_FORCE_INLINE_ void _set_voxel_binding(int64_t value, int x, int y, int z, unsigned int c = 0) { set_voxel(value, Vector3i(x, y, z), c); }
+	_FORCE_INLINE_ int64_t _get_voxel_v_binding(Vector3 pos, unsigned int c = 0) { return get_voxel(Vector3i(pos), c); }
+	_FORCE_INLINE_ void _set_voxel_v_binding(int64_t value, Vector3 pos, unsigned int c = 0) { set_voxel(value, Vector3i(pos), c); }
+	_FORCE_INLINE_ int64_t _get_default_voxel_binding(unsigned int channel) { return get_default_voxel(channel); }
+	bool _undo_binding() { return undo(); }
+	bool _redo_binding() { return redo(); }
+	_FORCE_INLINE_ void _set_default_voxel_binding(int64_t value, unsigned int channel) { set_default_voxel(value, channel); }
 	_FORCE_INLINE_ bool _has_block_binding(int x, int y, int z) { return has_block(Vector3i(x, y, z)); }
 	_FORCE_INLINE_ Vector3 _voxel_to_block_binding(Vector3 pos) const { return voxel_to_block(Vector3i(pos)).to_vec3(); }
 	_FORCE_INLINE_ Vector3 _block_to_voxel_binding(Vector3 pos) const { return block_to_voxel(Vector3i(pos)).to_vec3(); }
 	bool _is_block_surrounded(Vector3 pos) const { return is_block_surrounded(Vector3i(pos)); }
-	void _get_buffer_copy_binding(Vector3 pos, Ref<VoxelBuffer> dst_buffer_ref, unsigned int channel = 0);
-	void _set_block_buffer_binding(Vector3 bpos, Ref<VoxelBuffer> buffer) { set_block_buffer(Vector3i(bpos), buffer); }
+	void _get_buffer_copy_binding(Vector3 pos, Ref<VoxelBuffer> dst_buffer_ref, unsigned int channels_mask) const;
+	void _set_block_buffer_binding(Vector3 bpos, Ref<VoxelBuffer> buffer, bool modified) { set_block_buffer(Vector3i(bpos), buffer, modified); }
+	bool _is_block_modified_binding(Vector3 bpos) const { return is_block_modified(Vector3i(bpos)); }
+	void _set_block_modified_binding(Vector3 bpos, bool modified) { set_block_modified(Vector3i(bpos), modified); }
 
 private:
 	// Voxel values that will be returned if access is out of map bounds
-	uint8_t _default_voxel[VoxelBuffer::MAX_CHANNELS];
+	uint32_t _default_voxel[VoxelBuffer::MAX_CHANNELS];
+
+	VoxelBuffer::Depth _channel_depths[VoxelBuffer::MAX_CHANNELS];
 
 	// Blocks stored with a spatial hash in all 3D directions
 	HashMap<Vector3i, VoxelBlock *, Vector3iHasher> _blocks;
 
+	// Blocks having the same value in all their voxels, without VoxelBlock
+	VoxelUniformOctree _uniform_blocks;
+
+	// Blocks of the map within _grid_box, or NULL. Slots of positions outside the box are stale.
+	Vector<VoxelBlock *> _grid;
+	Rect3i _grid_box;
+	Vector3i _grid_size;
+	Vector3i _grid_mask;
+
 	// Voxel access will most frequently be in contiguous areas, so the same blocks are accessed.
 	// To prevent too much hashing, this reference is checked before.
+	// Only used by the main thread, other threads don't read blocks often enough to benefit from it.
 	VoxelBlock *_last_accessed_block;
 
+	// Protects blocks and their voxels from other threads reading while the main thread modifies them
+	RWLock *_lock;
+
 	unsigned int _block_size;
 	unsigned int _block_size_pow2;
 	unsigned int _block_size_mask;
+
+	// Incremented every call to compress_cold_blocks(), used to know how long ago blocks were accessed
+	uint32_t _frame;
+	int _cold_block_frames;
+	uint32_t _next_cold_scan_frame;
+	// Blocks found cold during the last scan, not compressed yet
+	Vector<Vector3i> _cold_blocks;
+
+	uint64_t _memory_budget;
+	uint32_t _next_budget_check_frame;
+
+	uint32_t _data_version;
+	bool _streamed;
+
+	VoxelEditJournal _journal;
+	bool _journal_enabled;
+
+	VoxelBlockSerializer _serializer;
+	Stats _stats;
 };
 
 #endif // VOXEL_MAP_H
@@ -2,8 +2,9 @@
 #include "../util/utility.h"
 #include <core/os/os.h>
 
-VoxelMeshUpdater::VoxelMeshUpdater(Ref<VoxelLibrary> library, MeshingParams params) {
+VoxelMeshUpdater::VoxelMeshUpdater(Ref<VoxelMap> map, Ref<VoxelLibrary> library, MeshingParams params) {
 
+	CRASH_COND(map.is_null());
 	CRASH_COND(library.is_null());
 	//CRASH_COND(params.materials.size() == 0);
 
@@ -18,6 +19,16 @@ VoxelMeshUpdater::VoxelMeshUpdater(Ref<VoxelLibrary> library, MeshingParams para
 		_dmc_mesher->set_octree_mode(VoxelMesherDMC::OCTREE_NONE);
 	}
 
+	_map = map;
+	_voxel_layout = params.voxel_layout;
+	const unsigned int padded_size = map->get_block_size() + 2 * get_required_padding();
+	_voxels.instance();
+	_voxels->create(padded_size, padded_size, padded_size);
+	if (_voxel_layout == VoxelBuffer::LAYOUT_BRICKS && VoxelBuffer::can_use_bricks(_voxels->get_size())) {
+		// Copies from the map get reordered into bricks
+		_voxels->set_layout(_voxel_layout);
+	}
+
 	_input_mutex = Mutex::create();
 	_output_mutex = Mutex::create();
 
@@ -115,6 +126,16 @@ int VoxelMeshUpdater::get_required_padding() const {
 		padding = max(padding, _dmc_mesher->get_minimum_padding());
 	}
 
+	if (_voxel_layout == VoxelBuffer::LAYOUT_BRICKS) {
+		// Meshers ignore extra padding, which can make the padded size a multiple of the brick size
+		const int block_size = _map->get_block_size();
+		for (int extra = 0; extra < (int)VoxelBuffer::BRICK_SIZE; ++extra) {
+			if (VoxelBuffer::can_use_bricks(Vector3i(block_size + 2 * (padding + extra)))) {
+				return padding + extra;
+			}
+		}
+	}
+
 	return padding;
 }
 
@@ -190,17 +211,27 @@ void VoxelMeshUpdater::thread_func() {
 
 void VoxelMeshUpdater::process_block(const InputBlock &block, OutputBlock &output) {
 
-	CRASH_COND(block.voxels.is_null());
-
 	int padding = get_required_padding();
 
-	_blocky_mesher->build(output.blocky_surfaces, **block.voxels, padding);
+	// Blocks can be modified by the main thread in the meantime, the map takes care of that
+	unsigned int channels_mask = (1 << VoxelBuffer::CHANNEL_TYPE) | (1 << VoxelBuffer::CHANNEL_ISOLEVEL);
+	_map->get_buffer_copy(_map->block_to_voxel(block.position) - Vector3i(padding), **_voxels, channels_mask);
+
+	// Meshers read raw channel data. Copying from uniform blocks with different values can leave palette channels.
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		if (((1 << i) & channels_mask) != 0 && _voxels->get_channel_compression(i) == VoxelBuffer::COMPRESSION_PALETTE) {
+			_voxels->decompress_channel(i);
+		}
+	}
+
+	_blocky_mesher->build(output.blocky_surfaces, **_voxels, padding);
 
 	if (_dmc_mesher.is_valid()) {
-		_dmc_mesher->build(output.smooth_surfaces, **block.voxels, padding);
+		_dmc_mesher->build(output.smooth_surfaces, **_voxels, padding);
 	}
 
 	output.position = block.position;
+	output.data_version = block.data_version;
 }
 
 // Sorts distance to viewer
@@ -8,12 +8,14 @@
 #include "../meshers/blocky/voxel_mesher_blocky.h"
 #include "../meshers/dmc/voxel_mesher_dmc.h"
 #include "../voxel_buffer.h"
+#include "voxel_map.h"
 
 class VoxelMeshUpdater {
 public:
+	// Voxels are read from the map by the thread, when the block gets processed
 	struct InputBlock {
-		Ref<VoxelBuffer> voxels;
 		Vector3i position;
+		uint32_t data_version; // Version of the block in the map when the update was requested
 	};
 
 	struct Input {
@@ -29,6 +31,7 @@ public:
 		VoxelMesher::Output blocky_surfaces;
 		VoxelMesher::Output smooth_surfaces;
 		Vector3i position;
+		uint32_t data_version; // Same as the request
 	};
 
 	struct Stats {
@@ -53,14 +56,17 @@ public:
 		bool baked_ao;
 		float baked_ao_darkness;
 		bool smooth_surface;
+		// Layout of voxels given to meshers. Bricks may add padding, see get_required_padding().
+		VoxelBuffer::Layout voxel_layout;
 
 		MeshingParams() :
 				baked_ao(true),
 				baked_ao_darkness(0.75),
-				smooth_surface(false) {}
+				smooth_surface(false),
+				voxel_layout(VoxelBuffer::LAYOUT_LINEAR) {}
 	};
 
-	VoxelMeshUpdater(Ref<VoxelLibrary> library, MeshingParams params);
+	VoxelMeshUpdater(Ref<VoxelMap> map, Ref<VoxelLibrary> library, MeshingParams params);
 	~VoxelMeshUpdater();
 
 	void push(const Input &input);
@@ -85,6 +91,11 @@ private:
 	Output _shared_output;
 	Mutex *_output_mutex;
 
+	Ref<VoxelMap> _map;
+	// Block voxels padded with neighbor voxels, re-used for every block
+	Ref<VoxelBuffer> _voxels;
+	VoxelBuffer::Layout _voxel_layout;
+
 	Ref<VoxelMesherBlocky> _blocky_mesher;
 	Ref<VoxelMesherDMC> _dmc_mesher;
 
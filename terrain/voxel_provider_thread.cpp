@@ -1,13 +1,12 @@
 #include "voxel_provider_thread.h"
 #include "../providers/voxel_provider.h"
-#include "../util/utility.h"
 #include "voxel_map.h"
 
 #include <core/os/os.h>
 #include <core/os/semaphore.h>
 #include <core/os/thread.h>
 
-VoxelProviderThread::VoxelProviderThread(Ref<VoxelProvider> provider, int block_size_pow2) {
+VoxelProviderThread::VoxelProviderThread(Ref<VoxelProvider> provider, int block_size_pow2, int thread_count) {
 
 	CRASH_COND(provider.is_null());
 	CRASH_COND(block_size_pow2 <= 0);
@@ -17,188 +16,330 @@ VoxelProviderThread::VoxelProviderThread(Ref<VoxelProvider> provider, int block_
 	_input_mutex = Mutex::create();
 	_output_mutex = Mutex::create();
 	_semaphore = Semaphore::create();
+	_needs_sort = false;
 	_thread_exit = false;
-	_thread = Thread::create(_thread_func, this);
+
+	// Providers that are not thread-safe only get one thread, and loading and saving take turns
+	thread_count = CLAMP(thread_count, 1, MAX_THREADS);
+	_provider_mutex = NULL;
+	if (!provider->is_thread_safe()) {
+		thread_count = 1;
+		_provider_mutex = Mutex::create();
+	}
+
+	_workers.resize(thread_count);
+	for (int i = 0; i < _workers.size(); ++i) {
+		Worker &worker = _workers.write[i];
+		worker.owner = this;
+		worker.thread = NULL;
+	}
+	// Started once the vector doesn't move anymore
+	for (int i = 0; i < _workers.size(); ++i) {
+		Worker &worker = _workers.write[i];
+		worker.thread = Thread::create(_thread_func, &worker);
+	}
+
+	_save_mutex = Mutex::create();
+	_save_semaphore = Semaphore::create();
+	_save_thread_exit = false;
+	_save_thread = Thread::create(_save_thread_func, this);
 }
 
 VoxelProviderThread::~VoxelProviderThread() {
 
 	_thread_exit = true;
-	_semaphore->post();
-	Thread::wait_to_finish(_thread);
+	for (int i = 0; i < _workers.size(); ++i) {
+		_semaphore->post();
+	}
+	for (int i = 0; i < _workers.size(); ++i) {
+		Thread::wait_to_finish(_workers[i].thread);
+		memdelete(_workers[i].thread);
+	}
+
+	// The save thread saves all remaining blocks before exiting
+	_save_thread_exit = true;
+	_save_semaphore->post();
+	Thread::wait_to_finish(_save_thread);
 
-	memdelete(_thread);
 	memdelete(_semaphore);
 	memdelete(_input_mutex);
 	memdelete(_output_mutex);
+
+	memdelete(_save_thread);
+	memdelete(_save_semaphore);
+	memdelete(_save_mutex);
+
+	if (_provider_mutex) {
+		memdelete(_provider_mutex);
+	}
 }
 
 void VoxelProviderThread::push(const InputData &input) {
 
-	bool should_run = false;
+	if (!input.blocks_to_immerge.empty()) {
+		{
+			MutexLock lock(_save_mutex);
+
+			for (int i = 0; i < input.blocks_to_immerge.size(); ++i) {
+				const ImmergeInput &ii = input.blocks_to_immerge[i];
+				// If the block is already waiting to be saved, only the latest version is kept
+				const ImmergeInput *prev = _blocks_to_save.getptr(ii.origin);
+				if (prev == NULL || prev->data_version <= ii.data_version) {
+					_blocks_to_save.set(ii.origin, ii);
+				}
+			}
+		}
+
+		_save_semaphore->post();
+	}
+
+	int batch_count = 0;
 
 	{
 		MutexLock lock(_input_mutex);
 
 		// TODO If the same request is sent twice, keep only the latest one
 
-		_shared_input.blocks_to_emerge.append_array(input.blocks_to_emerge);
-		_shared_input.blocks_to_immerge.append_array(input.blocks_to_immerge);
-		_shared_input.priority_block_position = input.priority_block_position;
+		if (!input.blocks_to_emerge.empty() || input.priority_block_position != _priority_block_position) {
+			_blocks_to_emerge.append_array(input.blocks_to_emerge);
+			_priority_block_position = input.priority_block_position;
+			_needs_sort = true;
+		}
 
-		should_run = !_shared_input.is_empty();
+		batch_count = (_blocks_to_emerge.size() + EMERGE_BATCH_SIZE - 1) / EMERGE_BATCH_SIZE;
 	}
 
-	// Notify the thread it should run
-	if (should_run) {
-		_semaphore->post();
+	// Wake up as many threads as there is work for
+	if (!input.blocks_to_emerge.empty()) {
+		const int count = MIN(batch_count, _workers.size());
+		for (int i = 0; i < count; ++i) {
+			_semaphore->post();
+		}
 	}
 }
 
 void VoxelProviderThread::pop(OutputData &out_data) {
 
-	MutexLock lock(_output_mutex);
+	{
+		MutexLock lock(_output_mutex);
 
-	out_data.emerged_blocks.append_array(_shared_output);
-	out_data.stats = _shared_stats;
-	_shared_output.clear();
-}
+		out_data.emerged_blocks.append_array(_shared_output);
+		_shared_output.clear();
 
-void VoxelProviderThread::_thread_func(void *p_self) {
-	VoxelProviderThread *self = reinterpret_cast<VoxelProviderThread *>(p_self);
-	self->thread_func();
-}
+		// Stats of the last frame anything was loaded
+		if (!_shared_stats.first) {
+			_last_stats = _shared_stats;
+			_shared_stats = Stats();
+		}
+		out_data.stats = _last_stats;
+	}
 
-void VoxelProviderThread::thread_func() {
+	{
+		MutexLock lock(_input_mutex);
+		out_data.stats.remaining_blocks = _blocks_to_emerge.size();
+	}
 
-	while (!_thread_exit) {
+	{
+		MutexLock lock(_save_mutex);
+		out_data.stats.remaining_saves = _blocks_to_save.size() + _blocks_being_saved.size();
+	}
+}
 
-		uint32_t sync_interval = 100.0; // milliseconds
-		uint32_t sync_time = OS::get_singleton()->get_ticks_msec() + sync_interval;
+void VoxelProviderThread::flush() {
+	while (true) {
+		{
+			MutexLock lock(_save_mutex);
+			if (_blocks_to_save.empty() && _blocks_being_saved.empty()) {
+				return;
+			}
+		}
+		OS::get_singleton()->delay_usec(1000);
+	}
+}
 
-		int emerge_index = 0;
-		Stats stats;
+void VoxelProviderThread::_thread_func(void *p_worker) {
+	Worker *worker = reinterpret_cast<Worker *>(p_worker);
+	worker->owner->thread_func(*worker);
+}
 
-		thread_sync(emerge_index, stats);
+void VoxelProviderThread::_save_thread_func(void *p_self) {
+	VoxelProviderThread *self = reinterpret_cast<VoxelProviderThread *>(p_self);
+	self->save_thread_func();
+}
 
-		while (!_input.is_empty() && !_thread_exit) {
-			//print_line(String("Thread runs: {0}").format(varray(_input.blocks_to_emerge.size())));
+// Sorts distance to viewer
+// The closest block will be the last one in the array, so it can be popped
+struct BlockPositionComparator {
+	Vector3i center;
+	inline bool operator()(const VoxelProviderThread::EmergeInput &a, const VoxelProviderThread::EmergeInput &b) const {
+		return a.block_position.distance_sq(center) > b.block_position.distance_sq(center);
+	}
+};
 
-			// TODO Block saving
-			_input.blocks_to_immerge.clear();
+void VoxelProviderThread::thread_func(Worker &worker) {
 
-			if (!_input.blocks_to_emerge.empty()) {
+	Vector<EmergeInput> batch;
+	Vector<EmergeOutput> output;
 
-				Vector3i block_pos = _input.blocks_to_emerge[emerge_index];
-				++emerge_index;
+	while (!_thread_exit) {
 
-				if (emerge_index >= _input.blocks_to_emerge.size()) {
-					_input.blocks_to_emerge.clear();
-				}
+		batch.clear();
 
-				int bs = 1 << _block_size_pow2;
-				Ref<VoxelBuffer> buffer = Ref<VoxelBuffer>(memnew(VoxelBuffer));
-				buffer->create(bs, bs, bs);
-
-				// Query voxel provider
-				Vector3i block_origin_in_voxels = block_pos * bs;
-				uint64_t time_before = OS::get_singleton()->get_ticks_usec();
-				_voxel_provider->emerge_block(buffer, block_origin_in_voxels);
-				uint64_t time_taken = OS::get_singleton()->get_ticks_usec() - time_before;
-
-				// Do some stats
-				if (stats.first) {
-					stats.first = false;
-					stats.min_time = time_taken;
-					stats.max_time = time_taken;
-				} else {
-					if (time_taken < stats.min_time)
-						stats.min_time = time_taken;
-					if (time_taken > stats.max_time)
-						stats.max_time = time_taken;
-				}
+		{
+			// All threads share the same queue, so the closest blocks are always loaded first
+			MutexLock lock(_input_mutex);
 
-				EmergeOutput eo;
-				eo.origin_in_voxels = block_origin_in_voxels;
-				eo.voxels = buffer;
-				_output.push_back(eo);
+			if (_needs_sort) {
+				SortArray<EmergeInput, BlockPositionComparator> sorter;
+				sorter.compare.center = _priority_block_position;
+				sorter.sort(_blocks_to_emerge.ptrw(), _blocks_to_emerge.size());
+				_needs_sort = false;
 			}
 
-			uint32_t time = OS::get_singleton()->get_ticks_msec();
-			if (time >= sync_time || _input.is_empty()) {
-
-				thread_sync(emerge_index, stats);
-
-				sync_time = OS::get_singleton()->get_ticks_msec() + sync_interval;
-				emerge_index = 0;
-				stats = Stats();
+			const int count = MIN(EMERGE_BATCH_SIZE, _blocks_to_emerge.size());
+			for (int i = 0; i < count; ++i) {
+				batch.push_back(_blocks_to_emerge[_blocks_to_emerge.size() - 1 - i]);
 			}
+			_blocks_to_emerge.resize(_blocks_to_emerge.size() - count);
 		}
 
-		if (_thread_exit)
-			break;
+		if (batch.empty()) {
+			// Wait for future wake-up
+			_semaphore->wait();
+			continue;
+		}
 
-		// Wait for future wake-up
-		_semaphore->wait();
+		Stats stats;
+		output.clear();
+		emerge_batch(worker, batch, output, stats);
+
+		{
+			// Post output
+			MutexLock lock(_output_mutex);
+			_shared_output.append_array(output);
+
+			// Stats are aggregated across threads
+			if (_shared_stats.first) {
+				_shared_stats = stats;
+			} else if (!stats.first) {
+				_shared_stats.min_time = MIN(_shared_stats.min_time, stats.min_time);
+				_shared_stats.max_time = MAX(_shared_stats.max_time, stats.max_time);
+			}
+		}
 	}
 
 	print_line("Thread exits");
 }
 
-// Sorts distance to viewer
-// The closest block will be the first one in the array
-struct BlockPositionComparator {
-	Vector3i center;
-	inline bool operator()(const Vector3i &a, const Vector3i &b) const {
-		return a.distance_sq(center) < b.distance_sq(center);
-	}
-};
+void VoxelProviderThread::emerge_batch(Worker &worker, const Vector<EmergeInput> &batch, Vector<EmergeOutput> &output, Stats &stats) {
 
-void VoxelProviderThread::thread_sync(int emerge_index, Stats stats) {
+	const int bs = 1 << _block_size_pow2;
+	Vector<VoxelProvider::BlockRequest> &requests = worker.requests;
+	requests.clear();
 
-	if (!_input.blocks_to_emerge.empty()) {
-		// Cleanup emerge vector
+	for (int i = 0; i < batch.size(); ++i) {
+		const EmergeInput &ei = batch[i];
 
-		if (emerge_index >= _input.blocks_to_emerge.size()) {
-			_input.blocks_to_emerge.clear();
+		EmergeOutput eo;
+		eo.origin_in_voxels = ei.block_position * bs;
 
-		} else if (emerge_index > 0) {
+		// A block that was unloaded recently may not be saved yet, in which case the provider would return old voxels
+		if (!get_pending_save(eo.origin_in_voxels, eo.voxels)) {
 
-			// Shift up remaining items since we use a Vector
-			shift_up(_input.blocks_to_emerge, emerge_index);
+			// Buffers are given to the map afterwards, so they can't be re-used
+			eo.voxels = Ref<VoxelBuffer>(memnew(VoxelBuffer));
+			eo.voxels->create(bs, bs, bs);
+
+			VoxelProvider::BlockRequest r;
+			r.voxels = eo.voxels;
+			r.origin_in_voxels = eo.origin_in_voxels;
+			requests.push_back(r);
 		}
+
+		// Buffers are filled before the output gets posted
+		output.push_back(eo);
+	}
+
+	if (requests.empty()) {
+		return;
 	}
 
+	// Query voxel provider
+	uint64_t time_taken;
 	{
-		// Get input
-		MutexLock lock(_input_mutex);
+		MutexLock lock(_provider_mutex);
+		uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+		_voxel_provider->emerge_blocks(requests);
+		// Blocks of a batch are not timed separately
+		time_taken = (OS::get_singleton()->get_ticks_usec() - time_before) / requests.size();
+	}
 
-		_input.blocks_to_emerge.append_array(_shared_input.blocks_to_emerge);
-		_input.blocks_to_immerge.append_array(_shared_input.blocks_to_immerge);
-		_input.priority_block_position = _shared_input.priority_block_position;
+	stats.first = false;
+	stats.min_time = time_taken;
+	stats.max_time = time_taken;
+}
+
+bool VoxelProviderThread::get_pending_save(Vector3i origin, Ref<VoxelBuffer> &out_voxels) {
+
+	MutexLock lock(_save_mutex);
 
-		_shared_input.blocks_to_emerge.clear();
-		_shared_input.blocks_to_immerge.clear();
+	const ImmergeInput *ii = _blocks_to_save.getptr(origin);
+	if (ii == NULL) {
+		ii = _blocks_being_saved.getptr(origin);
+	}
+	if (ii == NULL) {
+		return false;
 	}
 
-	stats.remaining_blocks = _input.blocks_to_emerge.size();
+	// Cheap, channel data is shared until modified
+	out_voxels = ii->voxels->duplicate();
+	return true;
+}
 
-	//	print_line(String("VoxelProviderThread: posting {0} blocks, {1} remaining ; cost [{2}..{3}] usec")
-	//			   .format(varray(_output.size(), _input.blocks_to_emerge.size(), stats.min_time, stats.max_time)));
+void VoxelProviderThread::save_thread_func() {
 
-	{
-		// Post output
-		MutexLock lock(_output_mutex);
-		_shared_output.append_array(_output);
-		_shared_stats = stats;
-		_output.clear();
-	}
+	while (true) {
+
+		_save_semaphore->wait();
 
-	if (!_input.blocks_to_emerge.empty()) {
-		// Re-sort priority
+		while (true) {
+			Vector<VoxelProvider::BlockRequest> requests;
+
+			{
+				// Take all blocks queued so far, more can be queued while they get saved
+				MutexLock lock(_save_mutex);
+
+				if (_blocks_to_save.empty()) {
+					break;
+				}
 
-		SortArray<Vector3i, BlockPositionComparator> sorter;
-		sorter.compare.center = _input.priority_block_position;
-		sorter.sort(_input.blocks_to_emerge.ptrw(), _input.blocks_to_emerge.size());
+				_blocks_being_saved = _blocks_to_save;
+				_blocks_to_save.clear();
+
+				const Vector3i *key = NULL;
+				while ((key = _blocks_being_saved.next(key))) {
+					const ImmergeInput &ii = _blocks_being_saved.get(*key);
+					VoxelProvider::BlockRequest r;
+					r.voxels = ii.voxels;
+					r.origin_in_voxels = ii.origin;
+					requests.push_back(r);
+				}
+			}
+
+			{
+				// Providers can group writes, for example by file
+				MutexLock lock(_provider_mutex);
+				_voxel_provider->immerge_blocks(requests);
+			}
+
+			{
+				MutexLock lock(_save_mutex);
+				_blocks_being_saved.clear();
+			}
+		}
+
+		if (_save_thread_exit) {
+			break;
+		}
 	}
 }
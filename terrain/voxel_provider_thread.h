@@ -2,23 +2,35 @@
 #define VOXEL_PROVIDER_THREAD_H
 
 #include "../math/vector3i.h"
+#include "../providers/voxel_provider.h"
+#include <core/hash_map.h>
 #include <core/resource.h>
 
-class VoxelProvider;
-class VoxelBuffer;
 class Thread;
 class Semaphore;
 
+// Runs a provider in the background. Blocks are loaded by a pool of threads sharing the same priority queue,
+// and saved on another thread, so loading never waits for disk writes.
 class VoxelProviderThread {
 public:
+	static const int MAX_THREADS = 16;
+
+	// How many blocks are given to the provider at once. Requests are re-sorted by priority between batches.
+	static const int EMERGE_BATCH_SIZE = 8;
+
 	struct ImmergeInput {
-		Vector3i origin;
+		Vector3i origin; // In voxels
 		Ref<VoxelBuffer> voxels;
+		uint32_t data_version; // Version of the block in VoxelMap, the most recent one is kept if saved twice
+	};
+
+	struct EmergeInput {
+		Vector3i block_position;
 	};
 
 	struct InputData {
 		Vector<ImmergeInput> blocks_to_immerge;
-		Vector<Vector3i> blocks_to_emerge;
+		Vector<EmergeInput> blocks_to_emerge;
 		Vector3i priority_block_position;
 
 		inline bool is_empty() {
@@ -36,12 +48,14 @@ public:
 		uint64_t min_time;
 		uint64_t max_time;
 		int remaining_blocks;
+		int remaining_saves;
 
 		Stats() :
 				first(true),
 				min_time(0),
 				max_time(0),
-				remaining_blocks(0) {}
+				remaining_blocks(0),
+				remaining_saves(0) {}
 	};
 
 	struct OutputData {
@@ -49,34 +63,63 @@ public:
 		Stats stats;
 	};
 
-	VoxelProviderThread(Ref<VoxelProvider> provider, int block_size_pow2);
+	// If the provider is not thread-safe, only one thread loads blocks, and never while blocks are being saved
+	VoxelProviderThread(Ref<VoxelProvider> provider, int block_size_pow2, int thread_count = 1);
 	~VoxelProviderThread();
 
 	void push(const InputData &input);
 	void pop(OutputData &out_data);
 
+	// Waits until all blocks pushed for saving so far are saved
+	void flush();
+
+	int get_thread_count() const { return _workers.size(); }
+
 private:
-	static void _thread_func(void *p_self);
+	struct Worker {
+		VoxelProviderThread *owner;
+		Thread *thread;
+		Vector<VoxelProvider::BlockRequest> requests;
+	};
+
+	static void _thread_func(void *p_worker);
+	static void _save_thread_func(void *p_self);
 
-	void thread_func();
-	void thread_sync(int emerge_index, Stats stats);
+	void thread_func(Worker &worker);
+	void emerge_batch(Worker &worker, const Vector<EmergeInput> &batch, Vector<EmergeOutput> &output, Stats &stats);
+	void save_thread_func();
+
+	bool get_pending_save(Vector3i origin, Ref<VoxelBuffer> &out_voxels);
 
 private:
-	InputData _shared_input;
+	// Sorted by priority when needed, the closest block is the last one
+	Vector<EmergeInput> _blocks_to_emerge;
+	Vector3i _priority_block_position;
+	bool _needs_sort;
 	Mutex *_input_mutex;
 
 	Vector<EmergeOutput> _shared_output;
-	Stats _shared_stats;
+	Stats _shared_stats; // Since the last pop
+	Stats _last_stats;
 	Mutex *_output_mutex;
 
 	Semaphore *_semaphore;
 	bool _thread_exit;
-	Thread *_thread;
-	InputData _input;
-	Vector<EmergeOutput> _output;
+	Vector<Worker> _workers;
 	int _block_size_pow2;
 
+	// Only the latest version of each block gets saved, indexed by origin
+	HashMap<Vector3i, ImmergeInput, Vector3iHasher> _blocks_to_save;
+	// Blocks the save thread is currently writing
+	HashMap<Vector3i, ImmergeInput, Vector3iHasher> _blocks_being_saved;
+	Mutex *_save_mutex;
+	Semaphore *_save_semaphore;
+	bool _save_thread_exit;
+	Thread *_save_thread;
+
 	Ref<VoxelProvider> _voxel_provider;
+	// Held while calling the provider, only if it is not thread-safe
+	Mutex *_provider_mutex;
 };
 
 #endif // VOXEL_PROVIDER_THREAD_H
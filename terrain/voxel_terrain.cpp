@@ -2,6 +2,7 @@
 #include "../providers/voxel_provider_test.h"
 #include "../util/utility.h"
 #include "../util/voxel_raycast.h"
+#include "../voxel_memory_pool.h"
 #include "voxel_block.h"
 #include "voxel_map.h"
 #include "voxel_provider_thread.h"
@@ -13,21 +14,32 @@
 VoxelTerrain::VoxelTerrain() {
 
 	_map = Ref<VoxelMap>(memnew(VoxelMap));
+	// Edits can reach blocks before the provider loads them
+	_map->set_streamed(true);
 
 	_view_distance_blocks = 8;
+	_budget_view_distance_blocks = _view_distance_blocks;
 	_last_view_distance_blocks = 0;
 
 	_provider_thread = NULL;
+	_provider_thread_count = 1;
 	_block_updater = NULL;
 
 	_generate_collisions = false;
 	_run_in_editor = false;
 	_smooth_meshing_enabled = false;
+	_meshing_layout = VoxelBuffer::LAYOUT_LINEAR;
 }
 
 VoxelTerrain::~VoxelTerrain() {
 	print_line("Destroying VoxelTerrain");
 	if (_provider_thread) {
+		// Edits would be lost otherwise.
+		// Blocks still waiting to be saved get saved before the thread exits.
+		if (_map.is_valid()) {
+			queue_modified_blocks_to_save();
+		}
+		send_blocks_to_save();
 		memdelete(_provider_thread);
 	}
 	if (_block_updater) {
@@ -71,13 +83,8 @@ void VoxelTerrain::_get_property_list(List<PropertyInfo> *p_list) const {
 void VoxelTerrain::set_provider(Ref<VoxelProvider> provider) {
 	if (provider != _provider) {
 
-		if (_provider_thread) {
-			memdelete(_provider_thread);
-			_provider_thread = NULL;
-		}
-
 		_provider = provider;
-		_provider_thread = memnew(VoxelProviderThread(_provider, _map->get_block_size_pow2()));
+		restart_provider_thread();
 		//		Ref<VoxelProviderTest> test;
 		//		test.instance();
 		//		_provider_thread = memnew(VoxelProviderThread(test, _map->get_block_size_pow2()));
@@ -92,6 +99,41 @@ Ref<VoxelProvider> VoxelTerrain::get_provider() const {
 	return _provider;
 }
 
+void VoxelTerrain::set_provider_thread_count(int count) {
+	count = CLAMP(count, 1, VoxelProviderThread::MAX_THREADS);
+	if (count != _provider_thread_count) {
+		_provider_thread_count = count;
+		if (_provider_thread) {
+			restart_provider_thread();
+		}
+	}
+}
+
+int VoxelTerrain::get_provider_thread_count() const {
+	return _provider_thread_count;
+}
+
+void VoxelTerrain::restart_provider_thread() {
+
+	if (_provider_thread) {
+		// Unloaded blocks were meant for the previous thread's provider
+		send_blocks_to_save();
+		memdelete(_provider_thread);
+		_provider_thread = NULL;
+
+		// Load requests sent to the previous thread are lost, so they are sent again.
+		// Responses for blocks that were requested twice are dropped.
+		const Vector3i *key = NULL;
+		while ((key = _dirty_blocks.next(key))) {
+			if (_dirty_blocks.get(*key) == BLOCK_LOAD) {
+				_blocks_pending_load.push_back(*key);
+			}
+		}
+	}
+
+	_provider_thread = memnew(VoxelProviderThread(_provider, _map->get_block_size_pow2(), _provider_thread_count));
+}
+
 Ref<VoxelLibrary> VoxelTerrain::get_voxel_library() const {
 	return _library;
 }
@@ -128,10 +170,28 @@ void VoxelTerrain::set_view_distance(int distance_in_voxels) {
 	if (d != _view_distance_blocks) {
 		print_line(String("View distance changed from ") + String::num(_view_distance_blocks) + String(" blocks to ") + String::num(d));
 		_view_distance_blocks = d;
+		_budget_view_distance_blocks = d;
 		// Blocks too far away will be removed in _process, same for blocks to load
 	}
 }
 
+int VoxelTerrain::get_budget_view_distance_blocks() const {
+	if (_map->get_memory_budget() == 0) {
+		return _view_distance_blocks;
+	}
+	return MIN(_view_distance_blocks, _budget_view_distance_blocks);
+}
+
+// Smallest view distance in blocks, for which the block is out of the view box.
+// The box spans [viewer - distance, viewer + distance[ on each axis.
+static inline int get_block_ring(Vector3i viewer_block_pos, Vector3i bpos) {
+	const Vector3i d = bpos - viewer_block_pos;
+	const int rx = d.x >= 0 ? d.x : -d.x - 1;
+	const int ry = d.y >= 0 ? d.y : -d.y - 1;
+	const int rz = d.z >= 0 ? d.z : -d.z - 1;
+	return MAX(rx, MAX(ry, rz));
+}
+
 void VoxelTerrain::set_viewer_path(NodePath path) {
 	_viewer_path = path;
 }
@@ -172,6 +232,19 @@ void VoxelTerrain::set_smooth_meshing_enabled(bool enabled) {
 	}
 }
 
+VoxelBuffer::Layout VoxelTerrain::get_meshing_layout() const {
+	return _meshing_layout;
+}
+
+void VoxelTerrain::set_meshing_layout(VoxelBuffer::Layout layout) {
+	ERR_FAIL_INDEX(layout, VoxelBuffer::LAYOUT_COUNT);
+	if (_meshing_layout != layout) {
+		_meshing_layout = layout;
+		reset_updater();
+		make_all_view_dirty_deferred();
+	}
+}
+
 void VoxelTerrain::make_block_dirty(Vector3i bpos) {
 	// TODO Immediate update viewer distance?
 
@@ -180,7 +253,7 @@ void VoxelTerrain::make_block_dirty(Vector3i bpos) {
 	if (state == NULL) {
 		// The block is not dirty, so it will either be loaded or updated
 
-		if (_map->has_block(bpos)) {
+		if (_map->is_block_loaded(bpos)) {
 
 			_blocks_pending_update.push_back(bpos);
 			_dirty_blocks[bpos] = BLOCK_UPDATE_NOT_SENT;
@@ -199,15 +272,24 @@ void VoxelTerrain::make_block_dirty(Vector3i bpos) {
 
 	//OS::get_singleton()->print("Dirty (%i, %i, %i)", bpos.x, bpos.y, bpos.z);
 
-	// TODO What if a block is made dirty, goes through threaded update, then gets changed again before it gets updated?
-	// this will make the second change ignored, which is not correct!
+	// If the block changes again while its update is in flight, the result will be detected as outdated
+	// using the data version of the block, and dropped.
 }
 
 void VoxelTerrain::immerge_block(Vector3i bpos) {
 
 	ERR_FAIL_COND(_map.is_null());
 
-	// TODO Schedule block saving when supported
+	// Blocks that were not edited can be given back by the provider, so only modified ones are saved
+	if (_map->is_block_modified(bpos)) {
+		VoxelProviderThread::ImmergeInput ii;
+		ii.origin = _map->block_to_voxel(bpos);
+		// Voxels are shared with the snapshot, so they don't get copied
+		ii.voxels = _map->get_block_snapshot(bpos);
+		ii.data_version = _map->get_block_data_version(bpos);
+		_blocks_to_save.push_back(ii);
+	}
+
 	_map->remove_block(bpos, VoxelMap::NoAction());
 
 	_dirty_blocks.erase(bpos);
@@ -215,12 +297,65 @@ void VoxelTerrain::immerge_block(Vector3i bpos) {
 	// because it's too expensive to linear-search all blocks for each block
 }
 
+void VoxelTerrain::send_blocks_to_save() {
+	if (_blocks_to_save.size() == 0) {
+		return;
+	}
+	VoxelProviderThread::InputData input;
+	input.priority_block_position = _last_viewer_block_pos;
+	input.blocks_to_immerge.append_array(_blocks_to_save);
+	_blocks_to_save.clear();
+	_provider_thread->push(input);
+}
+
+struct GetModifiedBlockPositionsAction {
+	Vector<Vector3i> &positions;
+	GetModifiedBlockPositionsAction(Vector<Vector3i> &p) :
+			positions(p) {}
+	void operator()(VoxelBlock *block) {
+		if (block->modified && !block->is_waiting_for_voxels()) {
+			positions.push_back(block->pos);
+		}
+	}
+};
+
+void VoxelTerrain::queue_modified_blocks_to_save() {
+
+	Vector<Vector3i> positions;
+	_map->for_all_blocks(GetModifiedBlockPositionsAction(positions));
+
+	for (int i = 0; i < positions.size(); ++i) {
+		const Vector3i bpos = positions[i];
+		VoxelProviderThread::ImmergeInput ii;
+		ii.origin = _map->block_to_voxel(bpos);
+		ii.voxels = _map->get_block_snapshot(bpos);
+		ii.data_version = _map->get_block_data_version(bpos);
+		_blocks_to_save.push_back(ii);
+		// Saved versions are what the provider will give back now
+		_map->set_block_modified(bpos, false);
+	}
+}
+
+void VoxelTerrain::save_all_blocks() {
+	ERR_FAIL_COND(_map.is_null());
+
+	if (_provider_thread == NULL) {
+		return;
+	}
+
+	queue_modified_blocks_to_save();
+	send_blocks_to_save();
+	_provider_thread->flush();
+}
+
 Dictionary VoxelTerrain::get_statistics() const {
 
 	Dictionary provider;
 	provider["min_time"] = _stats.provider.min_time;
 	provider["max_time"] = _stats.provider.max_time;
 	provider["remaining_blocks"] = _stats.provider.remaining_blocks;
+	provider["remaining_saves"] = _stats.provider.remaining_saves;
+	provider["thread_count"] = _provider_thread ? _provider_thread->get_thread_count() : 0;
 	provider["dropped_blocks"] = _stats.dropped_provider_blocks;
 
 	Dictionary updater;
@@ -230,11 +365,19 @@ Dictionary VoxelTerrain::get_statistics() const {
 	updater["updated_blocks"] = _stats.updated_blocks;
 	updater["mesh_alloc_time"] = _stats.mesh_alloc_time;
 	updater["dropped_blocks"] = _stats.dropped_updater_blocks;
+	updater["stale_blocks"] = _stats.stale_updater_blocks;
 	updater["remaining_main_thread_blocks"] = _stats.remaining_main_thread_blocks;
 
+	Dictionary budget;
+	budget["evicted_blocks"] = _stats.evicted_blocks;
+	budget["view_distance_blocks"] = get_budget_view_distance_blocks();
+
 	Dictionary d;
 	d["provider"] = provider;
 	d["updater"] = updater;
+	d["budget"] = budget;
+	d["map"] = _map->get_statistics();
+	d["memory_pool"] = VoxelMemoryPool::get_singleton()->get_statistics();
 
 	// Breakdown of time spent in _process
 	d["time_detect_required_blocks"] = _stats.time_detect_required_blocks;
@@ -242,6 +385,7 @@ Dictionary VoxelTerrain::get_statistics() const {
 	d["time_process_load_responses"] = _stats.time_process_load_responses;
 	d["time_send_update_requests"] = _stats.time_send_update_requests;
 	d["time_process_update_responses"] = _stats.time_process_update_responses;
+	d["time_compress_cold_blocks"] = _stats.time_compress_cold_blocks;
 
 	return d;
 }
@@ -282,8 +426,9 @@ void VoxelTerrain::reset_updater() {
 	// TODO Thread-safe way to change those parameters
 	VoxelMeshUpdater::MeshingParams params;
 	params.smooth_surface = _smooth_meshing_enabled;
+	params.voxel_layout = _meshing_layout;
 
-	_block_updater = memnew(VoxelMeshUpdater(_library, params));
+	_block_updater = memnew(VoxelMeshUpdater(_map, _library, params));
 }
 
 inline int get_border_index(int x, int max) {
@@ -446,6 +591,46 @@ void VoxelTerrain::make_area_dirty(Rect3i box) {
 	}
 }
 
+void VoxelTerrain::set_voxels(const Vector<VoxelMap::Edit> &edits) {
+	Vector<Rect3i> boxes;
+	_map->set_voxels(edits, &boxes);
+	for (int i = 0; i < boxes.size(); ++i) {
+		make_area_dirty(boxes[i]);
+	}
+}
+
+void VoxelTerrain::fill_area(uint32_t value, Rect3i box, unsigned int channel) {
+	_map->fill_area(value, box, channel);
+	make_area_dirty(box);
+}
+
+void VoxelTerrain::paste(Vector3i min_pos, const VoxelBuffer &voxels, unsigned int channels_mask) {
+	_map->paste(min_pos, voxels, channels_mask);
+	make_area_dirty(Rect3i(min_pos, voxels.get_size()));
+}
+
+bool VoxelTerrain::undo() {
+	Vector<Rect3i> boxes;
+	if (!_map->undo(&boxes)) {
+		return false;
+	}
+	for (int i = 0; i < boxes.size(); ++i) {
+		make_area_dirty(boxes[i]);
+	}
+	return true;
+}
+
+bool VoxelTerrain::redo() {
+	Vector<Rect3i> boxes;
+	if (!_map->redo(&boxes)) {
+		return false;
+	}
+	for (int i = 0; i < boxes.size(); ++i) {
+		make_area_dirty(boxes[i]);
+	}
+	return true;
+}
+
 struct EnterWorldAction {
 	World *world;
 	EnterWorldAction(World *w) :
@@ -564,9 +749,12 @@ void VoxelTerrain::_process() {
 	// Find out which blocks need to appear and which need to be unloaded
 	{
 		//Vector3i viewer_block_pos_delta = _last_viewer_block_pos - viewer_block_pos;
-		Rect3i new_box = Rect3i::from_center_extents(viewer_block_pos, Vector3i(_view_distance_blocks));
+		Rect3i new_box = Rect3i::from_center_extents(viewer_block_pos, Vector3i(get_budget_view_distance_blocks()));
 		Rect3i prev_box = Rect3i::from_center_extents(_last_viewer_block_pos, Vector3i(_last_view_distance_blocks));
 
+		// Blocks around the loaded area are also looked up, when checking if neighbors are loaded
+		_map->set_grid_box(Rect3i(new_box.pos - Vector3i(1), new_box.size + Vector3i(2)));
+
 		if (prev_box != new_box) {
 			//print_line(String("Loaded area changed: from ") + prev_box.to_string() + String(" to ") + new_box.to_string());
 
@@ -602,7 +790,7 @@ void VoxelTerrain::_process() {
 
 	_stats.time_detect_required_blocks = os.get_ticks_usec() - time_before;
 
-	_last_view_distance_blocks = _view_distance_blocks;
+	_last_view_distance_blocks = get_budget_view_distance_blocks();
 	_last_viewer_block_pos = viewer_block_pos;
 
 	time_before = os.get_ticks_usec();
@@ -612,8 +800,14 @@ void VoxelTerrain::_process() {
 		VoxelProviderThread::InputData input;
 
 		input.priority_block_position = viewer_block_pos;
-		input.blocks_to_emerge.append_array(_blocks_pending_load);
-		//input.blocks_to_immerge.append_array();
+		input.blocks_to_immerge.append_array(_blocks_to_save);
+		_blocks_to_save.clear();
+
+		for (int i = 0; i < _blocks_pending_load.size(); ++i) {
+			VoxelProviderThread::EmergeInput ei;
+			ei.block_position = _blocks_pending_load[i];
+			input.blocks_to_emerge.push_back(ei);
+		}
 
 		//print_line(String("Sending {0} block requests").format(varray(input.blocks_to_emerge.size())));
 		_blocks_pending_load.clear();
@@ -649,6 +843,7 @@ void VoxelTerrain::_process() {
 					++_stats.dropped_provider_blocks;
 					continue;
 				}
+
 			}
 
 			// Check return
@@ -658,8 +853,10 @@ void VoxelTerrain::_process() {
 			// TODO Discard blocks out of range
 
 			// Store buffer
-			bool update_neighbors = !_map->has_block(block_pos);
-			_map->set_block_buffer(block_pos, o.voxels);
+			bool update_neighbors = !_map->is_block_loaded(block_pos);
+			// Voxels are the same as what the provider has, so there is no need to save them back.
+			// If the block got edited while it was loading, the map applies the edits over them.
+			_map->set_block_buffer(block_pos, o.voxels, false);
 
 			// Trigger mesh updates
 			if (update_neighbors) {
@@ -710,13 +907,21 @@ void VoxelTerrain::_process() {
 			// but that will slow down meshing a lot.
 			// TODO This is one reason to separate terrain systems between blocky and smooth (other reason is LOD)
 			if (!_smooth_meshing_enabled) {
+				const uint32_t air_type = 0;
 				VoxelBlock *block = _map->get_block(block_pos);
 				if (block == NULL) {
-					continue;
+					if (_map->is_block_collapsed(block_pos) &&
+							_map->get_voxel(_map->block_to_voxel(block_pos), Voxel::CHANNEL_TYPE) == air_type) {
+						// Still empty, nothing to update
+						_dirty_blocks.erase(block_pos);
+						continue;
+					}
+					if (!_map->has_block(block_pos)) {
+						continue;
+					}
 				} else {
 					CRASH_COND(block->voxels.is_null());
 
-					int air_type = 0;
 					if (
 							block->voxels->is_uniform(Voxel::CHANNEL_TYPE) &&
 							block->voxels->is_uniform(Voxel::CHANNEL_ISOLEVEL) &&
@@ -730,8 +935,8 @@ void VoxelTerrain::_process() {
 						block->set_mesh(Ref<Mesh>(), Ref<World>());
 						_dirty_blocks.erase(block_pos);
 
-						// Optional, but I guess it might spare some memory
-						block->voxels->clear_channel(Voxel::CHANNEL_TYPE, air_type);
+						// Spares the block entirely if its other channels are uniform too
+						_map->collapse_block(block_pos);
 
 						continue;
 					}
@@ -742,21 +947,10 @@ void VoxelTerrain::_process() {
 			CRASH_COND(block_state == NULL);
 			CRASH_COND(*block_state != BLOCK_UPDATE_NOT_SENT);
 
-			// Create buffer padded with neighbor voxels
-			Ref<VoxelBuffer> nbuffer;
-			nbuffer.instance();
-
-			// TODO Make the buffer re-usable
-			unsigned int block_size = _map->get_block_size();
-			unsigned int padding = _block_updater->get_required_padding();
-			nbuffer->create(block_size + 2 * padding, block_size + 2 * padding, block_size + 2 * padding);
-
-			unsigned int channels_mask = (1 << VoxelBuffer::CHANNEL_TYPE) | (1 << VoxelBuffer::CHANNEL_ISOLEVEL);
-			_map->get_buffer_copy(_map->block_to_voxel(block_pos) - Vector3i(padding), **nbuffer, channels_mask);
-
+			// The updater thread gets voxels padded with neighbors from the map itself
 			VoxelMeshUpdater::InputBlock iblock;
-			iblock.voxels = nbuffer;
 			iblock.position = block_pos;
+			iblock.data_version = _map->get_block_data_version(block_pos);
 			input.blocks.push_back(iblock);
 
 			*block_state = BLOCK_UPDATE_SENT;
@@ -778,6 +972,7 @@ void VoxelTerrain::_process() {
 			_stats.updater = output.stats;
 			_stats.updated_blocks = output.blocks.size();
 			_stats.dropped_updater_blocks = 0;
+			_stats.stale_updater_blocks = 0;
 
 			_blocks_pending_main_thread_update.append_array(output.blocks);
 		}
@@ -791,22 +986,54 @@ void VoxelTerrain::_process() {
 		// This also proved to be very slow compared to the meshing process itself...
 		// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
 
+		// Results can pile up for the same block when it gets edited quickly, only the latest one is worth uploading
+		HashMap<Vector3i, int, Vector3iHasher> latest_indexes;
+		for (int i = 0; i < _blocks_pending_main_thread_update.size(); ++i) {
+			latest_indexes.set(_blocks_pending_main_thread_update[i].position, i);
+		}
+
 		for (; queue_index < _blocks_pending_main_thread_update.size() && os.get_ticks_msec() < timeout; ++queue_index) {
 
 			const VoxelMeshUpdater::OutputBlock &ob = _blocks_pending_main_thread_update[queue_index];
 
-			VoxelTerrain::BlockDirtyState *state = _dirty_blocks.getptr(ob.position);
-			if (state && *state == BLOCK_UPDATE_SENT) {
-				_dirty_blocks.erase(ob.position);
+			const int *latest_index = latest_indexes.getptr(ob.position);
+			if (latest_index != NULL && *latest_index != queue_index) {
+				// A newer result for the same block is further in the queue, no point uploading this one
+				++_stats.stale_updater_blocks;
+				continue;
 			}
 
-			VoxelBlock *block = _map->get_block(ob.position);
-			if (block == NULL) {
+			// Note: if the block was made dirty again while this update was in flight, its state is BLOCK_UPDATE_NOT_SENT.
+			// The result is still uploaded because it is newer than what is displayed, and a new update will follow.
+			VoxelTerrain::BlockDirtyState *state = _dirty_blocks.getptr(ob.position);
+
+			if (!_map->has_block(ob.position)) {
 				// That block is no longer loaded, drop the result
+				if (state && *state == BLOCK_UPDATE_SENT) {
+					_dirty_blocks.erase(ob.position);
+				}
 				++_stats.dropped_updater_blocks;
 				continue;
 			}
 
+			if (ob.data_version != _map->get_block_data_version(ob.position) &&
+					(state == NULL || *state != BLOCK_UPDATE_NOT_SENT)) {
+				// Voxels changed since the update was requested without the block being made dirty
+				// (can happen if edits are made directly to the map), so schedule another one
+				++_stats.stale_updater_blocks;
+				if (state == NULL) {
+					make_block_dirty(ob.position);
+				} else if (*state == BLOCK_UPDATE_SENT) {
+					*state = BLOCK_UPDATE_NOT_SENT;
+					_blocks_pending_update.push_back(ob.position);
+				}
+				continue;
+			}
+
+			if (state && *state == BLOCK_UPDATE_SENT) {
+				_dirty_blocks.erase(ob.position);
+			}
+
 			Ref<ArrayMesh> mesh;
 			mesh.instance();
 
@@ -842,8 +1069,14 @@ void VoxelTerrain::_process() {
 
 			if (is_mesh_empty(mesh)) {
 				mesh = Ref<Mesh>();
+				// Blocks with nothing to display and the same value everywhere don't need a VoxelBlock
+				if (_map->collapse_block(ob.position)) {
+					continue;
+				}
 			}
 
+			// Collapsed blocks can have a mesh if their neighbors changed
+			VoxelBlock *block = _map->get_or_create_block(ob.position);
 			block->set_mesh(mesh, world);
 		}
 
@@ -854,6 +1087,45 @@ void VoxelTerrain::_process() {
 	}
 
 	_stats.time_process_update_responses = os.get_ticks_usec() - time_before;
+	time_before = os.get_ticks_usec();
+
+	// Blocks that were not used for a while get compressed, spread over frames with a budget of 1ms
+	_map->compress_cold_blocks(1000);
+
+	_stats.time_compress_cold_blocks = os.get_ticks_usec() - time_before;
+
+	// Unload blocks if they take more memory than allowed. They go through the same path as blocks leaving the view.
+	// Blocks only get loaded when they enter the view, so evicting blocks in view also reduces the view distance
+	// until they are out of it. It grows back when there is room again.
+	// Dirty blocks are spared, because outdated mesh results can schedule updates after pending lists got consumed.
+	{
+		Vector<Vector3i> blocks_to_evict;
+		if (_map->get_blocks_over_budget(viewer_block_pos, blocks_to_evict)) {
+
+			const int view_distance = get_budget_view_distance_blocks();
+			int new_view_distance = view_distance;
+
+			for (int i = 0; i < blocks_to_evict.size(); ++i) {
+				const Vector3i bpos = blocks_to_evict[i];
+				if (_dirty_blocks.has(bpos)) {
+					continue;
+				}
+				immerge_block(bpos);
+				++_stats.evicted_blocks;
+				new_view_distance = MIN(new_view_distance, get_block_ring(viewer_block_pos, bpos));
+			}
+
+			if (new_view_distance < view_distance) {
+				_budget_view_distance_blocks = new_view_distance;
+
+			} else if (blocks_to_evict.empty() &&
+					_budget_view_distance_blocks < _view_distance_blocks &&
+					_map->get_stats().memory_usage < _map->get_memory_budget() * 3 / 4) {
+				// Grow slowly, a new ring of blocks can take a lot of memory
+				++_budget_view_distance_blocks;
+			}
+		}
+	}
 
 	//print_line(String("d:") + String::num(_dirty_blocks.size()) + String(", q:") + String::num(_block_update_queue.size()));
 }
@@ -901,6 +1173,39 @@ void VoxelTerrain::_make_area_dirty_binding(AABB aabb) {
 	make_area_dirty(Rect3i(aabb.position, aabb.size));
 }
 
+// Channels can be given per edit, or omitted to edit channel 0
+void VoxelTerrain::_set_voxels_binding(PoolVector3Array positions, PoolIntArray values, PoolIntArray channels) {
+	ERR_FAIL_COND(positions.size() != values.size());
+	ERR_FAIL_COND(channels.size() != 0 && channels.size() != positions.size());
+
+	Vector<VoxelMap::Edit> edits;
+	edits.resize(positions.size());
+
+	PoolVector3Array::Read positions_read = positions.read();
+	PoolIntArray::Read values_read = values.read();
+	PoolIntArray::Read channels_read = channels.read();
+	const bool has_channels = channels.size() != 0;
+
+	for (int i = 0; i < edits.size(); ++i) {
+		VoxelMap::Edit &edit = edits.write[i];
+		edit.position = Vector3i(positions_read[i]);
+		edit.value = values_read[i];
+		edit.channel = has_channels ? channels_read[i] : 0;
+		ERR_FAIL_INDEX(edit.channel, VoxelBuffer::MAX_CHANNELS);
+	}
+
+	set_voxels(edits);
+}
+
+void VoxelTerrain::_fill_area_binding(int64_t value, AABB aabb, unsigned int channel) {
+	fill_area(value, Rect3i(aabb.position, aabb.size), channel);
+}
+
+void VoxelTerrain::_paste_binding(Vector3 min_pos, Ref<VoxelBuffer> voxels, unsigned int channels_mask) {
+	ERR_FAIL_COND(voxels.is_null());
+	paste(Vector3i(min_pos), **voxels, channels_mask);
+}
+
 Variant VoxelTerrain::_raycast_binding(Vector3 origin, Vector3 direction, real_t max_distance) {
 
 	// TODO Transform input if the terrain is rotated (in the future it can be made a Spatial node)
@@ -947,6 +1252,9 @@ void VoxelTerrain::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_provider", "provider"), &VoxelTerrain::set_provider);
 	ClassDB::bind_method(D_METHOD("get_provider"), &VoxelTerrain::get_provider);
 
+	ClassDB::bind_method(D_METHOD("set_provider_thread_count", "count"), &VoxelTerrain::set_provider_thread_count);
+	ClassDB::bind_method(D_METHOD("get_provider_thread_count"), &VoxelTerrain::get_provider_thread_count);
+
 	ClassDB::bind_method(D_METHOD("set_voxel_library", "library"), &VoxelTerrain::set_voxel_library);
 	ClassDB::bind_method(D_METHOD("get_voxel_library"), &VoxelTerrain::get_voxel_library);
 
@@ -962,6 +1270,9 @@ void VoxelTerrain::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("is_smooth_meshing_enabled"), &VoxelTerrain::is_smooth_meshing_enabled);
 	ClassDB::bind_method(D_METHOD("set_smooth_meshing_enabled", "enabled"), &VoxelTerrain::set_smooth_meshing_enabled);
 
+	ClassDB::bind_method(D_METHOD("get_meshing_layout"), &VoxelTerrain::get_meshing_layout);
+	ClassDB::bind_method(D_METHOD("set_meshing_layout", "layout"), &VoxelTerrain::set_meshing_layout);
+
 	ClassDB::bind_method(D_METHOD("get_storage"), &VoxelTerrain::get_map);
 
 	ClassDB::bind_method(D_METHOD("voxel_to_block", "voxel_pos"), &VoxelTerrain::_voxel_to_block_binding);
@@ -970,17 +1281,26 @@ void VoxelTerrain::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("make_voxel_dirty", "pos"), &VoxelTerrain::_make_voxel_dirty_binding);
 	ClassDB::bind_method(D_METHOD("make_area_dirty", "aabb"), &VoxelTerrain::_make_area_dirty_binding);
 
+	ClassDB::bind_method(D_METHOD("set_voxels", "positions", "values", "channels"), &VoxelTerrain::_set_voxels_binding, DEFVAL(PoolIntArray()));
+	ClassDB::bind_method(D_METHOD("fill_area", "value", "aabb", "channel"), &VoxelTerrain::_fill_area_binding, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("paste", "min_pos", "voxels", "channels_mask"), &VoxelTerrain::_paste_binding, DEFVAL(1));
+	ClassDB::bind_method(D_METHOD("save_all_blocks"), &VoxelTerrain::save_all_blocks);
+	ClassDB::bind_method(D_METHOD("undo"), &VoxelTerrain::undo);
+	ClassDB::bind_method(D_METHOD("redo"), &VoxelTerrain::redo);
+
 	ClassDB::bind_method(D_METHOD("raycast", "origin", "direction", "max_distance"), &VoxelTerrain::_raycast_binding, DEFVAL(100));
 
 	ClassDB::bind_method(D_METHOD("get_statistics"), &VoxelTerrain::get_statistics);
 	ClassDB::bind_method(D_METHOD("get_block_state", "block_pos"), &VoxelTerrain::get_block_state);
 
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "provider", PROPERTY_HINT_RESOURCE_TYPE, "VoxelProvider"), "set_provider", "get_provider");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "provider_thread_count", PROPERTY_HINT_RANGE, "1,16,1"), "set_provider_thread_count", "get_provider_thread_count");
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "voxel_library", PROPERTY_HINT_RESOURCE_TYPE, "VoxelLibrary"), "set_voxel_library", "get_voxel_library");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "view_distance"), "set_view_distance", "get_view_distance");
 	ADD_PROPERTY(PropertyInfo(Variant::NODE_PATH, "viewer_path"), "set_viewer_path", "get_viewer_path");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "generate_collisions"), "set_generate_collisions", "get_generate_collisions");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "smooth_meshing_enabled"), "set_smooth_meshing_enabled", "is_smooth_meshing_enabled");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "meshing_layout", PROPERTY_HINT_ENUM, "Linear,Bricks"), "set_meshing_layout", "get_meshing_layout");
 
 	BIND_ENUM_CONSTANT(BLOCK_NONE);
 	BIND_ENUM_CONSTANT(BLOCK_LOAD);
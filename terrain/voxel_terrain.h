@@ -5,12 +5,12 @@
 #include "../math/vector3i.h"
 #include "../providers/voxel_provider.h"
 #include "../util/zprofiling.h"
+#include "voxel_map.h"
 #include "voxel_mesh_updater.h"
 #include "voxel_provider_thread.h"
 
 #include <scene/3d/spatial.h>
 
-class VoxelMap;
 class VoxelLibrary;
 
 // Infinite paged terrain made of voxel blocks.
@@ -33,6 +33,10 @@ public:
 	void set_provider(Ref<VoxelProvider> provider);
 	Ref<VoxelProvider> get_provider() const;
 
+	// How many threads load blocks from the provider. Only used if the provider is thread-safe.
+	void set_provider_thread_count(int count);
+	int get_provider_thread_count() const;
+
 	void set_voxel_library(Ref<VoxelLibrary> library);
 	Ref<VoxelLibrary> get_voxel_library() const;
 
@@ -42,6 +46,19 @@ public:
 	void make_area_dirty(Rect3i box);
 	bool is_block_dirty(Vector3i bpos) const;
 
+	// Batched edits. Blocks needing an update are found once per modified block, instead of once per voxel.
+	void set_voxels(const Vector<VoxelMap::Edit> &edits);
+	void fill_area(uint32_t value, Rect3i box, unsigned int channel);
+	void paste(Vector3i min_pos, const VoxelBuffer &voxels, unsigned int channels_mask);
+
+	// Saves all modified blocks through the provider, and waits until they are written.
+	// Useful for autosaves, or before quitting.
+	void save_all_blocks();
+
+	// Undoes edits recorded by the map, see VoxelMap::set_journal_enabled
+	bool undo();
+	bool redo();
+
 	void set_generate_collisions(bool enabled);
 	bool get_generate_collisions() const { return _generate_collisions; }
 
@@ -57,6 +74,9 @@ public:
 	bool is_smooth_meshing_enabled() const;
 	void set_smooth_meshing_enabled(bool enabled);
 
+	VoxelBuffer::Layout get_meshing_layout() const;
+	void set_meshing_layout(VoxelBuffer::Layout layout);
+
 	Ref<VoxelMap> get_map() { return _map; }
 
 	struct Stats {
@@ -66,24 +86,30 @@ public:
 		int updated_blocks;
 		int dropped_provider_blocks;
 		int dropped_updater_blocks;
+		int stale_updater_blocks; // Meshes of voxels that got edited while they were in flight
 		int remaining_main_thread_blocks;
+		uint32_t evicted_blocks; // How many blocks were unloaded to fit in the memory budget of the map so far
 		uint64_t time_detect_required_blocks;
 		uint64_t time_send_load_requests;
 		uint64_t time_process_load_responses;
 		uint64_t time_send_update_requests;
 		uint64_t time_process_update_responses;
+		uint64_t time_compress_cold_blocks;
 
 		Stats() :
 				mesh_alloc_time(0),
 				updated_blocks(0),
 				dropped_provider_blocks(0),
 				dropped_updater_blocks(0),
+				stale_updater_blocks(0),
 				remaining_main_thread_blocks(0),
+				evicted_blocks(0),
 				time_detect_required_blocks(0),
 				time_send_load_requests(0),
 				time_process_load_responses(0),
 				time_send_update_requests(0),
-				time_process_update_responses(0) {}
+				time_process_update_responses(0),
+				time_compress_cold_blocks(0) {}
 	};
 
 protected:
@@ -98,10 +124,14 @@ private:
 
 	void make_all_view_dirty_deferred();
 	void reset_updater();
+	void restart_provider_thread();
 
 	Spatial *get_viewer(NodePath path) const;
+	int get_budget_view_distance_blocks() const;
 
 	void immerge_block(Vector3i bpos);
+	void queue_modified_blocks_to_save();
+	void send_blocks_to_save();
 
 	Dictionary get_statistics() const;
 
@@ -113,6 +143,9 @@ private:
 	//void _force_load_blocks_binding(Vector3 center, Vector3 extents) { force_load_blocks(center, extents); }
 	void _make_voxel_dirty_binding(Vector3 pos) { make_voxel_dirty(pos); }
 	void _make_area_dirty_binding(AABB aabb);
+	void _set_voxels_binding(PoolVector3Array positions, PoolIntArray values, PoolIntArray channels);
+	void _fill_area_binding(int64_t value, AABB aabb, unsigned int channel);
+	void _paste_binding(Vector3 min_pos, Ref<VoxelBuffer> voxels, unsigned int channels_mask);
 	Variant _raycast_binding(Vector3 origin, Vector3 direction, real_t max_distance);
 	void set_voxel(Vector3 pos, int value, int c);
 	int get_voxel(Vector3 pos, int c);
@@ -126,17 +159,21 @@ private:
 
 	// How many blocks to load around the viewer
 	int _view_distance_blocks;
+	// Lower view distance used while blocks don't fit in the memory budget of the map
+	int _budget_view_distance_blocks;
 
-	// TODO Terrains only need to handle the visible portion of voxels, which reduces the bounds blocks to handle.
-	// Therefore, could a simple grid be better to use than a hashmap?
+	// Terrains only need to handle the visible portion of voxels, so blocks around the viewer are also indexed
+	// in a grid by the map (see VoxelMap::set_grid_box), which avoids hashing for most lookups.
 
 	Vector<Vector3i> _blocks_pending_load;
 	Vector<Vector3i> _blocks_pending_update;
+	Vector<VoxelProviderThread::ImmergeInput> _blocks_to_save;
 	HashMap<Vector3i, BlockDirtyState, Vector3iHasher> _dirty_blocks; // TODO Rename _block_states
 	Vector<VoxelMeshUpdater::OutputBlock> _blocks_pending_main_thread_update;
 
 	Ref<VoxelProvider> _provider;
 	VoxelProviderThread *_provider_thread;
+	int _provider_thread_count;
 
 	Ref<VoxelLibrary> _library;
 	VoxelMeshUpdater *_block_updater;
@@ -148,6 +185,7 @@ private:
 	bool _generate_collisions;
 	bool _run_in_editor;
 	bool _smooth_meshing_enabled;
+	VoxelBuffer::Layout _meshing_layout;
 
 	Ref<Material> _materials[VoxelMesherBlocky::MAX_MATERIALS];
 
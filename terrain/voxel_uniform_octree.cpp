@@ -0,0 +1,177 @@
+#include "voxel_uniform_octree.h"
+
+VoxelUniformOctree::VoxelUniformOctree() :
+		_block_count(0),
+		_node_count(0) {
+}
+
+VoxelUniformOctree::~VoxelUniformOctree() {
+	clear();
+}
+
+const VoxelUniformOctree::Values *VoxelUniformOctree::find(Vector3i bpos) const {
+
+	Node *const *rptr = _roots.getptr(get_root_pos(bpos));
+	if (rptr == NULL) {
+		return NULL;
+	}
+
+	const Node *node = *rptr;
+	unsigned int level = ROOT_LEVEL;
+	while (node->children) {
+		node = &node->children[get_child_index(bpos, level)];
+		--level;
+	}
+
+	return node->has_values ? &node->values : NULL;
+}
+
+void VoxelUniformOctree::set(Vector3i bpos, const Values &values) {
+
+	const Vector3i rpos = get_root_pos(bpos);
+	Node **rptr = _roots.getptr(rpos);
+	Node *root;
+
+	if (rptr == NULL) {
+		root = memnew(Node);
+		root->children = NULL;
+		root->has_values = false;
+		_roots.set(rpos, root);
+		++_node_count;
+	} else {
+		root = *rptr;
+	}
+
+	if (set(*root, bpos, ROOT_LEVEL, values)) {
+		++_block_count;
+	}
+}
+
+bool VoxelUniformOctree::set(Node &node, Vector3i bpos, unsigned int level, const Values &values) {
+
+	if (node.children == NULL) {
+		if (node.has_values && node.values == values) {
+			// Already covered by a region with the same values
+			return false;
+		}
+		if (level == 0) {
+			const bool added = !node.has_values;
+			node.has_values = true;
+			node.values = values;
+			return added;
+		}
+		split(node);
+	}
+
+	const bool added = set(node.children[get_child_index(bpos, level)], bpos, level - 1, values);
+	try_merge(node);
+	return added;
+}
+
+bool VoxelUniformOctree::remove(Vector3i bpos) {
+
+	const Vector3i rpos = get_root_pos(bpos);
+	Node **rptr = _roots.getptr(rpos);
+	if (rptr == NULL) {
+		return false;
+	}
+
+	Node *root = *rptr;
+	if (!remove(*root, bpos, ROOT_LEVEL)) {
+		return false;
+	}
+	--_block_count;
+
+	if (root->children == NULL && !root->has_values) {
+		memdelete(root);
+		_roots.erase(rpos);
+		--_node_count;
+	}
+	return true;
+}
+
+bool VoxelUniformOctree::remove(Node &node, Vector3i bpos, unsigned int level) {
+
+	if (node.children == NULL) {
+		if (!node.has_values) {
+			return false;
+		}
+		if (level == 0) {
+			node.has_values = false;
+			return true;
+		}
+		split(node);
+	}
+
+	const bool removed = remove(node.children[get_child_index(bpos, level)], bpos, level - 1);
+	try_merge(node);
+	return removed;
+}
+
+void VoxelUniformOctree::split(Node &node) {
+	CRASH_COND(node.children != NULL);
+
+	// Children inherit the values of the region
+	node.children = memnew_arr(Node, 8);
+	for (unsigned int i = 0; i < 8; ++i) {
+		Node &child = node.children[i];
+		child.children = NULL;
+		child.has_values = node.has_values;
+		child.values = node.values;
+	}
+	node.has_values = false;
+	_node_count += 8;
+}
+
+void VoxelUniformOctree::try_merge(Node &node) {
+	CRASH_COND(node.children == NULL);
+
+	const Node &first = node.children[0];
+	if (first.children) {
+		return;
+	}
+
+	for (unsigned int i = 1; i < 8; ++i) {
+		const Node &child = node.children[i];
+		if (child.children || child.has_values != first.has_values) {
+			return;
+		}
+		if (child.has_values && !(child.values == first.values)) {
+			return;
+		}
+	}
+
+	node.has_values = first.has_values;
+	node.values = first.values;
+	memdelete_arr(node.children);
+	node.children = NULL;
+	_node_count -= 8;
+}
+
+void VoxelUniformOctree::free_children(Node &node) {
+	if (node.children == NULL) {
+		return;
+	}
+	for (unsigned int i = 0; i < 8; ++i) {
+		free_children(node.children[i]);
+	}
+	memdelete_arr(node.children);
+	node.children = NULL;
+}
+
+void VoxelUniformOctree::clear() {
+	const Vector3i *key = NULL;
+	while (key = _roots.next(key)) {
+		Node *root = _roots.get(*key);
+		free_children(*root);
+		memdelete(root);
+	}
+	_roots.clear();
+	_block_count = 0;
+	_node_count = 0;
+}
+
+uint64_t VoxelUniformOctree::get_memory_usage() const {
+	// Hashmap entries are approximated
+	return _node_count * sizeof(Node) + _roots.size() * (sizeof(Vector3i) + 2 * sizeof(void *));
+}
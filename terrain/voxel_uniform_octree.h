@@ -0,0 +1,99 @@
+#ifndef VOXEL_UNIFORM_OCTREE_H
+#define VOXEL_UNIFORM_OCTREE_H
+
+#include "../math/vector3i.h"
+#include "../voxel_buffer.h"
+
+#include <core/hash_map.h>
+
+// Sparse storage for blocks having the same value in all their voxels, without allocating anything per block.
+// Roots cover cubes of blocks and are stored in a hashmap. A node either has values for its whole region,
+// or 8 children. Siblings with the same values are merged back into their parent,
+// so large regions of air or bedrock end up being a single node.
+class VoxelUniformOctree {
+public:
+	// Roots cover 8x8x8 blocks
+	static const unsigned int ROOT_LEVEL = 3;
+
+	struct Values {
+		uint32_t channels[VoxelBuffer::MAX_CHANNELS];
+
+		bool operator==(const Values &other) const {
+			for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+				if (channels[i] != other.channels[i]) {
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	VoxelUniformOctree();
+	~VoxelUniformOctree();
+
+	// Gets values of a block, or NULL if the block is not in the tree
+	const Values *find(Vector3i bpos) const;
+	_FORCE_INLINE_ bool has(Vector3i bpos) const { return find(bpos) != NULL; }
+
+	// Nodes covering the block get split if needed, and merged if siblings end up the same
+	void set(Vector3i bpos, const Values &values);
+	// Returns true if the block was in the tree
+	bool remove(Vector3i bpos);
+
+	void clear();
+
+	// How many blocks the tree contains, as if they were stored individually
+	_FORCE_INLINE_ int get_block_count() const { return _block_count; }
+	_FORCE_INLINE_ int get_node_count() const { return _node_count; }
+	uint64_t get_memory_usage() const;
+
+	// Visits values of all nodes, which may cover more than one block
+	template <typename Op_T>
+	void for_all_values(Op_T op) {
+		const Vector3i *key = NULL;
+		while (key = _roots.next(key)) {
+			for_all_values(*_roots.get(*key), op);
+		}
+	}
+
+private:
+	struct Node {
+		Node *children; // 8 nodes, or NULL if the node is a leaf
+		bool has_values;
+		Values values;
+	};
+
+	static _FORCE_INLINE_ Vector3i get_root_pos(Vector3i bpos) {
+		return Vector3i(bpos.x >> ROOT_LEVEL, bpos.y >> ROOT_LEVEL, bpos.z >> ROOT_LEVEL);
+	}
+
+	// Index of the child containing the block, in a node covering 2^level blocks
+	static _FORCE_INLINE_ unsigned int get_child_index(Vector3i bpos, unsigned int level) {
+		const unsigned int s = level - 1;
+		return ((bpos.x >> s) & 1) | (((bpos.y >> s) & 1) << 1) | (((bpos.z >> s) & 1) << 2);
+	}
+
+	bool set(Node &node, Vector3i bpos, unsigned int level, const Values &values);
+	bool remove(Node &node, Vector3i bpos, unsigned int level);
+	void split(Node &node);
+	void try_merge(Node &node);
+	void free_children(Node &node);
+
+	template <typename Op_T>
+	static void for_all_values(Node &node, Op_T &op) {
+		if (node.children) {
+			for (unsigned int i = 0; i < 8; ++i) {
+				for_all_values(node.children[i], op);
+			}
+		} else if (node.has_values) {
+			op(node.values);
+		}
+	}
+
+private:
+	HashMap<Vector3i, Node *, Vector3iHasher> _roots;
+	int _block_count;
+	int _node_count;
+};
+
+#endif // VOXEL_UNIFORM_OCTREE_H
@@ -0,0 +1,190 @@
+// Measures ArrayOps kernels at each SIMD level, on channels of 16^3 and 32^3 blocks.
+// Not part of the module build. From the module directory, with the Godot source tree at <godot>:
+//
+//   g++ -O2 -I<godot> -I<godot>/platform/x11 tools/array_ops_benchmark.cpp util/array_ops.cpp -o array_ops_benchmark
+//
+// Don't pass -mavx2 or -march=native, the point is to check the kernels picked at runtime.
+// Results of each level are also checked against portable loops.
+
+#include "../util/array_ops.h"
+
+#include <core/error_macros.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// The only parts of Godot's core that ArrayOps uses
+bool _err_error_exists = false;
+void _err_print_error(const char *p_function, const char *p_file, int p_line, const char *p_error, ErrorHandlerType p_type) {
+	fprintf(stderr, "ERROR: %s: %s (%s:%i)\n", p_function, p_error, p_file, p_line);
+}
+
+namespace {
+
+const char *g_level_names[] = { "none", "sse2", "avx2" };
+
+// Prevents the compiler from removing benchmarked calls
+volatile uint64_t g_sink = 0;
+
+// Keeps running the function until enough time passed, returns nanoseconds per call
+template <typename F>
+double measure(F f) {
+	typedef std::chrono::high_resolution_clock Clock;
+	unsigned int iterations = 16;
+	while (true) {
+		const Clock::time_point begin = Clock::now();
+		for (unsigned int i = 0; i < iterations; ++i) {
+			f();
+		}
+		const double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+		if (ns > 50000000.0 || iterations >= (1u << 30)) {
+			return ns / iterations;
+		}
+		iterations *= 2;
+	}
+}
+
+void write_value(uint8_t *data, unsigned int i, unsigned int value_size, uint32_t v) {
+	switch (value_size) {
+		case 1:
+			data[i] = v;
+			break;
+		case 2:
+			reinterpret_cast<uint16_t *>(data)[i] = v;
+			break;
+		case 4:
+			reinterpret_cast<uint32_t *>(data)[i] = v;
+			break;
+	}
+}
+
+struct Case {
+	unsigned int block_size;
+	unsigned int value_size;
+	std::vector<uint8_t> uniform;
+	std::vector<uint8_t> terrain; // Half air, half varied values, like a block crossing the ground
+	std::vector<uint8_t> scratch;
+
+	unsigned int volume() const { return block_size * block_size * block_size; }
+};
+
+void make_case(Case &c, unsigned int block_size, unsigned int value_size) {
+	c.block_size = block_size;
+	c.value_size = value_size;
+	const unsigned int volume = c.volume();
+	c.uniform.assign(volume * value_size, 0);
+	c.terrain.assign(volume * value_size, 0);
+	c.scratch.assign(volume * value_size, 0);
+	srand(1234);
+	for (unsigned int i = 0; i < volume; ++i) {
+		// Y is the innermost coordinate
+		const unsigned int y = i % block_size;
+		write_value(c.uniform.data(), i, value_size, 7);
+		write_value(c.terrain.data(), i, value_size, y < block_size / 2 ? 1 + rand() % 5 : 0);
+	}
+}
+
+// Fills a box inside the block row by row, as VoxelBuffer::fill_area() does
+void fill_sub_box(Case &c, unsigned int margin, uint32_t value) {
+	const unsigned int bs = c.block_size;
+	const unsigned int row_size = bs - 2 * margin;
+	for (unsigned int z = margin; z < bs - margin; ++z) {
+		for (unsigned int x = margin; x < bs - margin; ++x) {
+			const unsigned int i = (z * bs + x) * bs + margin;
+			ArrayOps::fill(c.scratch.data() + i * c.value_size, row_size, c.value_size, value);
+		}
+	}
+}
+
+struct Results {
+	bool uniform_is_uniform;
+	bool terrain_is_uniform;
+	uint32_t min;
+	uint32_t max;
+	unsigned int count;
+	std::vector<uint8_t> filled;
+
+	bool operator==(const Results &other) const {
+		return uniform_is_uniform == other.uniform_is_uniform &&
+			   terrain_is_uniform == other.terrain_is_uniform &&
+			   min == other.min && max == other.max && count == other.count &&
+			   filled == other.filled;
+	}
+};
+
+Results get_results(Case &c) {
+	Results r;
+	r.uniform_is_uniform = ArrayOps::is_uniform(c.uniform.data(), c.volume(), c.value_size);
+	r.terrain_is_uniform = ArrayOps::is_uniform(c.terrain.data(), c.volume(), c.value_size);
+	ArrayOps::get_min_max(c.terrain.data(), c.volume(), c.value_size, r.min, r.max);
+	r.count = ArrayOps::count_value(c.terrain.data(), c.volume(), c.value_size, 0);
+	c.scratch.assign(c.scratch.size(), 0);
+	fill_sub_box(c, 1, 3);
+	r.filled = c.scratch;
+	return r;
+}
+
+void run_case(Case &c, ArrayOps::SimdLevel level, const Results &expected, bool &all_ok) {
+	ArrayOps::set_simd_level(level);
+
+	const bool ok = get_results(c) == expected;
+	all_ok = all_ok && ok;
+
+	const unsigned int volume = c.volume();
+
+	const double is_uniform_ns = measure([&]() {
+		g_sink += ArrayOps::is_uniform(c.uniform.data(), volume, c.value_size);
+	});
+	const double min_max_ns = measure([&]() {
+		uint32_t min, max;
+		ArrayOps::get_min_max(c.terrain.data(), volume, c.value_size, min, max);
+		g_sink += min + max;
+	});
+	const double count_ns = measure([&]() {
+		g_sink += ArrayOps::count_value(c.terrain.data(), volume, c.value_size, 0);
+	});
+	const double fill_ns = measure([&]() {
+		ArrayOps::fill(c.scratch.data(), volume, c.value_size, 3);
+		g_sink += c.scratch[0];
+	});
+	const double sub_box_ns = measure([&]() {
+		fill_sub_box(c, 1, 3);
+		g_sink += c.scratch[0];
+	});
+
+	printf("%4u^3 %2u-bit %-5s %10.0f %10.0f %10.0f %10.0f %10.0f  %s\n",
+			c.block_size, c.value_size * 8, g_level_names[level],
+			is_uniform_ns, min_max_ns, count_ns, fill_ns, sub_box_ns,
+			ok ? "ok" : "MISMATCH");
+}
+
+} // namespace
+
+int main() {
+	const ArrayOps::SimdLevel supported = ArrayOps::get_supported_simd_level();
+	printf("Supported level: %s\n", g_level_names[supported]);
+	printf("Nanoseconds per call on a whole channel. sub_box fills all rows of the block minus a 1-voxel margin.\n\n");
+	printf("%6s %6s %-5s %10s %10s %10s %10s %10s\n", "block", "depth", "level", "is_uniform", "min_max", "count", "fill", "sub_box");
+
+	const unsigned int block_sizes[] = { 16, 32 };
+	const unsigned int value_sizes[] = { 1, 2, 4 };
+	bool all_ok = true;
+
+	for (unsigned int bi = 0; bi < 2; ++bi) {
+		for (unsigned int vi = 0; vi < 3; ++vi) {
+			Case c;
+			make_case(c, block_sizes[bi], value_sizes[vi]);
+
+			ArrayOps::set_simd_level(ArrayOps::SIMD_NONE);
+			const Results expected = get_results(c);
+
+			for (int level = ArrayOps::SIMD_NONE; level <= supported; ++level) {
+				run_case(c, (ArrayOps::SimdLevel)level, expected, all_ok);
+			}
+		}
+	}
+
+	return all_ok ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+# Compares meshing times of the three meshers with voxels stored in linear and brick layouts.
+# Not part of the module build. Run it with an editor or export template built with the module:
+#
+#   godot --no-window -s tools/mesher_layout_benchmark.gd
+#
+# Buffers are padded blocks of 16^3 and 32^3 with a hilly ground crossing them, like terrains give to meshers.
+# Meshes built in both layouts are also compared, they must be identical.
+
+extends SceneTree
+
+const PADDING = 2
+const BLOCK_SIZES = [16, 32]
+const ITERATIONS = 20
+
+var _library
+
+
+func _init():
+	_library = VoxelLibrary.new()
+	_library.create_voxel(0, "air").set_transparent(true)
+	var solid = _library.create_voxel(1, "solid")
+	solid.set_transparent(false)
+	solid.set_geometry_type(Voxel.GEOMETRY_CUBE)
+
+	var blocky = VoxelMesherBlocky.new()
+	blocky.set_library(_library)
+	var meshers = {
+		"blocky": blocky,
+		"transvoxel": VoxelMesherTransvoxel.new(),
+		"dmc": VoxelMesherDMC.new()
+	}
+
+	print("Microseconds per mesh, average of ", ITERATIONS, " builds")
+	var all_ok = true
+
+	for block_size in BLOCK_SIZES:
+		var linear_buffer = make_buffer(block_size + 2 * PADDING)
+		var bricks_buffer = linear_buffer.duplicate()
+		bricks_buffer.set_layout(VoxelBuffer.LAYOUT_BRICKS)
+
+		for mesher_name in meshers:
+			var mesher = meshers[mesher_name]
+			var linear_time = measure(mesher, linear_buffer)
+			var bricks_time = measure(mesher, bricks_buffer)
+			var ok = get_vertices(mesher.build_mesh(linear_buffer)) == get_vertices(mesher.build_mesh(bricks_buffer))
+			all_ok = all_ok and ok
+			print("%d^3 %-10s linear %8d  bricks %8d  %s" % [
+				block_size, mesher_name, linear_time, bricks_time, "ok" if ok else "MISMATCH"])
+
+	quit(0 if all_ok else 1)
+
+
+func make_buffer(size):
+	var buffer = VoxelBuffer.new()
+	buffer.create(size, size, size)
+	for z in size:
+		for x in size:
+			var height = size / 2 + 3.0 * sin(x * 0.3) * cos(z * 0.2)
+			for y in size:
+				buffer.set_voxel(1 if y < height else 0, x, y, z, VoxelBuffer.CHANNEL_TYPE)
+				buffer.set_voxel_f((y - height) / 4.0, x, y, z, VoxelBuffer.CHANNEL_ISOLEVEL)
+	return buffer
+
+
+func measure(mesher, buffer):
+	# First build warms up caches and memory re-used by the mesher
+	mesher.build_mesh(buffer)
+	var begin = OS.get_ticks_usec()
+	for i in ITERATIONS:
+		mesher.build_mesh(buffer)
+	return (OS.get_ticks_usec() - begin) / ITERATIONS
+
+
+func get_vertices(mesh):
+	if mesh == null:
+		return []
+	var vertices = []
+	for i in mesh.get_surface_count():
+		vertices.append(mesh.surface_get_arrays(i)[Mesh.ARRAY_VERTEX])
+	return vertices
@@ -0,0 +1,609 @@
+#include "array_ops.h"
+
+#include <core/error_macros.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXEL_ARRAY_OPS_SSE2
+#include <emmintrin.h>
+
+// AVX2 kernels are compiled for all x86 targets having SSE2, and only used if the CPU supports them
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define VOXEL_ARRAY_OPS_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define VOXEL_AVX2_FUNC
+#else
+#define VOXEL_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
+#endif
+
+namespace {
+
+ArrayOps::SimdLevel detect_simd_level() {
+#if defined(VOXEL_ARRAY_OPS_AVX2) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7) {
+		__cpuid(info, 1);
+		// The OS must also save YMM registers
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		const bool avx = (info[2] & (1 << 28)) != 0;
+		if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+			__cpuidex(info, 7, 0);
+			if ((info[1] & (1 << 5)) != 0) {
+				return ArrayOps::SIMD_AVX2;
+			}
+		}
+	}
+	return ArrayOps::SIMD_SSE2;
+#elif defined(VOXEL_ARRAY_OPS_AVX2)
+	// Also checks that the OS supports it
+	if (__builtin_cpu_supports("avx2")) {
+		return ArrayOps::SIMD_AVX2;
+	}
+	return ArrayOps::SIMD_SSE2;
+#elif defined(VOXEL_ARRAY_OPS_SSE2)
+	return ArrayOps::SIMD_SSE2;
+#else
+	return ArrayOps::SIMD_NONE;
+#endif
+}
+
+const ArrayOps::SimdLevel g_supported_simd_level = detect_simd_level();
+ArrayOps::SimdLevel g_simd_level = g_supported_simd_level;
+
+// Fills 16 bytes with the given value repeated, as it would be stored in an array
+void make_pattern(uint8_t pattern[16], uint32_t value, unsigned int value_size) {
+	switch (value_size) {
+		case 1:
+			memset(pattern, value, 16);
+			break;
+		case 2: {
+			uint16_t v = value;
+			for (unsigned int i = 0; i < 16; i += 2) {
+				memcpy(pattern + i, &v, 2);
+			}
+		} break;
+		case 4:
+			for (unsigned int i = 0; i < 16; i += 4) {
+				memcpy(pattern + i, &value, 4);
+			}
+			break;
+		default:
+			CRASH_NOW();
+	}
+}
+
+uint32_t get_value(const uint8_t *data, unsigned int i, unsigned int value_size) {
+	switch (value_size) {
+		case 1:
+			return data[i];
+		case 2:
+			return reinterpret_cast<const uint16_t *>(data)[i];
+		case 4:
+			return reinterpret_cast<const uint32_t *>(data)[i];
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+template <typename T>
+void get_min_max_scalar(const T *data, unsigned int begin, unsigned int end, uint32_t &io_min, uint32_t &io_max) {
+	for (unsigned int i = begin; i < end; ++i) {
+		const T v = data[i];
+		if (v < io_min) {
+			io_min = v;
+		}
+		if (v > io_max) {
+			io_max = v;
+		}
+	}
+}
+
+// Kernels below process the beginning of arrays, and return how far they went.
+// The rest is done by portable loops.
+
+// Returns false if a byte differs from the pattern. io_i is in bytes.
+bool is_uniform_scalar(const uint8_t *data, unsigned int size, const uint8_t pattern[16], unsigned int &io_i) {
+	uint64_t p;
+	memcpy(&p, pattern, sizeof(p));
+	unsigned int i = io_i;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t v;
+		memcpy(&v, data + i, sizeof(v));
+		if (v != p) {
+			return false;
+		}
+	}
+	io_i = i;
+	return true;
+}
+
+#ifdef VOXEL_ARRAY_OPS_SSE2
+
+bool is_uniform_sse2(const uint8_t *data, unsigned int size, const uint8_t pattern[16], unsigned int &io_i) {
+	const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pattern));
+	unsigned int i = io_i;
+	// Checking 64 bytes at once, because uniform blocks are common and have to be fully scanned
+	for (; i + 64 <= size; i += 64) {
+		const __m128i *v = reinterpret_cast<const __m128i *>(data + i);
+		__m128i eq = _mm_and_si128(
+				_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(v), p), _mm_cmpeq_epi8(_mm_loadu_si128(v + 1), p)),
+				_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(v + 2), p), _mm_cmpeq_epi8(_mm_loadu_si128(v + 3), p)));
+		if (_mm_movemask_epi8(eq) != 0xffff) {
+			return false;
+		}
+	}
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, p)) != 0xffff) {
+			return false;
+		}
+	}
+	io_i = i;
+	return true;
+}
+
+template <unsigned int N>
+inline __m128i cmpeq(__m128i a, __m128i b);
+
+template <>
+inline __m128i cmpeq<1>(__m128i a, __m128i b) { return _mm_cmpeq_epi8(a, b); }
+template <>
+inline __m128i cmpeq<2>(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+template <>
+inline __m128i cmpeq<4>(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+
+// Counts bytes belonging to matching values, 16 at a time.
+// Returns how many bytes were processed.
+template <unsigned int N>
+unsigned int count_matching_bytes_sse2(const uint8_t *data, unsigned int size, const uint8_t pattern[16], uint64_t &out_bytes) {
+	const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pattern));
+	const __m128i zero = _mm_setzero_si128();
+	const unsigned int end = size & ~15u;
+	__m128i total = zero;
+	unsigned int i = 0;
+
+	while (i < end) {
+		// Byte counters would overflow after 255 iterations
+		const unsigned int batch_end = MIN(end, i + 255 * 16);
+		__m128i counters = zero;
+		for (; i < batch_end; i += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+			counters = _mm_sub_epi8(counters, cmpeq<N>(v, p));
+		}
+		total = _mm_add_epi64(total, _mm_sad_epu8(counters, zero));
+	}
+
+	uint64_t sums[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(sums), total);
+	out_bytes = sums[0] + sums[1];
+	return end;
+}
+
+// SSE2 only has signed comparisons for 32-bit values, so they are offset to keep unsigned order
+unsigned int get_min_max_u32_sse2(const uint8_t *data, unsigned int count, uint32_t &io_min, uint32_t &io_max) {
+	const unsigned int end = count & ~3u;
+	if (end == 0) {
+		return 0;
+	}
+	const __m128i bias = _mm_set1_epi32(0x80000000);
+	__m128i vmin = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), bias);
+	__m128i vmax = vmin;
+	for (unsigned int i = 4; i < end; i += 4) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 4)), bias);
+		__m128i lt = _mm_cmplt_epi32(v, vmin);
+		vmin = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vmin));
+		__m128i gt = _mm_cmpgt_epi32(v, vmax);
+		vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+	}
+	uint32_t mins[4];
+	uint32_t maxs[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(mins), _mm_xor_si128(vmin, bias));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(maxs), _mm_xor_si128(vmax, bias));
+	get_min_max_scalar(mins, 0, 4, io_min, io_max);
+	get_min_max_scalar(maxs, 0, 4, io_min, io_max);
+	return end;
+}
+
+unsigned int get_min_max_u16_sse2(const uint8_t *data, unsigned int count, uint32_t &io_min, uint32_t &io_max) {
+	const unsigned int end = count & ~7u;
+	if (end == 0) {
+		return 0;
+	}
+	// Same as 32-bit, but SSE2 has min and max for signed 16-bit values
+	const __m128i bias = _mm_set1_epi16(-0x8000);
+	__m128i vmin = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), bias);
+	__m128i vmax = vmin;
+	for (unsigned int i = 8; i < end; i += 8) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 2)), bias);
+		vmin = _mm_min_epi16(vmin, v);
+		vmax = _mm_max_epi16(vmax, v);
+	}
+	uint16_t mins[8];
+	uint16_t maxs[8];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(mins), _mm_xor_si128(vmin, bias));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(maxs), _mm_xor_si128(vmax, bias));
+	get_min_max_scalar(mins, 0, 8, io_min, io_max);
+	get_min_max_scalar(maxs, 0, 8, io_min, io_max);
+	return end;
+}
+
+unsigned int get_min_max_u8_sse2(const uint8_t *data, unsigned int count, uint32_t &io_min, uint32_t &io_max) {
+	const unsigned int end = count & ~15u;
+	if (end == 0) {
+		return 0;
+	}
+	__m128i vmin = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+	__m128i vmax = vmin;
+	for (unsigned int i = 16; i < end; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		vmin = _mm_min_epu8(vmin, v);
+		vmax = _mm_max_epu8(vmax, v);
+	}
+	uint8_t mins[16];
+	uint8_t maxs[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(mins), vmin);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(maxs), vmax);
+	get_min_max_scalar(mins, 0, 16, io_min, io_max);
+	get_min_max_scalar(maxs, 0, 16, io_min, io_max);
+	return end;
+}
+
+// Returns how many bytes were filled
+unsigned int fill_sse2(uint8_t *data, unsigned int size, const uint8_t pattern[16]) {
+	const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pattern));
+	unsigned int i = 0;
+	for (; i + 16 <= size; i += 16) {
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), p);
+	}
+	return i;
+}
+
+#endif // VOXEL_ARRAY_OPS_SSE2
+
+#ifdef VOXEL_ARRAY_OPS_AVX2
+
+// Same as the SSE2 kernels, with 32 bytes at a time.
+// Blocks of 16^3 8-bit voxels are 4096 bytes, so the wider loop matters more than tails.
+
+VOXEL_AVX2_FUNC inline __m256i load_pattern_avx2(const uint8_t pattern[16]) {
+	return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pattern)));
+}
+
+VOXEL_AVX2_FUNC bool is_uniform_avx2(const uint8_t *data, unsigned int size, const uint8_t pattern[16], unsigned int &io_i) {
+	const __m256i p = load_pattern_avx2(pattern);
+	unsigned int i = io_i;
+	for (; i + 128 <= size; i += 128) {
+		const __m256i *v = reinterpret_cast<const __m256i *>(data + i);
+		__m256i eq = _mm256_and_si256(
+				_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(v), p), _mm256_cmpeq_epi8(_mm256_loadu_si256(v + 1), p)),
+				_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(v + 2), p), _mm256_cmpeq_epi8(_mm256_loadu_si256(v + 3), p)));
+		if (_mm256_movemask_epi8(eq) != -1) {
+			return false;
+		}
+	}
+	for (; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, p)) != -1) {
+			return false;
+		}
+	}
+	io_i = i;
+	return true;
+}
+
+template <unsigned int N>
+VOXEL_AVX2_FUNC inline __m256i cmpeq_avx2(__m256i a, __m256i b);
+
+template <>
+VOXEL_AVX2_FUNC inline __m256i cmpeq_avx2<1>(__m256i a, __m256i b) { return _mm256_cmpeq_epi8(a, b); }
+template <>
+VOXEL_AVX2_FUNC inline __m256i cmpeq_avx2<2>(__m256i a, __m256i b) { return _mm256_cmpeq_epi16(a, b); }
+template <>
+VOXEL_AVX2_FUNC inline __m256i cmpeq_avx2<4>(__m256i a, __m256i b) { return _mm256_cmpeq_epi32(a, b); }
+
+template <unsigned int N>
+VOXEL_AVX2_FUNC unsigned int count_matching_bytes_avx2(const uint8_t *data, unsigned int size, const uint8_t pattern[16], uint64_t &out_bytes) {
+	const __m256i p = load_pattern_avx2(pattern);
+	const __m256i zero = _mm256_setzero_si256();
+	const unsigned int end = size & ~31u;
+	__m256i total = zero;
+	unsigned int i = 0;
+
+	while (i < end) {
+		const unsigned int batch_end = MIN(end, i + 255 * 32);
+		__m256i counters = zero;
+		for (; i < batch_end; i += 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+			counters = _mm256_sub_epi8(counters, cmpeq_avx2<N>(v, p));
+		}
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(counters, zero));
+	}
+
+	uint64_t sums[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(sums), total);
+	out_bytes = sums[0] + sums[1] + sums[2] + sums[3];
+	return end;
+}
+
+// AVX2 has unsigned min and max for all sizes
+VOXEL_AVX2_FUNC unsigned int get_min_max_u32_avx2(const uint8_t *data, unsigned int count, uint32_t &io_min, uint32_t &io_max) {
+	const unsigned int end = count & ~7u;
+	if (end == 0) {
+		return 0;
+	}
+	__m256i vmin = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+	__m256i vmax = vmin;
+	for (unsigned int i = 8; i < end; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i * 4));
+		vmin = _mm256_min_epu32(vmin, v);
+		vmax = _mm256_max_epu32(vmax, v);
+	}
+	uint32_t mins[8];
+	uint32_t maxs[8];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(mins), vmin);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(maxs), vmax);
+	get_min_max_scalar(mins, 0, 8, io_min, io_max);
+	get_min_max_scalar(maxs, 0, 8, io_min, io_max);
+	return end;
+}
+
+VOXEL_AVX2_FUNC unsigned int get_min_max_u16_avx2(const uint8_t *data, unsigned int count, uint32_t &io_min, uint32_t &io_max) {
+	const unsigned int end = count & ~15u;
+	if (end == 0) {
+		return 0;
+	}
+	__m256i vmin = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+	__m256i vmax = vmin;
+	for (unsigned int i = 16; i < end; i += 16) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i * 2));
+		vmin = _mm256_min_epu16(vmin, v);
+		vmax = _mm256_max_epu16(vmax, v);
+	}
+	uint16_t mins[16];
+	uint16_t maxs[16];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(mins), vmin);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(maxs), vmax);
+	get_min_max_scalar(mins, 0, 16, io_min, io_max);
+	get_min_max_scalar(maxs, 0, 16, io_min, io_max);
+	return end;
+}
+
+VOXEL_AVX2_FUNC unsigned int get_min_max_u8_avx2(const uint8_t *data, unsigned int count, uint32_t &io_min, uint32_t &io_max) {
+	const unsigned int end = count & ~31u;
+	if (end == 0) {
+		return 0;
+	}
+	__m256i vmin = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+	__m256i vmax = vmin;
+	for (unsigned int i = 32; i < end; i += 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		vmin = _mm256_min_epu8(vmin, v);
+		vmax = _mm256_max_epu8(vmax, v);
+	}
+	uint8_t mins[32];
+	uint8_t maxs[32];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(mins), vmin);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(maxs), vmax);
+	get_min_max_scalar(mins, 0, 32, io_min, io_max);
+	get_min_max_scalar(maxs, 0, 32, io_min, io_max);
+	return end;
+}
+
+VOXEL_AVX2_FUNC unsigned int fill_avx2(uint8_t *data, unsigned int size, const uint8_t pattern[16]) {
+	const __m256i p = load_pattern_avx2(pattern);
+	unsigned int i = 0;
+	for (; i + 32 <= size; i += 32) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), p);
+	}
+	return i;
+}
+
+#endif // VOXEL_ARRAY_OPS_AVX2
+
+// Dispatch to the kernels of the current level. They return how many values or bytes they processed, 0 if none.
+
+unsigned int get_min_max_simd(const uint8_t *data, unsigned int count, unsigned int value_size, uint32_t &io_min, uint32_t &io_max) {
+	switch (g_simd_level) {
+#ifdef VOXEL_ARRAY_OPS_AVX2
+		case ArrayOps::SIMD_AVX2:
+			switch (value_size) {
+				case 1:
+					return get_min_max_u8_avx2(data, count, io_min, io_max);
+				case 2:
+					return get_min_max_u16_avx2(data, count, io_min, io_max);
+				case 4:
+					return get_min_max_u32_avx2(data, count, io_min, io_max);
+			}
+			break;
+#endif
+#ifdef VOXEL_ARRAY_OPS_SSE2
+		case ArrayOps::SIMD_SSE2:
+			switch (value_size) {
+				case 1:
+					return get_min_max_u8_sse2(data, count, io_min, io_max);
+				case 2:
+					return get_min_max_u16_sse2(data, count, io_min, io_max);
+				case 4:
+					return get_min_max_u32_sse2(data, count, io_min, io_max);
+			}
+			break;
+#endif
+		default:
+			break;
+	}
+	return 0;
+}
+
+unsigned int count_matching_bytes_simd(const uint8_t *data, unsigned int size, unsigned int value_size, const uint8_t pattern[16], uint64_t &out_bytes) {
+	out_bytes = 0;
+	switch (g_simd_level) {
+#ifdef VOXEL_ARRAY_OPS_AVX2
+		case ArrayOps::SIMD_AVX2:
+			switch (value_size) {
+				case 1:
+					return count_matching_bytes_avx2<1>(data, size, pattern, out_bytes);
+				case 2:
+					return count_matching_bytes_avx2<2>(data, size, pattern, out_bytes);
+				case 4:
+					return count_matching_bytes_avx2<4>(data, size, pattern, out_bytes);
+			}
+			break;
+#endif
+#ifdef VOXEL_ARRAY_OPS_SSE2
+		case ArrayOps::SIMD_SSE2:
+			switch (value_size) {
+				case 1:
+					return count_matching_bytes_sse2<1>(data, size, pattern, out_bytes);
+				case 2:
+					return count_matching_bytes_sse2<2>(data, size, pattern, out_bytes);
+				case 4:
+					return count_matching_bytes_sse2<4>(data, size, pattern, out_bytes);
+			}
+			break;
+#endif
+		default:
+			break;
+	}
+	return 0;
+}
+
+} // namespace
+
+namespace ArrayOps {
+
+SimdLevel get_supported_simd_level() {
+	return g_supported_simd_level;
+}
+
+void set_simd_level(SimdLevel level) {
+	ERR_FAIL_COND(level < SIMD_NONE || level > g_supported_simd_level);
+	g_simd_level = level;
+}
+
+SimdLevel get_simd_level() {
+	return g_simd_level;
+}
+
+bool is_uniform(const uint8_t *data, unsigned int count, unsigned int value_size) {
+	ERR_FAIL_COND_V(data == NULL, true);
+	if (count <= 1) {
+		return true;
+	}
+
+	// Values are compared as raw bytes against the first value repeated
+	const unsigned int size = count * value_size;
+	uint8_t pattern[16];
+	make_pattern(pattern, get_value(data, 0, value_size), value_size);
+	unsigned int i = 0;
+	bool uniform;
+
+	switch (g_simd_level) {
+#ifdef VOXEL_ARRAY_OPS_AVX2
+		case SIMD_AVX2:
+			uniform = is_uniform_avx2(data, size, pattern, i);
+			break;
+#endif
+#ifdef VOXEL_ARRAY_OPS_SSE2
+		case SIMD_SSE2:
+			uniform = is_uniform_sse2(data, size, pattern, i);
+			break;
+#endif
+		default:
+			uniform = is_uniform_scalar(data, size, pattern, i);
+			break;
+	}
+
+	if (!uniform) {
+		return false;
+	}
+
+	for (; i < size; ++i) {
+		if (data[i] != pattern[i & 15]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void get_min_max(const uint8_t *data, unsigned int count, unsigned int value_size, uint32_t &out_min, uint32_t &out_max) {
+	ERR_FAIL_COND(data == NULL);
+	ERR_FAIL_COND(count == 0);
+
+	out_min = 0xffffffff;
+	out_max = 0;
+	const unsigned int i = get_min_max_simd(data, count, value_size, out_min, out_max);
+
+	switch (value_size) {
+		case 1:
+			get_min_max_scalar(data, i, count, out_min, out_max);
+			break;
+		case 2:
+			get_min_max_scalar(reinterpret_cast<const uint16_t *>(data), i, count, out_min, out_max);
+			break;
+		case 4:
+			get_min_max_scalar(reinterpret_cast<const uint32_t *>(data), i, count, out_min, out_max);
+			break;
+		default:
+			CRASH_NOW();
+	}
+}
+
+unsigned int count_value(const uint8_t *data, unsigned int count, unsigned int value_size, uint32_t value) {
+	ERR_FAIL_COND_V(data == NULL, 0);
+
+	uint8_t pattern[16];
+	make_pattern(pattern, value, value_size);
+	uint64_t matching_bytes = 0;
+	const unsigned int end = count_matching_bytes_simd(data, count * value_size, value_size, pattern, matching_bytes);
+
+	unsigned int n = matching_bytes / value_size;
+	for (unsigned int i = end / value_size; i < count; ++i) {
+		if (get_value(data, i, value_size) == value) {
+			++n;
+		}
+	}
+	return n;
+}
+
+void fill(uint8_t *data, unsigned int count, unsigned int value_size, uint32_t value) {
+	ERR_FAIL_COND(data == NULL);
+
+	if (value_size == 1) {
+		memset(data, value, count);
+		return;
+	}
+
+	const unsigned int size = count * value_size;
+	uint8_t pattern[16];
+	make_pattern(pattern, value, value_size);
+	unsigned int i = 0;
+
+	switch (g_simd_level) {
+#ifdef VOXEL_ARRAY_OPS_AVX2
+		case SIMD_AVX2:
+			i = fill_avx2(data, size, pattern);
+			break;
+#endif
+#ifdef VOXEL_ARRAY_OPS_SSE2
+		case SIMD_SSE2:
+			i = fill_sse2(data, size, pattern);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	// Kernels can leave more than the pattern's size
+	for (; i + 16 <= size; i += 16) {
+		memcpy(data + i, pattern, 16);
+	}
+	memcpy(data + i, pattern, size - i);
+}
+
+} // namespace ArrayOps
@@ -0,0 +1,36 @@
+#ifndef VOXEL_ARRAY_OPS_H
+#define VOXEL_ARRAY_OPS_H
+
+#include <core/typedefs.h>
+
+// Bulk operations on arrays of 8, 16 or 32-bit unsigned values, such as dense voxel channels.
+// On x86, AVX2 is used if the CPU supports it, and SSE2 otherwise. Other targets use portable loops.
+// value_size is in bytes, and count is in values.
+// See tools/array_ops_benchmark.cpp to compare levels.
+namespace ArrayOps {
+
+enum SimdLevel {
+	SIMD_NONE, // Portable loops
+	SIMD_SSE2,
+	SIMD_AVX2
+};
+
+// Best level available, detected when the program starts
+SimdLevel get_supported_simd_level();
+
+// Level used by the functions below, the best available by default.
+// Lower levels can be forced to compare them. Not thread-safe, meant to be set before using the functions.
+void set_simd_level(SimdLevel level);
+SimdLevel get_simd_level();
+
+bool is_uniform(const uint8_t *data, unsigned int count, unsigned int value_size);
+
+void get_min_max(const uint8_t *data, unsigned int count, unsigned int value_size, uint32_t &out_min, uint32_t &out_max);
+
+unsigned int count_value(const uint8_t *data, unsigned int count, unsigned int value_size, uint32_t value);
+
+void fill(uint8_t *data, unsigned int count, unsigned int value_size, uint32_t value);
+
+} // namespace ArrayOps
+
+#endif // VOXEL_ARRAY_OPS_H
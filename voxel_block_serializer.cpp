@@ -0,0 +1,280 @@
+#include "voxel_block_serializer.h"
+#include "voxel_buffer.h"
+
+#include <core/io/marshalls.h>
+
+namespace {
+
+const uint8_t FORMAT_VERSION = 1;
+
+// Appends bytes at the end of a vector, growing it as needed
+class ByteWriter {
+public:
+	ByteWriter(Vector<uint8_t> &data) :
+			_data(data),
+			_pos(0) {}
+
+	void write_u8(uint8_t v) {
+		uint8_t *w = grow(1);
+		*w = v;
+	}
+
+	void write_u16(uint16_t v) {
+		encode_uint16(v, grow(2));
+	}
+
+	void write_u32(uint32_t v) {
+		encode_uint32(v, grow(4));
+	}
+
+	void write_bytes(const uint8_t *src, unsigned int size) {
+		memcpy(grow(size), src, size);
+	}
+
+	unsigned int get_position() const { return _pos; }
+
+private:
+	uint8_t *grow(unsigned int size) {
+		if (_pos + size > (unsigned int)_data.size()) {
+			// Scratch buffers are re-used, so this stops happening after a few blocks
+			_data.resize(MAX(_pos + size, _data.size() * 2));
+		}
+		uint8_t *p = _data.ptrw() + _pos;
+		_pos += size;
+		return p;
+	}
+
+	Vector<uint8_t> &_data;
+	unsigned int _pos;
+};
+
+// Reads bytes one after the other, failing instead of reading past the end
+class ByteReader {
+public:
+	ByteReader(const uint8_t *data, unsigned int size) :
+			_data(data),
+			_size(size),
+			_pos(0) {}
+
+	bool read_u8(uint8_t &v) {
+		ERR_FAIL_COND_V(_pos + 1 > _size, false);
+		v = _data[_pos];
+		_pos += 1;
+		return true;
+	}
+
+	bool read_u16(uint16_t &v) {
+		ERR_FAIL_COND_V(_pos + 2 > _size, false);
+		v = decode_uint16(_data + _pos);
+		_pos += 2;
+		return true;
+	}
+
+	bool read_u32(uint32_t &v) {
+		ERR_FAIL_COND_V(_pos + 4 > _size, false);
+		v = decode_uint32(_data + _pos);
+		_pos += 4;
+		return true;
+	}
+
+	bool read_bytes(uint8_t *dst, unsigned int size) {
+		ERR_FAIL_COND_V(_pos + size > _size, false);
+		memcpy(dst, _data + _pos, size);
+		_pos += size;
+		return true;
+	}
+
+private:
+	const uint8_t *_data;
+	unsigned int _size;
+	unsigned int _pos;
+};
+
+} // namespace
+
+// Format:
+// uint8 version
+// uint32 size_x, size_y, size_z
+// For each channel:
+//     uint8 compression
+//     uint8 depth
+//     uint32 default value
+//     If palette:
+//         uint8 index bits
+//         uint16 palette size
+//         uint32[palette size] palette
+//         bit-packed indexes
+//     If dense:
+//         values, as large as the depth
+// Values are little-endian, except dense arrays which are copied as-is.
+// Voxels are in linear order, whatever the layout of the buffer.
+void VoxelBlockSerializer::serialize(const VoxelBuffer &buffer, Vector<uint8_t> &out_data) {
+
+	if (buffer.get_layout() != VoxelBuffer::LAYOUT_LINEAR) {
+		// Copying channels into a linear buffer reorders them
+		VoxelBuffer linear_buffer;
+		linear_buffer.create(buffer.get_size().x, buffer.get_size().y, buffer.get_size().z);
+		for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+			linear_buffer.copy_from(buffer, i);
+		}
+		serialize(linear_buffer, out_data);
+		return;
+	}
+
+	ByteWriter w(out_data);
+	const Vector3i size = buffer.get_size();
+	const unsigned int volume = buffer.get_volume();
+
+	w.write_u8(FORMAT_VERSION);
+	w.write_u32(size.x);
+	w.write_u32(size.y);
+	w.write_u32(size.z);
+
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		const VoxelBuffer::Channel &channel = buffer._channels[i];
+		const VoxelBuffer::Compression compression = buffer.get_channel_compression(i);
+
+		w.write_u8(compression);
+		w.write_u8(channel.depth);
+		w.write_u32(channel.defval);
+
+		switch (compression) {
+			case VoxelBuffer::COMPRESSION_UNIFORM:
+				break;
+
+			case VoxelBuffer::COMPRESSION_PALETTE:
+				w.write_u8(channel.palette_bits);
+				w.write_u16(channel.palette_size);
+				for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+					w.write_u32(channel.palette[pi]);
+				}
+				w.write_bytes(channel.data, VoxelBuffer::get_packed_size(volume, channel.palette_bits));
+				break;
+
+			case VoxelBuffer::COMPRESSION_NONE:
+				w.write_bytes(channel.data, volume * VoxelBuffer::get_depth_byte_count((VoxelBuffer::Depth)channel.depth));
+				break;
+
+			default:
+				CRASH_NOW();
+		}
+	}
+
+	out_data.resize(w.get_position());
+}
+
+bool VoxelBlockSerializer::deserialize(const uint8_t *data, int size, VoxelBuffer &out_buffer) {
+
+	ERR_FAIL_COND_V(data == NULL, false);
+	ByteReader r(data, size);
+
+	uint8_t version;
+	ERR_FAIL_COND_V(!r.read_u8(version), false);
+	ERR_FAIL_COND_V(version != FORMAT_VERSION, false);
+
+	uint32_t sx, sy, sz;
+	ERR_FAIL_COND_V(!r.read_u32(sx), false);
+	ERR_FAIL_COND_V(!r.read_u32(sy), false);
+	ERR_FAIL_COND_V(!r.read_u32(sz), false);
+
+	// Data is read in linear order, then put back in the layout of the buffer if it supports the size
+	const VoxelBuffer::Layout layout = out_buffer.get_layout();
+	out_buffer.clear();
+	out_buffer.set_layout(VoxelBuffer::LAYOUT_LINEAR);
+	out_buffer.create(sx, sy, sz);
+	ERR_FAIL_COND_V(out_buffer.get_size() != Vector3i(sx, sy, sz), false);
+	const unsigned int volume = out_buffer.get_volume();
+
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		VoxelBuffer::Channel &channel = out_buffer._channels[i];
+
+		uint8_t compression;
+		uint8_t depth;
+		uint32_t defval;
+		ERR_FAIL_COND_V(!r.read_u8(compression), false);
+		ERR_FAIL_COND_V(!r.read_u8(depth), false);
+		ERR_FAIL_COND_V(!r.read_u32(defval), false);
+		ERR_FAIL_COND_V(depth >= VoxelBuffer::DEPTH_COUNT, false);
+
+		channel.depth = depth;
+		channel.defval = defval;
+
+		switch (compression) {
+			case VoxelBuffer::COMPRESSION_UNIFORM:
+				break;
+
+			case VoxelBuffer::COMPRESSION_PALETTE: {
+				uint8_t bits;
+				uint16_t palette_size;
+				ERR_FAIL_COND_V(!r.read_u8(bits), false);
+				ERR_FAIL_COND_V(!r.read_u16(palette_size), false);
+				ERR_FAIL_COND_V(bits == 0 || bits > VoxelBuffer::get_max_palette_bits((VoxelBuffer::Depth)depth) || (bits & (bits - 1)) != 0, false);
+				ERR_FAIL_COND_V(palette_size > (1 << bits), false);
+
+				out_buffer.create_channel_palette(i, out_buffer.get_size(), bits);
+				for (unsigned int pi = 0; pi < palette_size; ++pi) {
+					if (!r.read_u32(channel.palette[pi])) {
+						out_buffer.delete_channel(i);
+						return false;
+					}
+				}
+				channel.palette_size = palette_size;
+
+				if (!r.read_bytes(channel.data, VoxelBuffer::get_packed_size(volume, bits))) {
+					out_buffer.delete_channel(i);
+					return false;
+				}
+			} break;
+
+			case VoxelBuffer::COMPRESSION_NONE:
+				out_buffer.create_channel_noinit(i, out_buffer.get_size());
+				if (!r.read_bytes(channel.data, volume * VoxelBuffer::get_depth_byte_count((VoxelBuffer::Depth)depth))) {
+					out_buffer.delete_channel(i);
+					return false;
+				}
+				break;
+
+			default:
+				ERR_PRINT("Unknown channel compression");
+				return false;
+		}
+
+		// Counts are not saved
+		out_buffer.update_channel_counts(i);
+	}
+
+	if (layout == VoxelBuffer::LAYOUT_BRICKS && VoxelBuffer::can_use_bricks(out_buffer.get_size())) {
+		out_buffer.set_layout(layout);
+	}
+
+	return true;
+}
+
+void VoxelBlockSerializer::serialize_and_compress(const VoxelBuffer &buffer, Vector<uint8_t> &out_data) {
+
+	serialize(buffer, _data);
+
+	const int src_size = _data.size();
+	out_data.resize(4 + Compression::get_max_compressed_buffer_size(src_size, COMPRESSION_MODE));
+
+	// The uncompressed size must be known to decompress
+	encode_uint32(src_size, out_data.ptrw());
+	int compressed_size = Compression::compress(out_data.ptrw() + 4, _data.ptr(), src_size, COMPRESSION_MODE);
+	CRASH_COND(compressed_size < 0);
+
+	out_data.resize(4 + compressed_size);
+}
+
+bool VoxelBlockSerializer::decompress_and_deserialize(const uint8_t *data, int size, VoxelBuffer &out_buffer) {
+
+	ERR_FAIL_COND_V(data == NULL, false);
+	ERR_FAIL_COND_V(size < 4, false);
+
+	const int decompressed_size = decode_uint32(data);
+	_data.resize(decompressed_size);
+
+	int actual_size = Compression::decompress(_data.ptrw(), decompressed_size, data + 4, size - 4, COMPRESSION_MODE);
+	ERR_FAIL_COND_V(actual_size != decompressed_size, false);
+
+	return deserialize(_data.ptr(), decompressed_size, out_buffer);
+}
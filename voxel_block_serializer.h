@@ -0,0 +1,29 @@
+#ifndef VOXEL_BLOCK_SERIALIZER_H
+#define VOXEL_BLOCK_SERIALIZER_H
+
+#include <core/io/compression.h>
+#include <core/vector.h>
+
+class VoxelBuffer;
+
+// Converts voxel buffers to and from compact byte arrays, for example to keep unused blocks in memory or to save them.
+// Channels are written in their current representation (uniform, palette or dense), so no conversion is needed.
+// Instances keep a scratch buffer, so they should be re-used.
+class VoxelBlockSerializer {
+public:
+	// Godot doesn't include LZ4, and FastLZ is the closest in speed
+	static const Compression::Mode COMPRESSION_MODE = Compression::MODE_FASTLZ;
+
+	// Writes the buffer into out_data, which gets resized to fit exactly
+	void serialize(const VoxelBuffer &buffer, Vector<uint8_t> &out_data);
+	bool deserialize(const uint8_t *data, int size, VoxelBuffer &out_buffer);
+
+	// Same as above, with the result compressed
+	void serialize_and_compress(const VoxelBuffer &buffer, Vector<uint8_t> &out_data);
+	bool decompress_and_deserialize(const uint8_t *data, int size, VoxelBuffer &out_buffer);
+
+private:
+	Vector<uint8_t> _data;
+};
+
+#endif // VOXEL_BLOCK_SERIALIZER_H
@@ -1,9 +1,12 @@
 #include "voxel_buffer.h"
+#include "util/array_ops.h"
+#include "voxel_memory_pool.h"
 
 #include <core/math/math_funcs.h>
 #include <string.h>
 
-VoxelBuffer::VoxelBuffer() {
+VoxelBuffer::VoxelBuffer() :
+		_layout(LAYOUT_LINEAR) {
 	_channels[CHANNEL_ISOLEVEL].defval = 255;
 }
 
@@ -20,13 +23,20 @@ void VoxelBuffer::create(int sx, int sy, int sz) {
 		for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
 			Channel &channel = _channels[i];
 			if (channel.data) {
-				// Channel already contained data
-				// TODO Optimize with realloc
+				// Channel already contained data.
+				// It gets reset to its default value, which doesn't need any allocation.
 				delete_channel(i);
-				create_channel(i, new_size, channel.defval);
 			}
 		}
 		_size = new_size;
+		if (_layout == LAYOUT_BRICKS && !can_use_bricks(_size)) {
+			// Channels are all uniform at this point, so nothing needs reordering
+			_layout = LAYOUT_LINEAR;
+		}
+		// Everything is new
+		for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+			mark_all_dirty(i);
+		}
 	}
 }
 
@@ -35,99 +45,354 @@ void VoxelBuffer::clear() {
 		Channel &channel = _channels[i];
 		if (channel.data) {
 			delete_channel(i);
+			mark_all_dirty(i);
 		}
 	}
 }
 
-void VoxelBuffer::clear_channel(unsigned int channel_index, int clear_value) {
+void VoxelBuffer::clear_channel(unsigned int channel_index, uint32_t clear_value) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	if (_channels[channel_index].data) {
-		delete_channel(channel_index);
+	fill(clear_value, channel_index);
+}
+
+void VoxelBuffer::set_layout(Layout layout) {
+	ERR_FAIL_INDEX(layout, LAYOUT_COUNT);
+	if (layout == _layout) {
+		return;
+	}
+	ERR_FAIL_COND(layout == LAYOUT_BRICKS && !can_use_bricks(_size));
+
+	const Layout old_layout = _layout;
+	_layout = layout;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		reorder_channel(i, old_layout);
 	}
-	_channels[channel_index].defval = clear_value;
 }
 
-void VoxelBuffer::set_default_values(uint8_t values[VoxelBuffer::MAX_CHANNELS]) {
+bool VoxelBuffer::can_use_bricks(Vector3i size) {
+	return (size.x & BRICK_MASK) == 0 && (size.y & BRICK_MASK) == 0 && (size.z & BRICK_MASK) == 0;
+}
+
+void VoxelBuffer::get_index_offsets(unsigned int *x_offsets, unsigned int *y_offsets, unsigned int *z_offsets) const {
+	ERR_FAIL_COND(x_offsets == NULL || y_offsets == NULL || z_offsets == NULL);
+
+	if (_layout == LAYOUT_LINEAR) {
+		for (int y = 0; y < _size.y; ++y) {
+			y_offsets[y] = y;
+		}
+		for (int x = 0; x < _size.x; ++x) {
+			x_offsets[x] = x * _size.y;
+		}
+		for (int z = 0; z < _size.z; ++z) {
+			z_offsets[z] = z * _size.x * _size.y;
+		}
+
+	} else {
+		// Bricks are indexed like voxels, and voxels within them too, see get_index()
+		const unsigned int brick_volume = 1 << (3 * BRICK_SIZE_PO2);
+		const unsigned int bricks_x = _size.x >> BRICK_SIZE_PO2;
+		const unsigned int bricks_y = _size.y >> BRICK_SIZE_PO2;
+		for (int y = 0; y < _size.y; ++y) {
+			y_offsets[y] = (y >> BRICK_SIZE_PO2) * brick_volume + (y & BRICK_MASK);
+		}
+		for (int x = 0; x < _size.x; ++x) {
+			x_offsets[x] = (x >> BRICK_SIZE_PO2) * bricks_y * brick_volume + (x & BRICK_MASK) * BRICK_SIZE;
+		}
+		for (int z = 0; z < _size.z; ++z) {
+			z_offsets[z] = (z >> BRICK_SIZE_PO2) * bricks_x * bricks_y * brick_volume + (z & BRICK_MASK) * BRICK_SIZE * BRICK_SIZE;
+		}
+	}
+}
+
+void VoxelBuffer::set_default_values(const uint32_t values[VoxelBuffer::MAX_CHANNELS]) {
 	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-		_channels[i].defval = values[i];
+		const uint32_t defval = MIN(values[i], get_depth_max_value((Depth)_channels[i].depth));
+		if (_channels[i].data == NULL && defval != _channels[i].defval) {
+			// Uniform channels have the default value everywhere
+			mark_all_dirty(i);
+		}
+		_channels[i].defval = defval;
+		if (_channels[i].data && _channels[i].palette_bits == 0) {
+			// Dense channels count voxels relative to the default value
+			update_channel_counts(i);
+		}
+	}
+}
+
+uint32_t VoxelBuffer::convert_value_depth(uint32_t value, Depth src_depth, Depth dst_depth, unsigned int channel_index) {
+	if (src_depth == dst_depth) {
+		return value;
 	}
+	if (channel_index == CHANNEL_ISOLEVEL) {
+		return iso_to_raw(raw_to_iso(value, src_depth), dst_depth);
+	}
+	return MIN(value, get_depth_max_value(dst_depth));
+}
+
+void VoxelBuffer::set_channel_depth(unsigned int channel_index, Depth depth) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_INDEX(depth, DEPTH_COUNT);
+
+	Channel &channel = _channels[channel_index];
+	const Depth old_depth = (Depth)channel.depth;
+	if (old_depth == depth) {
+		return;
+	}
+
+	channel.defval = convert_value_depth(channel.defval, old_depth, depth, channel_index);
+
+	if (channel.data) {
+		if (channel.palette_bits != 0) {
+			// Indexes stay the same, only palette entries need conversion
+			make_channel_unique(channel_index);
+			for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+				channel.palette[pi] = convert_value_depth(channel.palette[pi], old_depth, depth, channel_index);
+			}
+			channel.depth = depth;
+			// Conversion may have merged entries, or the new depth may not allow current index size
+			repack_palette(channel_index, 0);
+
+		} else {
+			uint8_t *old_data = channel.data;
+			channel.data = NULL;
+			channel.depth = depth;
+			create_channel_noinit(channel_index, _size);
+
+			const unsigned int volume = get_volume();
+			for (unsigned int i = 0; i < volume; ++i) {
+				uint32_t v = get_raw_value(old_data, i, old_depth);
+				set_raw_value(channel.data, i, depth, convert_value_depth(v, old_depth, depth, channel_index));
+			}
+
+			release_data(old_data, get_dense_size(volume, old_depth), NULL, 0);
+			// Conversion may have changed which values are the default one
+			update_channel_counts(channel_index);
+		}
+	} else {
+		channel.depth = depth;
+	}
+
+	mark_all_dirty(channel_index);
 }
 
-int VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index) const {
+VoxelBuffer::Depth VoxelBuffer::get_channel_depth(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, DEPTH_8_BIT);
+	return (Depth)_channels[channel_index].depth;
+}
+
+uint32_t VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index) const {
 	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
 
 	const Channel &channel = _channels[channel_index];
 
 	if (validate_pos(x, y, z) && channel.data) {
-		return channel.data[index(x, y, z)];
+		const unsigned int i = index(x, y, z);
+		if (channel.palette_bits == 0) {
+			return get_raw_value(channel.data, i, (Depth)channel.depth);
+		}
+		return channel.palette[get_packed_index(channel.data, i, channel.palette_bits)];
 	} else {
 		return channel.defval;
 	}
 }
 
-void VoxelBuffer::set_voxel(int value, int x, int y, int z, unsigned int channel_index) {
+void VoxelBuffer::set_voxel(uint32_t value, int x, int y, int z, unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	ERR_FAIL_COND(!validate_pos(x, y, z));
 
-	Channel &channel = _channels[channel_index];
-
-	if (channel.data == NULL) {
-		if (channel.defval != value) {
-			// Allocate channel with same initial values as defval
-			create_channel(channel_index, _size, channel.defval);
-			channel.data[index(x, y, z)] = value;
-		}
-	} else {
-		channel.data[index(x, y, z)] = value;
+	if (set_voxel_at_index(channel_index, index(x, y, z), value)) {
+		mark_dirty(channel_index, Vector3i(x, y, z), Vector3i(x + 1, y + 1, z + 1));
 	}
 }
 
 // This version does not cause errors if out of bounds. Use only if it's okay to be outside.
-void VoxelBuffer::try_set_voxel(int x, int y, int z, int value, unsigned int channel_index) {
+void VoxelBuffer::try_set_voxel(int x, int y, int z, uint32_t value, unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	if (!validate_pos(x, y, z)) {
 		return;
 	}
 
+	if (set_voxel_at_index(channel_index, index(x, y, z), value)) {
+		mark_dirty(channel_index, Vector3i(x, y, z), Vector3i(x + 1, y + 1, z + 1));
+	}
+}
+
+void VoxelBuffer::set_voxel_f(real_t value, int x, int y, int z, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	set_voxel(iso_to_raw(value, (Depth)_channels[channel_index].depth), x, y, z, channel_index);
+}
+
+real_t VoxelBuffer::get_voxel_f(int x, int y, int z, unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
+	return raw_to_iso(get_voxel(x, y, z, channel_index), (Depth)_channels[channel_index].depth);
+}
+
+// Returns true if the voxel changed
+bool VoxelBuffer::set_voxel_at_index(unsigned int channel_index, unsigned int i, uint32_t value) {
+
 	Channel &channel = _channels[channel_index];
+	value = MIN(value, get_depth_max_value((Depth)channel.depth));
 
 	if (channel.data == NULL) {
-		if (channel.defval != value) {
-			create_channel(channel_index, _size, channel.defval);
-			channel.data[index(x, y, z)] = value;
+		if (channel.defval == value) {
+			return false;
 		}
+		// Allocate channel with same initial values as defval.
+		// Two different values fit in one bit per voxel.
+		create_channel_palette(channel_index, _size, 1);
+		channel.palette[0] = channel.defval;
+		get_palette_counts(channel)[0] = get_volume();
+		channel.palette_size = 1;
 	} else {
-		channel.data[index(x, y, z)] = value;
+		make_channel_unique(channel_index);
+	}
+
+	if (channel.palette_bits != 0) {
+		const int pi = get_or_add_palette_index(channel_index, value);
+		if (pi != -1) {
+			// Read after adding the value, because the palette may have been repacked
+			const unsigned int old_pi = get_packed_index(channel.data, i, channel.palette_bits);
+			if (old_pi == (unsigned int)pi) {
+				return false;
+			}
+			uint32_t *counts = get_palette_counts(channel);
+			--counts[old_pi];
+			++counts[pi];
+			set_packed_index(channel.data, i, channel.palette_bits, pi);
+			return true;
+		}
+		// Else the channel became dense
+	}
+
+	const Depth depth = (Depth)channel.depth;
+	const uint32_t old_value = get_raw_value(channel.data, i, depth);
+	if (old_value == value) {
+		return false;
+	}
+	if (old_value == channel.defval) {
+		++channel.non_default_count;
+	} else if (value == channel.defval) {
+		--channel.non_default_count;
+	}
+	set_raw_value(channel.data, i, depth, value);
+	return true;
+}
+
+// Returns the palette index of the given value, adding it to the palette if needed.
+// Returns -1 if the palette had to be dropped in favor of a dense array.
+int VoxelBuffer::get_or_add_palette_index(unsigned int channel_index, uint32_t value) {
+
+	Channel &channel = _channels[channel_index];
+
+	for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+		if (channel.palette[pi] == value) {
+			return pi;
+		}
+	}
+
+	if (channel.palette_size == (1u << channel.palette_bits)) {
+		// Palette is full, unused entries get dropped and indexes may grow
+		repack_palette(channel_index, 1);
+		if (channel.palette_bits == 0) {
+			return -1;
+		}
+	}
+
+	int pi = channel.palette_size;
+	channel.palette[pi] = value;
+	get_palette_counts(channel)[pi] = 0;
+	++channel.palette_size;
+	return pi;
+}
+
+// Rebuilds the palette with only entries that are actually used, so that it can hold the given amount of extra entries.
+// Index size is increased if necessary, and the channel is converted into a dense array if a palette would not save memory.
+void VoxelBuffer::repack_palette(unsigned int channel_index, unsigned int extra_entries) {
+
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.palette_bits == 0);
+
+	const unsigned int volume = get_volume();
+	const unsigned int old_bits = channel.palette_bits;
+
+	const uint32_t *counts = get_palette_counts(channel);
+
+	uint8_t remap[1 << MAX_PALETTE_BITS];
+	uint32_t new_palette[1 << MAX_PALETTE_BITS];
+	uint32_t new_counts[1 << MAX_PALETTE_BITS];
+	unsigned int new_palette_size = 0;
+	for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+		if (counts[pi] != 0) {
+			// Entries may be duplicates after a depth conversion
+			unsigned int npi = 0;
+			while (npi < new_palette_size && new_palette[npi] != channel.palette[pi]) {
+				++npi;
+			}
+			if (npi == new_palette_size) {
+				new_palette[new_palette_size] = channel.palette[pi];
+				new_counts[new_palette_size] = 0;
+				++new_palette_size;
+			}
+			new_counts[npi] += counts[pi];
+			remap[pi] = npi;
+		}
+	}
+
+	unsigned int new_bits = 1;
+	while ((1u << new_bits) < new_palette_size + extra_entries) {
+		new_bits *= 2;
+	}
+
+	if (new_bits > get_max_palette_bits((Depth)channel.depth)) {
+		// Too many different values, a dense array will be as small and faster to access
+		decompress_channel(channel_index);
+		return;
 	}
+
+	// The old arrays may be shared, so new ones are always allocated
+	uint8_t *old_data = channel.data;
+	uint32_t *old_palette = channel.palette;
+
+	channel.data = allocate_data(get_packed_size(volume, new_bits));
+	memset(channel.data, 0, get_packed_size(volume, new_bits));
+	channel.palette = (uint32_t *)VoxelMemoryPool::allocate_block(get_palette_alloc_size(new_bits));
+	memcpy(channel.palette, new_palette, new_palette_size * sizeof(uint32_t));
+	channel.palette_bits = new_bits;
+	channel.palette_size = new_palette_size;
+	memcpy(get_palette_counts(channel), new_counts, new_palette_size * sizeof(uint32_t));
+
+	for (unsigned int i = 0; i < volume; ++i) {
+		set_packed_index(channel.data, i, new_bits, remap[get_packed_index(old_data, i, old_bits)]);
+	}
+
+	release_data(old_data, get_packed_size(volume, old_bits), old_palette, old_bits);
 }
 
-void VoxelBuffer::set_voxel_v(int value, Vector3 pos, unsigned int channel_index) {
+void VoxelBuffer::set_voxel_v(uint32_t value, Vector3 pos, unsigned int channel_index) {
 	set_voxel(value, pos.x, pos.y, pos.z, channel_index);
 }
 
-void VoxelBuffer::fill(int defval, unsigned int channel_index) {
+void VoxelBuffer::fill(uint32_t defval, unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 
 	Channel &channel = _channels[channel_index];
-	if (channel.data == NULL) {
-		// Channel is already optimized and uniform
-		if (channel.defval == defval) {
-			// No change
-			return;
-		} else {
-			// Just change default value
-			channel.defval = defval;
-			return;
-		}
-	} else {
-		create_channel_noinit(channel_index, _size);
+	defval = MIN(defval, get_depth_max_value((Depth)channel.depth));
+	if (channel.data) {
+		// The whole channel gets the same value, so it becomes uniform
+		delete_channel(channel_index);
+		mark_all_dirty(channel_index);
+	} else if (channel.defval != defval) {
+		mark_all_dirty(channel_index);
 	}
+	channel.defval = defval;
+}
 
-	unsigned int volume = get_volume();
-	memset(channel.data, defval, volume);
+void VoxelBuffer::fill_f(float value, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	fill(iso_to_raw(value, (Depth)_channels[channel_index].depth), channel_index);
 }
 
-void VoxelBuffer::fill_area(int defval, Vector3i min, Vector3i max, unsigned int channel_index) {
+void VoxelBuffer::fill_area(uint32_t defval, Vector3i min, Vector3i max, unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 
 	Vector3i::sort_min_max(min, max);
@@ -141,21 +406,66 @@ void VoxelBuffer::fill_area(int defval, Vector3i min, Vector3i max, unsigned int
 	}
 
 	Channel &channel = _channels[channel_index];
+	const Depth depth = (Depth)channel.depth;
+	defval = MIN(defval, get_depth_max_value(depth));
+
 	if (channel.data == NULL) {
 		if (channel.defval == defval) {
 			return;
 		} else {
-			create_channel(channel_index, _size, channel.defval);
+			create_channel_palette(channel_index, _size, 1);
+			channel.palette[0] = channel.defval;
+			get_palette_counts(channel)[0] = get_volume();
+			channel.palette_size = 1;
 		}
+	} else {
+		make_channel_unique(channel_index);
 	}
 
+	mark_dirty(channel_index, min, max);
+
 	Vector3i pos;
 	int volume = get_volume();
+
+	if (channel.palette_bits != 0) {
+		// The value is the same for the whole area, so only one palette lookup is needed
+		int pi = get_or_add_palette_index(channel_index, defval);
+		if (pi != -1) {
+			uint32_t *counts = get_palette_counts(channel);
+			for (pos.z = min.z; pos.z < max.z; ++pos.z) {
+				for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+					for (pos.y = min.y; pos.y < max.y;) {
+						const unsigned int dst_ri = index(pos.x, pos.y, pos.z);
+						const unsigned int run = MIN((unsigned int)(max.y - pos.y), get_run_length(pos.y));
+						CRASH_COND(dst_ri + run > volume);
+						for (unsigned int i = dst_ri; i < dst_ri + run; ++i) {
+							--counts[get_packed_index(channel.data, i, channel.palette_bits)];
+							set_packed_index(channel.data, i, channel.palette_bits, pi);
+						}
+						pos.y += run;
+					}
+				}
+			}
+			counts[pi] += area_size.x * area_size.y * area_size.z;
+			return;
+		}
+		// Else the channel became dense
+	}
+
 	for (pos.z = min.z; pos.z < max.z; ++pos.z) {
 		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
-			unsigned int dst_ri = index(pos.x, pos.y + min.y, pos.z);
-			CRASH_COND(dst_ri >= volume);
-			memset(&channel.data[dst_ri], defval, area_size.y * sizeof(uint8_t));
+			for (pos.y = min.y; pos.y < max.y;) {
+				const unsigned int dst_ri = index(pos.x, pos.y, pos.z);
+				const unsigned int run = MIN((unsigned int)(max.y - pos.y), get_run_length(pos.y));
+				CRASH_COND(dst_ri + run > volume);
+				const unsigned int default_count = count_row_default_values(channel, dst_ri, run);
+				channel.non_default_count += default_count;
+				if (defval == channel.defval) {
+					channel.non_default_count -= run;
+				}
+				ArrayOps::fill(&channel.data[dst_ri * get_depth_byte_count(depth)], run, get_depth_byte_count(depth), defval);
+				pos.y += run;
+			}
 		}
 	}
 }
@@ -169,44 +479,304 @@ bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
 		return true;
 	}
 
-	// Channel isn't optimized, so must look at each voxel
-	uint8_t voxel = channel.data[0];
 	unsigned int volume = get_volume();
-	for (unsigned int i = 1; i < volume; ++i) {
-		if (channel.data[i] != voxel) {
-			return false;
+
+	if (channel.palette_bits != 0) {
+		// Uniform if one entry is used by all voxels
+		const uint32_t *counts = get_palette_counts(channel);
+		for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+			if (counts[pi] != 0) {
+				return counts[pi] == volume;
+			}
 		}
+		return true;
 	}
 
-	return true;
+	if (channel.non_default_count == 0) {
+		return true;
+	} else if (channel.non_default_count != volume) {
+		// Some voxels have the default value, and some don't
+		return false;
+	}
+
+	// No voxel has the default value, so must look at each voxel
+	return ArrayOps::is_uniform(channel.data, volume, get_depth_byte_count((Depth)channel.depth));
+}
+
+void VoxelBuffer::get_channel_min_max(unsigned int channel_index, uint32_t &out_min, uint32_t &out_max) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+
+	const Channel &channel = _channels[channel_index];
+
+	if (channel.data == NULL) {
+		out_min = channel.defval;
+		out_max = channel.defval;
+
+	} else if (channel.palette_bits != 0) {
+		const uint32_t *counts = get_palette_counts(channel);
+		out_min = 0xffffffff;
+		out_max = 0;
+		for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+			if (counts[pi] != 0) {
+				out_min = MIN(out_min, channel.palette[pi]);
+				out_max = MAX(out_max, channel.palette[pi]);
+			}
+		}
+
+	} else {
+		ArrayOps::get_min_max(channel.data, get_volume(), get_depth_byte_count((Depth)channel.depth), out_min, out_max);
+	}
+}
+
+unsigned int VoxelBuffer::count_value(uint32_t value, unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
+
+	const Channel &channel = _channels[channel_index];
+	const unsigned int volume = get_volume();
+
+	if (value > get_depth_max_value((Depth)channel.depth)) {
+		return 0;
+	}
+
+	if (channel.data == NULL) {
+		return channel.defval == value ? volume : 0;
+	}
+
+	if (channel.palette_bits != 0) {
+		for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+			if (channel.palette[pi] == value) {
+				return get_palette_counts(channel)[pi];
+			}
+		}
+		return 0;
+	}
+
+	if (value == channel.defval) {
+		return volume - channel.non_default_count;
+	}
+
+	return ArrayOps::count_value(channel.data, volume, get_depth_byte_count((Depth)channel.depth), value);
+}
+
+bool VoxelBuffer::contains_value(uint32_t value, unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+
+	const Channel &channel = _channels[channel_index];
+	if (channel.data && channel.palette_bits == 0 && value != channel.defval && channel.non_default_count == 0) {
+		// Dense, but only default values
+		return false;
+	}
+	return count_value(value, channel_index) != 0;
 }
 
-// TODO Rename compress_uniform_channels()
+void VoxelBuffer::update_channel_counts(unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+
+	Channel &channel = _channels[channel_index];
+	if (channel.data == NULL) {
+		return;
+	}
+
+	const unsigned int volume = get_volume();
+
+	if (channel.palette_bits != 0) {
+		// Counts are shared along with the palette
+		make_channel_unique(channel_index);
+		uint32_t *counts = get_palette_counts(channel);
+		memset(counts, 0, channel.palette_size * sizeof(uint32_t));
+		for (unsigned int i = 0; i < volume; ++i) {
+			++counts[get_packed_index(channel.data, i, channel.palette_bits)];
+		}
+	} else {
+		channel.non_default_count = volume - count_row_default_values(channel, 0, volume);
+	}
+}
+
+// Counts default values in a range of a dense channel
+unsigned int VoxelBuffer::count_row_default_values(const Channel &channel, unsigned int row_index, unsigned int row_length) const {
+	const unsigned int depth_bytes = get_depth_byte_count((Depth)channel.depth);
+	return ArrayOps::count_value(channel.data + row_index * depth_bytes, row_length, depth_bytes, channel.defval);
+}
+
+// TODO Rename compress_channels()
 void VoxelBuffer::optimize() {
 	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-		if (_channels[i].data && is_uniform(i)) {
-			clear_channel(i, _channels[i].data[0]);
+		Channel &channel = _channels[i];
+		if (channel.data == NULL) {
+			continue;
+		}
+		if (is_uniform(i)) {
+			clear_channel(i, get_voxel(0, 0, 0, i));
+		} else if (channel.palette_bits == 0) {
+			compress_palette(i);
+		} else {
+			// Drop entries that are no longer used, indexes might shrink
+			repack_palette(i, 0);
+		}
+	}
+}
+
+// Converts a dense channel into a palette-compressed one, if it has few enough different values.
+bool VoxelBuffer::compress_palette(unsigned int channel_index) {
+
+	Channel &channel = _channels[channel_index];
+	ERR_FAIL_COND_V(channel.data == NULL, false);
+	ERR_FAIL_COND_V(channel.palette_bits != 0, false);
+
+	const Depth depth = (Depth)channel.depth;
+	const unsigned int max_palette_size = 1 << get_max_palette_bits(depth);
+	const unsigned int volume = get_volume();
+
+	// Indexes are stored temporarily as bytes, so the palette is only searched once per voxel
+	uint8_t *indexes = VoxelMemoryPool::allocate_block(volume);
+	uint32_t palette[1 << MAX_PALETTE_BITS];
+	uint32_t counts[1 << MAX_PALETTE_BITS];
+	unsigned int palette_size = 0;
+
+	// Neighbor voxels are likely to be the same
+	uint32_t last_value = 0;
+	unsigned int last_pi = 0;
+
+	for (unsigned int i = 0; i < volume; ++i) {
+		uint32_t v = get_raw_value(channel.data, i, depth);
+		if (palette_size == 0 || v != last_value) {
+			unsigned int pi = 0;
+			while (pi < palette_size && palette[pi] != v) {
+				++pi;
+			}
+			if (pi == palette_size) {
+				if (palette_size == max_palette_size) {
+					// Too many different values
+					VoxelMemoryPool::recycle_block(indexes, volume);
+					return false;
+				}
+				palette[palette_size] = v;
+				counts[palette_size] = 0;
+				++palette_size;
+			}
+			last_value = v;
+			last_pi = pi;
+		}
+		indexes[i] = last_pi;
+		++counts[last_pi];
+	}
+
+	unsigned int bits = 1;
+	while ((1u << bits) < palette_size) {
+		bits *= 2;
+	}
+
+	release_data(channel.data, get_dense_size(volume, depth), NULL, 0);
+	channel.data = NULL;
+	create_channel_palette(channel_index, _size, bits);
+	memcpy(channel.palette, palette, palette_size * sizeof(uint32_t));
+	memcpy(get_palette_counts(channel), counts, palette_size * sizeof(uint32_t));
+	channel.palette_size = palette_size;
+
+	for (unsigned int i = 0; i < volume; ++i) {
+		set_packed_index(channel.data, i, bits, indexes[i]);
+	}
+
+	VoxelMemoryPool::recycle_block(indexes, volume);
+	return true;
+}
+
+VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, COMPRESSION_NONE);
+	const Channel &channel = _channels[channel_index];
+	if (channel.data == NULL) {
+		return COMPRESSION_UNIFORM;
+	}
+	if (channel.palette_bits != 0) {
+		return COMPRESSION_PALETTE;
+	}
+	return COMPRESSION_NONE;
+}
+
+unsigned int VoxelBuffer::get_memory_usage() const {
+	unsigned int size = sizeof(VoxelBuffer);
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &channel = _channels[i];
+		if (channel.data) {
+			size += DATA_HEADER_SIZE + get_channel_data_size(i);
+			if (channel.palette_bits != 0) {
+				size += get_palette_alloc_size(channel.palette_bits);
+			}
 		}
 	}
+	return size;
+}
+
+// Makes sure the channel is stored as a dense array, so it can be accessed with get_channel_raw().
+void VoxelBuffer::decompress_channel(unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	Channel &channel = _channels[channel_index];
+
+	if (channel.data == NULL) {
+		create_channel(channel_index, _size, channel.defval);
+
+	} else if (channel.palette_bits != 0) {
+		uint8_t *packed_data = channel.data;
+		uint32_t *palette = channel.palette;
+		unsigned int bits = channel.palette_bits;
+
+		const uint32_t *counts = get_palette_counts(channel);
+		uint32_t non_default_count = 0;
+		for (unsigned int pi = 0; pi < channel.palette_size; ++pi) {
+			if (palette[pi] != channel.defval) {
+				non_default_count += counts[pi];
+			}
+		}
+
+		channel.data = NULL;
+		channel.palette = NULL;
+		channel.palette_bits = 0;
+		channel.palette_size = 0;
+
+		create_channel_noinit(channel_index, _size);
+		decode_palette(packed_data, palette, bits, (Depth)channel.depth, channel.data);
+		channel.non_default_count = non_default_count;
+
+		release_data(packed_data, get_packed_size(get_volume(), bits), palette, bits);
+	}
+}
+
+void VoxelBuffer::decode_palette(const uint8_t *data, const uint32_t *palette, unsigned int bits, Depth depth, uint8_t *dst) const {
+	const unsigned int volume = get_volume();
+	for (unsigned int i = 0; i < volume; ++i) {
+		set_raw_value(dst, i, depth, palette[get_packed_index(data, i, bits)]);
+	}
 }
 
 void VoxelBuffer::copy_from(const VoxelBuffer &other, unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	ERR_FAIL_COND(other._size == _size);
+	ERR_FAIL_COND(other._size != _size);
 
 	Channel &channel = _channels[channel_index];
 	const Channel &other_channel = other._channels[channel_index];
 
-	if (other_channel.data) {
-		if (channel.data == NULL) {
-			create_channel_noinit(channel_index, _size);
+	if (channel.data == other_channel.data && channel.depth == other_channel.depth) {
+		// Already sharing the same data, or both uniform
+		if (channel.data == NULL && channel.defval != other_channel.defval) {
+			mark_all_dirty(channel_index);
 		}
-		memcpy(channel.data, other_channel.data, get_volume() * sizeof(uint8_t));
-	} else if (channel.data) {
+		channel.defval = other_channel.defval;
+		return;
+	}
+
+	if (channel.data) {
 		delete_channel(channel_index);
 	}
 
-	channel.defval = other_channel.defval;
+	// The whole channel is replaced, including its format.
+	// Data is shared, it will be copied by whichever buffer modifies it first.
+	if (other_channel.data) {
+		get_data_refcount(other_channel.data).ref();
+	}
+	channel = other_channel;
+	// Voxels get their own copy in this buffer's order if the layouts differ
+	reorder_channel(channel_index, other._layout);
+	mark_all_dirty(channel_index);
 }
 
 void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i src_max, Vector3i dst_min, unsigned int channel_index) {
@@ -223,63 +793,390 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 
 	dst_min.clamp_to(Vector3i(0, 0, 0), _size);
 	Vector3i area_size = src_max - src_min;
-	//Vector3i dst_max = dst_min + area_size;
+	// Parts of the area falling outside of this buffer are not copied
+	area_size.x = MIN(area_size.x, _size.x - dst_min.x);
+	area_size.y = MIN(area_size.y, _size.y - dst_min.y);
+	area_size.z = MIN(area_size.z, _size.z - dst_min.z);
 
-	if (area_size == _size) {
+	if (area_size == _size && other._size == _size) {
 		copy_from(other, channel_index);
 	} else {
-		if (other_channel.data) {
-			if (channel.data == NULL) {
-				create_channel(channel_index, _size, channel.defval);
-			}
-			// Copy row by row
-			Vector3i pos;
-			for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
-				for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-					// Row direction is Y
-					unsigned int src_ri = other.index(pos.x + src_min.x, pos.y + src_min.y, pos.z + src_min.z);
-					unsigned int dst_ri = index(pos.x + dst_min.x, pos.y + dst_min.y, pos.z + dst_min.z);
-					memcpy(&channel.data[dst_ri], &other_channel.data[src_ri], area_size.y * sizeof(uint8_t));
+		// Values are copied as-is, so both channels must have the same format
+		ERR_FAIL_COND(channel.depth != other_channel.depth);
+
+		const Depth depth = (Depth)channel.depth;
+		const unsigned int depth_bytes = get_depth_byte_count(depth);
+
+		if (other_channel.data == NULL) {
+			// The source area has only one value. The destination may contain anything, including that value.
+			fill_area(other_channel.defval, dst_min, dst_min + area_size, channel_index);
+			return;
+		}
+
+		mark_dirty(channel_index, dst_min, dst_min + area_size);
+
+		if (channel.data == NULL || channel.palette_bits != 0) {
+			decompress_channel(channel_index);
+		} else {
+			make_channel_unique(channel_index);
+		}
+		// Copy row by row
+		Vector3i pos;
+		for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+			for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+				// Row direction is Y. Runs must be contiguous in both buffers, which may have different layouts.
+				for (pos.y = 0; pos.y < area_size.y;) {
+					const unsigned int src_ri = other.index(pos.x + src_min.x, pos.y + src_min.y, pos.z + src_min.z);
+					const unsigned int dst_ri = index(pos.x + dst_min.x, pos.y + dst_min.y, pos.z + dst_min.z);
+					const unsigned int run = MIN((unsigned int)(area_size.y - pos.y), MIN(other.get_run_length(pos.y + src_min.y), get_run_length(pos.y + dst_min.y)));
+					channel.non_default_count += count_row_default_values(channel, dst_ri, run);
+					if (other_channel.palette_bits == 0) {
+						memcpy(&channel.data[dst_ri * depth_bytes], &other_channel.data[src_ri * depth_bytes], run * depth_bytes);
+					} else {
+						for (unsigned int i = 0; i < run; ++i) {
+							unsigned int pi = get_packed_index(other_channel.data, src_ri + i, other_channel.palette_bits);
+							set_raw_value(channel.data, dst_ri + i, depth, other_channel.palette[pi]);
+						}
+					}
+					channel.non_default_count -= count_row_default_values(channel, dst_ri, run);
+					pos.y += run;
 				}
 			}
-		} else if (channel.defval != other_channel.defval) {
-			if (channel.data == NULL) {
-				create_channel(channel_index, _size, channel.defval);
-			}
-			// Set row by row
-			Vector3i pos;
-			for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
-				for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-					unsigned int dst_ri = index(pos.x + dst_min.x, pos.y + dst_min.y, pos.z + dst_min.z);
-					memset(&channel.data[dst_ri], other_channel.defval, area_size.y * sizeof(uint8_t));
+		}
+	}
+}
+
+Ref<VoxelBuffer> VoxelBuffer::duplicate() const {
+	Ref<VoxelBuffer> d;
+	d.instance();
+	d->create(_size.x, _size.y, _size.z);
+	d->set_layout(_layout);
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		d->copy_from(*this, i);
+	}
+	return d;
+}
+
+Rect3i VoxelBuffer::get_dirty_region(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, Rect3i());
+	return _dirty_regions[channel_index];
+}
+
+bool VoxelBuffer::is_channel_dirty(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	return _dirty_regions[channel_index].size != Vector3i();
+}
+
+Rect3i VoxelBuffer::consume_dirty_region(unsigned int channel_index) {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, Rect3i());
+	Rect3i region = _dirty_regions[channel_index];
+	_dirty_regions[channel_index] = Rect3i();
+	return region;
+}
+
+void VoxelBuffer::mark_dirty(unsigned int channel_index, Vector3i min, Vector3i max) {
+	min.x = CLAMP(min.x, 0, _size.x);
+	min.y = CLAMP(min.y, 0, _size.y);
+	min.z = CLAMP(min.z, 0, _size.z);
+	max.x = CLAMP(max.x, 0, _size.x);
+	max.y = CLAMP(max.y, 0, _size.y);
+	max.z = CLAMP(max.z, 0, _size.z);
+
+	const Rect3i box(min, max - min);
+	if (box.size.x <= 0 || box.size.y <= 0 || box.size.z <= 0) {
+		return;
+	}
+
+	Rect3i &region = _dirty_regions[channel_index];
+	if (region.size == Vector3i()) {
+		region = box;
+	} else {
+		region = Rect3i::get_bounding_box(region, box);
+	}
+}
+
+void VoxelBuffer::mark_all_dirty(unsigned int channel_index) {
+	mark_dirty(channel_index, Vector3i(), _size);
+}
+
+PoolByteArray VoxelBuffer::get_channel_as_bytes(unsigned int channel_index) const {
+	PoolByteArray bytes;
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, bytes);
+
+	const Channel &channel = _channels[channel_index];
+	const Depth depth = (Depth)channel.depth;
+	const unsigned int volume = get_volume();
+
+	if (channel.data && _layout != LAYOUT_LINEAR) {
+		// Bytes are in linear order, so they are gathered row by row
+		return get_channel_area_as_bytes(channel_index, Vector3i(), _size);
+	}
+
+	bytes.resize(get_dense_size(volume, depth));
+	PoolByteArray::Write w = bytes.write();
+
+	if (channel.data == NULL) {
+		ArrayOps::fill(w.ptr(), volume, get_depth_byte_count(depth), channel.defval);
+	} else if (channel.palette_bits != 0) {
+		decode_palette(channel.data, channel.palette, channel.palette_bits, depth, w.ptr());
+	} else {
+		memcpy(w.ptr(), channel.data, get_dense_size(volume, depth));
+	}
+
+	return bytes;
+}
+
+void VoxelBuffer::set_channel_from_bytes(unsigned int channel_index, const PoolByteArray &bytes) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+
+	Channel &channel = _channels[channel_index];
+	const unsigned int volume = get_volume();
+	const unsigned int size = get_dense_size(volume, (Depth)channel.depth);
+	ERR_FAIL_COND(volume == 0);
+	ERR_FAIL_COND(bytes.size() != size);
+
+	if (_layout != LAYOUT_LINEAR) {
+		// Bytes are in linear order, so they are scattered row by row
+		set_channel_area_from_bytes(channel_index, Vector3i(), _size, bytes);
+		return;
+	}
+
+	// All values are replaced, so the previous data is not needed
+	if (channel.data) {
+		delete_channel(channel_index);
+	}
+	create_channel_noinit(channel_index, _size);
+
+	PoolByteArray::Read r = bytes.read();
+	memcpy(channel.data, r.ptr(), size);
+	update_channel_counts(channel_index);
+	mark_all_dirty(channel_index);
+}
+
+bool VoxelBuffer::validate_area(Vector3i min, Vector3i max) const {
+	return min.x >= 0 && min.y >= 0 && min.z >= 0 &&
+		   max.x <= _size.x && max.y <= _size.y && max.z <= _size.z &&
+		   min.x < max.x && min.y < max.y && min.z < max.z;
+}
+
+PoolByteArray VoxelBuffer::get_channel_area_as_bytes(unsigned int channel_index, Vector3i min, Vector3i max) const {
+	PoolByteArray bytes;
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, bytes);
+	ERR_FAIL_COND_V(!validate_area(min, max), bytes);
+
+	const Channel &channel = _channels[channel_index];
+	const Depth depth = (Depth)channel.depth;
+	const unsigned int depth_bytes = get_depth_byte_count(depth);
+	const Vector3i area_size = max - min;
+
+	bytes.resize(get_dense_size(area_size.x * area_size.y * area_size.z, depth));
+	PoolByteArray::Write w = bytes.write();
+
+	if (channel.data == NULL) {
+		ArrayOps::fill(w.ptr(), area_size.x * area_size.y * area_size.z, depth_bytes, channel.defval);
+		return bytes;
+	}
+
+	// Copy row by row
+	uint8_t *dst = w.ptr();
+	Vector3i pos;
+	for (pos.z = min.z; pos.z < max.z; ++pos.z) {
+		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+			for (pos.y = min.y; pos.y < max.y;) {
+				const unsigned int src_ri = index(pos.x, pos.y, pos.z);
+				const unsigned int run = MIN((unsigned int)(max.y - pos.y), get_run_length(pos.y));
+				if (channel.palette_bits == 0) {
+					memcpy(dst, &channel.data[src_ri * depth_bytes], run * depth_bytes);
+				} else {
+					for (unsigned int i = 0; i < run; ++i) {
+						unsigned int pi = get_packed_index(channel.data, src_ri + i, channel.palette_bits);
+						set_raw_value(dst, i, depth, channel.palette[pi]);
+					}
 				}
+				dst += run * depth_bytes;
+				pos.y += run;
 			}
 		}
 	}
+
+	return bytes;
 }
 
-uint8_t *VoxelBuffer::get_channel_raw(unsigned int channel_index) const {
+void VoxelBuffer::set_channel_area_from_bytes(unsigned int channel_index, Vector3i min, Vector3i max, const PoolByteArray &bytes) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_COND(!validate_area(min, max));
+
+	const Vector3i area_size = max - min;
+	if (area_size == _size && _layout == LAYOUT_LINEAR) {
+		set_channel_from_bytes(channel_index, bytes);
+		return;
+	}
+
+	Channel &channel = _channels[channel_index];
+	const unsigned int depth_bytes = get_depth_byte_count((Depth)channel.depth);
+	const unsigned int row_size = area_size.y * depth_bytes;
+	ERR_FAIL_COND(bytes.size() != row_size * area_size.x * area_size.z);
+
+	if (channel.data == NULL || channel.palette_bits != 0) {
+		decompress_channel(channel_index);
+	} else {
+		make_channel_unique(channel_index);
+	}
+
+	mark_dirty(channel_index, min, max);
+
+	// Copy row by row
+	PoolByteArray::Read r = bytes.read();
+	const uint8_t *src = r.ptr();
+	Vector3i pos;
+	for (pos.z = min.z; pos.z < max.z; ++pos.z) {
+		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+			for (pos.y = min.y; pos.y < max.y;) {
+				const unsigned int dst_ri = index(pos.x, pos.y, pos.z);
+				const unsigned int run = MIN((unsigned int)(max.y - pos.y), get_run_length(pos.y));
+				channel.non_default_count += count_row_default_values(channel, dst_ri, run);
+				memcpy(&channel.data[dst_ri * depth_bytes], src, run * depth_bytes);
+				channel.non_default_count -= count_row_default_values(channel, dst_ri, run);
+				src += run * depth_bytes;
+				pos.y += run;
+			}
+		}
+	}
+}
+
+const uint8_t *VoxelBuffer::get_channel_raw(unsigned int channel_index) const {
 	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, NULL);
 	const Channel &channel = _channels[channel_index];
+	if (channel.palette_bits != 0) {
+		return NULL;
+	}
 	return channel.data;
 }
 
-void VoxelBuffer::create_channel(int i, Vector3i size, uint8_t defval) {
+void VoxelBuffer::create_channel(int i, Vector3i size, uint32_t defval) {
 	create_channel_noinit(i, size);
-	memset(_channels[i].data, defval, get_volume() * sizeof(uint8_t));
+	Channel &channel = _channels[i];
+	unsigned int volume = size.x * size.y * size.z;
+	ArrayOps::fill(channel.data, volume, get_depth_byte_count((Depth)channel.depth), defval);
+	channel.non_default_count = defval == channel.defval ? 0 : volume;
 }
 
 void VoxelBuffer::create_channel_noinit(int i, Vector3i size) {
 	Channel &channel = _channels[i];
 	unsigned int volume = size.x * size.y * size.z;
-	channel.data = (uint8_t *)memalloc(volume * sizeof(uint8_t));
+	channel.data = allocate_data(get_dense_size(volume, (Depth)channel.depth));
+}
+
+void VoxelBuffer::create_channel_palette(int i, Vector3i size, unsigned int bits) {
+	Channel &channel = _channels[i];
+	unsigned int packed_size = get_packed_size(size.x * size.y * size.z, bits);
+	channel.data = allocate_data(packed_size);
+	memset(channel.data, 0, packed_size);
+	channel.palette = (uint32_t *)VoxelMemoryPool::allocate_block(get_palette_alloc_size(bits));
+	channel.palette_bits = bits;
+	channel.palette_size = 0;
 }
 
 void VoxelBuffer::delete_channel(int i) {
 	Channel &channel = _channels[i];
 	ERR_FAIL_COND(channel.data == NULL);
-	memfree(channel.data);
+	release_data(channel.data, get_channel_data_size(i), channel.palette, channel.palette_bits);
 	channel.data = NULL;
+	channel.palette = NULL;
+	channel.palette_bits = 0;
+	channel.palette_size = 0;
+}
+
+// Gives the channel its own copy of its data if it is shared with other buffers, so it can be modified
+void VoxelBuffer::make_channel_unique(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	if (channel.data == NULL || get_data_refcount(channel.data).get() == 1) {
+		return;
+	}
+
+	const unsigned int size = get_channel_data_size(channel_index);
+	uint8_t *shared_data = channel.data;
+	uint32_t *shared_palette = channel.palette;
+
+	channel.data = allocate_data(size);
+	memcpy(channel.data, shared_data, size);
+
+	if (shared_palette) {
+		channel.palette = copy_palette(shared_palette, channel.palette_bits, channel.palette_size);
+	}
+
+	release_data(shared_data, size, shared_palette, channel.palette_bits);
+}
+
+// Moves voxels of a channel from the order of the given layout to the current one.
+// Palette indexes move the same way. The channel gets new data, because the old one may be shared.
+void VoxelBuffer::reorder_channel(unsigned int channel_index, Layout src_layout) {
+	Channel &channel = _channels[channel_index];
+	if (channel.data == NULL || src_layout == _layout) {
+		return;
+	}
+
+	const unsigned int size = get_channel_data_size(channel_index);
+	const Depth depth = (Depth)channel.depth;
+	const unsigned int bits = channel.palette_bits;
+	uint8_t *src_data = channel.data;
+	uint32_t *src_palette = channel.palette;
+
+	channel.data = allocate_data(size);
+	if (src_palette) {
+		channel.palette = copy_palette(src_palette, bits, channel.palette_size);
+	}
+
+	Vector3i pos;
+	for (pos.z = 0; pos.z < _size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < _size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < _size.y; ++pos.y) {
+				const unsigned int src_i = get_index(src_layout, _size, pos.x, pos.y, pos.z);
+				const unsigned int dst_i = index(pos.x, pos.y, pos.z);
+				if (bits == 0) {
+					set_raw_value(channel.data, dst_i, depth, get_raw_value(src_data, src_i, depth));
+				} else {
+					set_packed_index(channel.data, dst_i, bits, get_packed_index(src_data, src_i, bits));
+				}
+			}
+		}
+	}
+
+	release_data(src_data, size, src_palette, bits);
+}
+
+unsigned int VoxelBuffer::get_channel_data_size(unsigned int channel_index) const {
+	const Channel &channel = _channels[channel_index];
+	if (channel.palette_bits != 0) {
+		return get_packed_size(get_volume(), channel.palette_bits);
+	}
+	return get_dense_size(get_volume(), (Depth)channel.depth);
+}
+
+uint8_t *VoxelBuffer::allocate_data(unsigned int size) {
+	uint8_t *block = VoxelMemoryPool::allocate_block(DATA_HEADER_SIZE + size);
+	uint8_t *data = block + DATA_HEADER_SIZE;
+	get_data_refcount(data).init();
+	return data;
+}
+
+// Allocates a palette with the same entries and counts
+uint32_t *VoxelBuffer::copy_palette(const uint32_t *palette, unsigned int bits, unsigned int palette_size) {
+	uint32_t *copy = (uint32_t *)VoxelMemoryPool::allocate_block(get_palette_alloc_size(bits));
+	memcpy(copy, palette, palette_size * sizeof(uint32_t));
+	memcpy(copy + (1 << bits), palette + (1 << bits), palette_size * sizeof(uint32_t));
+	return copy;
+}
+
+// Drops a reference to channel data, which gets recycled with its palette if nothing else uses it
+void VoxelBuffer::release_data(uint8_t *data, unsigned int size, uint32_t *palette, unsigned int palette_bits) {
+	if (!get_data_refcount(data).unref()) {
+		return;
+	}
+	VoxelMemoryPool::recycle_block(data - DATA_HEADER_SIZE, DATA_HEADER_SIZE + size);
+	if (palette) {
+		VoxelMemoryPool::recycle_block((uint8_t *)palette, get_palette_alloc_size(palette_bits));
+	}
 }
 
 void VoxelBuffer::_bind_methods() {
@@ -292,6 +1189,12 @@ void VoxelBuffer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_size_y"), &VoxelBuffer::get_size_y);
 	ClassDB::bind_method(D_METHOD("get_size_z"), &VoxelBuffer::get_size_z);
 
+	ClassDB::bind_method(D_METHOD("set_layout", "layout"), &VoxelBuffer::set_layout);
+	ClassDB::bind_method(D_METHOD("get_layout"), &VoxelBuffer::get_layout);
+
+	ClassDB::bind_method(D_METHOD("set_channel_depth", "channel", "depth"), &VoxelBuffer::set_channel_depth);
+	ClassDB::bind_method(D_METHOD("get_channel_depth", "channel"), &VoxelBuffer::get_channel_depth);
+
 	ClassDB::bind_method(D_METHOD("set_voxel", "value", "x", "y", "z", "channel"), &VoxelBuffer::_set_voxel_binding, DEFVAL(0));
 	ClassDB::bind_method(D_METHOD("set_voxel_f", "value", "x", "y", "z", "channel"), &VoxelBuffer::_set_voxel_f_binding, DEFVAL(0));
 	ClassDB::bind_method(D_METHOD("set_voxel_v", "value", "pos", "channel"), &VoxelBuffer::set_voxel_v, DEFVAL(0));
@@ -303,9 +1206,24 @@ void VoxelBuffer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("fill_area", "value", "min", "max", "channel"), &VoxelBuffer::_fill_area_binding, DEFVAL(0));
 	ClassDB::bind_method(D_METHOD("copy_from", "other", "channel"), &VoxelBuffer::_copy_from_binding, DEFVAL(0));
 	ClassDB::bind_method(D_METHOD("copy_from_area", "other", "src_min", "src_max", "dst_min", "channel"), &VoxelBuffer::_copy_from_area_binding, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("duplicate"), &VoxelBuffer::duplicate);
+
+	ClassDB::bind_method(D_METHOD("get_channel_as_bytes", "channel"), &VoxelBuffer::get_channel_as_bytes);
+	ClassDB::bind_method(D_METHOD("set_channel_from_bytes", "channel", "bytes"), &VoxelBuffer::set_channel_from_bytes);
+	ClassDB::bind_method(D_METHOD("get_channel_area_as_bytes", "channel", "min", "max"), &VoxelBuffer::_get_channel_area_as_bytes_binding);
+	ClassDB::bind_method(D_METHOD("set_channel_area_from_bytes", "channel", "min", "max", "bytes"), &VoxelBuffer::_set_channel_area_from_bytes_binding);
 
 	ClassDB::bind_method(D_METHOD("is_uniform", "channel"), &VoxelBuffer::is_uniform);
+	ClassDB::bind_method(D_METHOD("count_value", "value", "channel"), &VoxelBuffer::_count_value_binding, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("contains_value", "value", "channel"), &VoxelBuffer::_contains_value_binding, DEFVAL(0));
 	ClassDB::bind_method(D_METHOD("optimize"), &VoxelBuffer::optimize);
+	ClassDB::bind_method(D_METHOD("get_channel_compression", "channel"), &VoxelBuffer::get_channel_compression);
+	ClassDB::bind_method(D_METHOD("decompress_channel", "channel"), &VoxelBuffer::decompress_channel);
+	ClassDB::bind_method(D_METHOD("get_memory_usage"), &VoxelBuffer::get_memory_usage);
+
+	ClassDB::bind_method(D_METHOD("get_dirty_region", "channel"), &VoxelBuffer::_get_dirty_region_binding);
+	ClassDB::bind_method(D_METHOD("is_channel_dirty", "channel"), &VoxelBuffer::is_channel_dirty);
+	ClassDB::bind_method(D_METHOD("consume_dirty_region", "channel"), &VoxelBuffer::_consume_dirty_region_binding);
 
 	BIND_ENUM_CONSTANT(CHANNEL_TYPE);
 	BIND_ENUM_CONSTANT(CHANNEL_ISOLEVEL);
@@ -316,6 +1234,20 @@ void VoxelBuffer::_bind_methods() {
 	BIND_ENUM_CONSTANT(CHANNEL_DATA6);
 	BIND_ENUM_CONSTANT(CHANNEL_DATA7);
 	BIND_ENUM_CONSTANT(MAX_CHANNELS);
+
+	BIND_ENUM_CONSTANT(COMPRESSION_NONE);
+	BIND_ENUM_CONSTANT(COMPRESSION_UNIFORM);
+	BIND_ENUM_CONSTANT(COMPRESSION_PALETTE);
+	BIND_ENUM_CONSTANT(COMPRESSION_COUNT);
+
+	BIND_ENUM_CONSTANT(DEPTH_8_BIT);
+	BIND_ENUM_CONSTANT(DEPTH_16_BIT);
+	BIND_ENUM_CONSTANT(DEPTH_32_BIT);
+	BIND_ENUM_CONSTANT(DEPTH_COUNT);
+
+	BIND_ENUM_CONSTANT(LAYOUT_LINEAR);
+	BIND_ENUM_CONSTANT(LAYOUT_BRICKS);
+	BIND_ENUM_CONSTANT(LAYOUT_COUNT);
 }
 
 void VoxelBuffer::_copy_from_binding(Ref<VoxelBuffer> other, unsigned int channel) {
@@ -327,3 +1259,13 @@ void VoxelBuffer::_copy_from_area_binding(Ref<VoxelBuffer> other, Vector3 src_mi
 	ERR_FAIL_COND(other.is_null());
 	copy_from(**other, Vector3i(src_min), Vector3i(src_max), Vector3i(dst_min), channel);
 }
+
+AABB VoxelBuffer::_get_dirty_region_binding(unsigned int channel) const {
+	Rect3i region = get_dirty_region(channel);
+	return AABB(region.pos.to_vec3(), region.size.to_vec3());
+}
+
+AABB VoxelBuffer::_consume_dirty_region_binding(unsigned int channel) {
+	Rect3i region = consume_dirty_region(channel);
+	return AABB(region.pos.to_vec3(), region.size.to_vec3());
+}
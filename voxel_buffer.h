@@ -1,17 +1,28 @@
 #ifndef VOXEL_BUFFER_H
 #define VOXEL_BUFFER_H
 
+#include "math/rect3i.h"
 #include "math/vector3i.h"
 #include <core/reference.h>
+#include <core/safe_refcount.h>
 #include <core/vector.h>
 
 // Dense voxels data storage.
-// Organized in 8-bit channels like images, all optional.
-// Note: for float storage (marching cubes for example), you can map [0..256] to [0..1] and save 3 bytes per cell
+// Organized in channels like images, all optional. Each channel can be 8, 16 or 32 bits deep.
+// Note: for float storage (marching cubes for example), you can map [0..256] to [0..1] and save 3 bytes per cell,
+// or use a wider channel if more precision is needed.
+// Channels holding only a few different values are transparently stored with a palette of bit-packed indexes.
+// Copying a whole channel shares its data with the source, which only gets duplicated when one of them is modified.
+// Value counts are kept up to date as voxels change, so uniformity checks don't have to scan the data.
+// The box of voxels modified in each channel is tracked, so incremental work can be limited to it.
+// Voxels can be stored in rows or in small bricks, see Layout.
 
 class VoxelBuffer : public Reference {
 	GDCLASS(VoxelBuffer, Reference)
 
+	// Reads and writes channels in their internal representation
+	friend class VoxelBlockSerializer;
+
 public:
 	enum ChannelId {
 		CHANNEL_TYPE = 0,
@@ -26,12 +37,54 @@ public:
 		MAX_CHANNELS
 	};
 
-	// TODO Quantification options
-	//	enum ChannelFormat {
-	//		FORMAT_I8_Q256U, // 0..255 integer
-	//		FORMAT_F8_Q1S, // -1..1 float stored in 8 bits
-	//		FORMAT_F16_Q128S // -128..128 float stored in 16 bits
-	//	};
+	enum Compression {
+		COMPRESSION_NONE = 0, // Dense array of values
+		COMPRESSION_UNIFORM, // No data, all voxels have the default value
+		COMPRESSION_PALETTE, // Bit-packed indexes into a small set of values
+		COMPRESSION_COUNT
+	};
+
+	// How many bits are used to store each voxel of a channel
+	enum Depth {
+		DEPTH_8_BIT = 0,
+		DEPTH_16_BIT,
+		DEPTH_32_BIT,
+		DEPTH_COUNT
+	};
+
+	// Order of voxels in channel arrays
+	enum Layout {
+		// Rows along Y, in order [z][x][y]. Fastest for row operations and vertical neighbors.
+		LAYOUT_LINEAR = 0,
+		// Bricks of BRICK_SIZE^3 voxels, ordered [z][x][y] like voxels inside them.
+		// Keeps neighbors along X and Z closer in memory. All sizes must be multiples of BRICK_SIZE.
+		LAYOUT_BRICKS,
+		LAYOUT_COUNT
+	};
+
+	static const unsigned int BRICK_SIZE_PO2 = 2;
+	static const unsigned int BRICK_SIZE = 1 << BRICK_SIZE_PO2;
+	static const unsigned int BRICK_MASK = BRICK_SIZE - 1;
+
+	// Palette indexes start at 1 bit per voxel and double up to this size, beyond which the channel becomes dense.
+	// 8-bit channels are limited to 4-bit indexes, because larger ones would not save any memory.
+	static const unsigned int MAX_PALETTE_BITS = 8;
+
+	static _FORCE_INLINE_ unsigned int get_depth_byte_count(Depth depth) {
+		return 1 << depth;
+	}
+
+	static _FORCE_INLINE_ unsigned int get_depth_bit_count(Depth depth) {
+		return 8 << depth;
+	}
+
+	static _FORCE_INLINE_ uint32_t get_depth_max_value(Depth depth) {
+		return depth == DEPTH_32_BIT ? 0xffffffff : (1u << get_depth_bit_count(depth)) - 1;
+	}
+
+	static _FORCE_INLINE_ unsigned int get_max_palette_bits(Depth depth) {
+		return depth == DEPTH_8_BIT ? 4 : MAX_PALETTE_BITS;
+	}
 
 	// Converts -1..1 float into 0..255 integer
 	static inline int iso_to_byte(real_t iso) {
@@ -48,48 +101,194 @@ public:
 		return static_cast<float>(b - 128) / 128.f;
 	}
 
+	// Isolevels are quantized differently depending on channel depth:
+	// 8-bit: -1..1 float, see iso_to_byte()
+	// 16-bit: -128..128 float with 8 fractional bits, 0 being stored as 32768
+	// 32-bit: raw bits of a single-precision float
+	static inline uint32_t iso_to_raw(real_t iso, Depth depth) {
+		switch (depth) {
+			case DEPTH_8_BIT:
+				return iso_to_byte(iso);
+			case DEPTH_16_BIT: {
+				int v = static_cast<int>(256.f * iso + 32768.f);
+				if (v > 0xffff)
+					return 0xffff;
+				else if (v < 0)
+					return 0;
+				return v;
+			}
+			case DEPTH_32_BIT: {
+				FloatBits fb;
+				fb.f = iso;
+				return fb.u;
+			}
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+	}
+
+	static inline real_t raw_to_iso(uint32_t raw, Depth depth) {
+		switch (depth) {
+			case DEPTH_8_BIT:
+				return byte_to_iso(raw);
+			case DEPTH_16_BIT:
+				return static_cast<float>(static_cast<int>(raw) - 32768) / 256.f;
+			case DEPTH_32_BIT: {
+				FloatBits fb;
+				fb.u = raw;
+				return fb.f;
+			}
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+	}
+
+	// Accesses a value in a dense channel array, which elements are as large as the channel depth
+	static _FORCE_INLINE_ uint32_t get_raw_value(const uint8_t *data, unsigned int i, Depth depth) {
+		switch (depth) {
+			case DEPTH_8_BIT:
+				return data[i];
+			case DEPTH_16_BIT:
+				return reinterpret_cast<const uint16_t *>(data)[i];
+			case DEPTH_32_BIT:
+				return reinterpret_cast<const uint32_t *>(data)[i];
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+	}
+
+	static _FORCE_INLINE_ void set_raw_value(uint8_t *data, unsigned int i, Depth depth, uint32_t value) {
+		switch (depth) {
+			case DEPTH_8_BIT:
+				data[i] = value;
+				break;
+			case DEPTH_16_BIT:
+				reinterpret_cast<uint16_t *>(data)[i] = value;
+				break;
+			case DEPTH_32_BIT:
+				reinterpret_cast<uint32_t *>(data)[i] = value;
+				break;
+			default:
+				CRASH_NOW();
+		}
+	}
+
+	// Converts a value from one depth to another.
+	// Isolevels keep the same meaning, other channels are clamped.
+	static uint32_t convert_value_depth(uint32_t value, Depth src_depth, Depth dst_depth, unsigned int channel_index);
+
 	VoxelBuffer();
 	~VoxelBuffer();
 
 	void create(int sx, int sy, int sz);
 	void clear();
-	void clear_channel(unsigned int channel_index, int clear_value = 0);
+	void clear_channel(unsigned int channel_index, uint32_t clear_value = 0);
 
 	_FORCE_INLINE_ const Vector3i &get_size() const { return _size; }
 
-	void set_default_values(uint8_t values[MAX_CHANNELS]);
+	// Reorders all channels in the given layout.
+	// Creating the buffer with a size the layout doesn't support sets it back to LAYOUT_LINEAR.
+	void set_layout(Layout layout);
+	_FORCE_INLINE_ Layout get_layout() const { return _layout; }
+	static bool can_use_bricks(Vector3i size);
 
-	int get_voxel(int x, int y, int z, unsigned int channel_index = 0) const;
-	void set_voxel(int value, int x, int y, int z, unsigned int channel_index = 0);
-	void set_voxel_v(int value, Vector3 pos, unsigned int channel_index = 0);
+	void set_default_values(const uint32_t values[MAX_CHANNELS]);
 
-	void try_set_voxel(int x, int y, int z, int value, unsigned int channel_index = 0);
+	// Changing the depth of a channel converts its values, see convert_value_depth()
+	void set_channel_depth(unsigned int channel_index, Depth depth);
+	Depth get_channel_depth(unsigned int channel_index) const;
 
-	_FORCE_INLINE_ void set_voxel_f(real_t value, int x, int y, int z, unsigned int channel_index = 0) { set_voxel(iso_to_byte(value), x, y, z, channel_index); }
-	_FORCE_INLINE_ real_t get_voxel_f(int x, int y, int z, unsigned int channel_index = 0) const { return byte_to_iso(get_voxel(x, y, z, channel_index)); }
+	uint32_t get_voxel(int x, int y, int z, unsigned int channel_index = 0) const;
+	void set_voxel(uint32_t value, int x, int y, int z, unsigned int channel_index = 0);
+	void set_voxel_v(uint32_t value, Vector3 pos, unsigned int channel_index = 0);
 
-	_FORCE_INLINE_ int get_voxel(const Vector3i pos, unsigned int channel_index = 0) const { return get_voxel(pos.x, pos.y, pos.z, channel_index); }
-	_FORCE_INLINE_ void set_voxel(int value, const Vector3i pos, unsigned int channel_index = 0) { set_voxel(value, pos.x, pos.y, pos.z, channel_index); }
+	void try_set_voxel(int x, int y, int z, uint32_t value, unsigned int channel_index = 0);
 
-	void fill(int defval, unsigned int channel_index = 0);
-	_FORCE_INLINE_ void fill_f(float value, unsigned int channel = 0) { fill(iso_to_byte(value), channel); }
-	void fill_area(int defval, Vector3i min, Vector3i max, unsigned int channel_index = 0);
+	void set_voxel_f(real_t value, int x, int y, int z, unsigned int channel_index = 0);
+	real_t get_voxel_f(int x, int y, int z, unsigned int channel_index = 0) const;
 
+	_FORCE_INLINE_ uint32_t get_voxel(const Vector3i pos, unsigned int channel_index = 0) const { return get_voxel(pos.x, pos.y, pos.z, channel_index); }
+	_FORCE_INLINE_ void set_voxel(uint32_t value, const Vector3i pos, unsigned int channel_index = 0) { set_voxel(value, pos.x, pos.y, pos.z, channel_index); }
+
+	void fill(uint32_t defval, unsigned int channel_index = 0);
+	void fill_f(float value, unsigned int channel = 0);
+	void fill_area(uint32_t defval, Vector3i min, Vector3i max, unsigned int channel_index = 0);
+
+	// Constant time unless the channel is dense and has no voxel of its default value
 	bool is_uniform(unsigned int channel_index) const;
 
+	// Gets the range of values in a channel
+	void get_channel_min_max(unsigned int channel_index, uint32_t &out_min, uint32_t &out_max) const;
+
+	// Counts how many voxels have the given value.
+	// Constant time unless the channel is dense and the value is not the default one.
+	unsigned int count_value(uint32_t value, unsigned int channel_index = 0) const;
+	bool contains_value(uint32_t value, unsigned int channel_index = 0) const;
+
+	// Recomputes value counts of a channel. Must be called after writing into channel data by other means than this class.
+	void update_channel_counts(unsigned int channel_index);
+
+	// Gets the box enclosing voxels modified since the last call to consume_dirty_region(), in voxel coordinates.
+	// Its size is zero if nothing was modified.
+	Rect3i get_dirty_region(unsigned int channel_index) const;
+	bool is_channel_dirty(unsigned int channel_index) const;
+	// Same as get_dirty_region(), and resets the region
+	Rect3i consume_dirty_region(unsigned int channel_index);
+
 	void optimize();
 
+	Compression get_channel_compression(unsigned int channel_index) const;
+	void decompress_channel(unsigned int channel_index);
+
+	// Bytes taken by this buffer and its channels. Channel data shared with other buffers is counted as well.
+	unsigned int get_memory_usage() const;
+
+	// Copying a whole channel is cheap, because data is shared until one of the buffers modifies it
 	void copy_from(const VoxelBuffer &other, unsigned int channel_index = 0);
 	void copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i src_max, Vector3i dst_min, unsigned int channel_index = 0);
 
+	// Creates a buffer sharing all channels with this one, for example to hand a snapshot to another thread
+	Ref<VoxelBuffer> duplicate() const;
+
+	// Bulk access to channels as raw arrays, in [z][x][y] order whatever the layout is.
+	// Each value takes as many bytes as the depth of the channel, in native byte order.
+	PoolByteArray get_channel_as_bytes(unsigned int channel_index) const;
+	void set_channel_from_bytes(unsigned int channel_index, const PoolByteArray &bytes);
+
+	// Same as above within a box, which must be inside the buffer. max is excluded.
+	PoolByteArray get_channel_area_as_bytes(unsigned int channel_index, Vector3i min, Vector3i max) const;
+	void set_channel_area_from_bytes(unsigned int channel_index, Vector3i min, Vector3i max, const PoolByteArray &bytes);
+
 	_FORCE_INLINE_ bool validate_pos(unsigned int x, unsigned int y, unsigned int z) const {
 		return x < _size.x && y < _size.y && z < _size.z;
 	}
 
 	_FORCE_INLINE_ unsigned int index(unsigned int x, unsigned int y, unsigned int z) const {
-		return y + _size.y * (x + _size.x * z);
+		return get_index(_layout, _size, x, y, z);
+	}
+
+	static _FORCE_INLINE_ unsigned int get_index(Layout layout, const Vector3i &size, unsigned int x, unsigned int y, unsigned int z) {
+		if (layout == LAYOUT_LINEAR) {
+			return y + size.y * (x + size.x * z);
+		}
+		const unsigned int brick_index = (y >> BRICK_SIZE_PO2) + (size.y >> BRICK_SIZE_PO2) * ((x >> BRICK_SIZE_PO2) + (size.x >> BRICK_SIZE_PO2) * (z >> BRICK_SIZE_PO2));
+		return (brick_index << (3 * BRICK_SIZE_PO2)) + (y & BRICK_MASK) + BRICK_SIZE * ((x & BRICK_MASK) + BRICK_SIZE * (z & BRICK_MASK));
+	}
+
+	// How many voxels from y are next to each other in channel arrays, going up to the end of the row.
+	// Areas can be processed row by row in runs of that length, whatever the layout is.
+	_FORCE_INLINE_ unsigned int get_run_length(unsigned int y) const {
+		return _layout == LAYOUT_LINEAR ? _size.y - y : BRICK_SIZE - (y & BRICK_MASK);
 	}
 
+	// Gets per-axis parts of index(), so that index(x, y, z) == x_offsets[x] + y_offsets[y] + z_offsets[z].
+	// Lets meshers reach neighbors of a voxel with a few additions, in any layout.
+	// Arrays must be as large as the size of the buffer along their axis.
+	void get_index_offsets(unsigned int *x_offsets, unsigned int *y_offsets, unsigned int *z_offsets) const;
+
 	//	_FORCE_INLINE_ unsigned int row_index(unsigned int x, unsigned int y, unsigned int z) const {
 	//		return _size.y * (x + _size.x * z);
 	//	}
@@ -99,12 +298,67 @@ public:
 		return _size.x * _size.y * _size.z;
 	}
 
-	uint8_t *get_channel_raw(unsigned int channel_index) const;
+	// Returns the dense array of a channel, or NULL if the channel is uniform or palette-compressed.
+	// Elements are as large as the depth of the channel, see get_raw_value().
+	// The array may be shared with other buffers, so it must not be modified.
+	const uint8_t *get_channel_raw(unsigned int channel_index) const;
 
 private:
 	void create_channel_noinit(int i, Vector3i size);
-	void create_channel(int i, Vector3i size, uint8_t defval);
+	void create_channel(int i, Vector3i size, uint32_t defval);
+	void create_channel_palette(int i, Vector3i size, unsigned int bits);
 	void delete_channel(int i);
+	void make_channel_unique(unsigned int channel_index);
+	void reorder_channel(unsigned int channel_index, Layout src_layout);
+	unsigned int get_channel_data_size(unsigned int channel_index) const;
+
+	static uint8_t *allocate_data(unsigned int size);
+	static void release_data(uint8_t *data, unsigned int size, uint32_t *palette, unsigned int palette_bits);
+	static uint32_t *copy_palette(const uint32_t *palette, unsigned int bits, unsigned int palette_size);
+
+	bool set_voxel_at_index(unsigned int channel_index, unsigned int i, uint32_t value);
+	void mark_dirty(unsigned int channel_index, Vector3i min, Vector3i max);
+	void mark_all_dirty(unsigned int channel_index);
+	int get_or_add_palette_index(unsigned int channel_index, uint32_t value);
+	void repack_palette(unsigned int channel_index, unsigned int extra_entries);
+	bool compress_palette(unsigned int channel_index);
+	void decode_palette(const uint8_t *data, const uint32_t *palette, unsigned int bits, Depth depth, uint8_t *dst) const;
+	bool validate_area(Vector3i min, Vector3i max) const;
+
+	static _FORCE_INLINE_ unsigned int get_packed_size(unsigned int volume, unsigned int bits) {
+		return (volume * bits + 7) / 8;
+	}
+
+	static _FORCE_INLINE_ unsigned int get_dense_size(unsigned int volume, Depth depth) {
+		return volume * get_depth_byte_count(depth);
+	}
+
+	// The palette is followed by how many voxels use each of its entries
+	static _FORCE_INLINE_ unsigned int get_palette_alloc_size(unsigned int bits) {
+		return 2 * (1 << bits) * sizeof(uint32_t);
+	}
+
+	// Channel data is reference-counted, with the count stored in front of it.
+	// The palette belongs to the same reference.
+	static const unsigned int DATA_HEADER_SIZE = 8;
+
+	static _FORCE_INLINE_ SafeRefCount &get_data_refcount(uint8_t *data) {
+		return *reinterpret_cast<SafeRefCount *>(data - DATA_HEADER_SIZE);
+	}
+
+	// Bit-packed indexes never straddle two bytes, because the number of bits always divides 8
+	static _FORCE_INLINE_ unsigned int get_packed_index(const uint8_t *data, unsigned int i, unsigned int bits) {
+		const unsigned int bit = i * bits;
+		return (data[bit >> 3] >> (bit & 7)) & ((1 << bits) - 1);
+	}
+
+	static _FORCE_INLINE_ void set_packed_index(uint8_t *data, unsigned int i, unsigned int bits, unsigned int pi) {
+		const unsigned int bit = i * bits;
+		const unsigned int shift = bit & 7;
+		const uint8_t mask = ((1 << bits) - 1) << shift;
+		uint8_t &b = data[bit >> 3];
+		b = (b & ~mask) | ((pi << shift) & mask);
+	}
 
 protected:
 	static void _bind_methods();
@@ -114,35 +368,85 @@ protected:
 	_FORCE_INLINE_ int get_size_z() const { return _size.z; }
 	_FORCE_INLINE_ Vector3 _get_size_binding() const { return _size.to_vec3(); }
 
-	_FORCE_INLINE_ int _get_voxel_binding(int x, int y, int z, unsigned int channel) const { return get_voxel(x, y, z, channel); }
-	_FORCE_INLINE_ void _set_voxel_binding(int value, int x, int y, int z, unsigned int channel) { set_voxel(value, x, y, z, channel); }
+	_FORCE_INLINE_ int64_t _get_voxel_binding(int x, int y, int z, unsigned int channel) const { return get_voxel(x, y, z, channel); }
+	_FORCE_INLINE_ void _set_voxel_binding(int64_t value, int x, int y, int z, unsigned int channel) { set_voxel(value, x, y, z, channel); }
 	void _copy_from_binding(Ref<VoxelBuffer> other, unsigned int channel);
 	void _copy_from_area_binding(Ref<VoxelBuffer> other, Vector3 src_min, Vector3 src_max, Vector3 dst_min, unsigned int channel);
-	_FORCE_INLINE_ void _fill_area_binding(int defval, Vector3 min, Vector3 max, unsigned int channel_index) { fill_area(defval, Vector3i(min), Vector3i(max), channel_index); }
+	_FORCE_INLINE_ PoolByteArray _get_channel_area_as_bytes_binding(unsigned int channel, Vector3 min, Vector3 max) const { return get_channel_area_as_bytes(channel, Vector3i(min), Vector3i(max)); }
+	_FORCE_INLINE_ void _set_channel_area_from_bytes_binding(unsigned int channel, Vector3 min, Vector3 max, PoolByteArray bytes) { set_channel_area_from_bytes(channel, Vector3i(min), Vector3i(max), bytes); }
+	_FORCE_INLINE_ void _fill_area_binding(int64_t defval, Vector3 min, Vector3 max, unsigned int channel_index) { fill_area(defval, Vector3i(min), Vector3i(max), channel_index); }
+	_FORCE_INLINE_ int _count_value_binding(int64_t value, unsigned int channel) const { return count_value(value, channel); }
+	_FORCE_INLINE_ bool _contains_value_binding(int64_t value, unsigned int channel) const { return contains_value(value, channel); }
+	AABB _get_dirty_region_binding(unsigned int channel) const;
+	AABB _consume_dirty_region_binding(unsigned int channel);
 	_FORCE_INLINE_ void _set_voxel_f_binding(real_t value, int x, int y, int z, unsigned int channel) { set_voxel_f(value, x, y, z, channel); }
 
 private:
+	union FloatBits {
+		float f;
+		uint32_t u;
+	};
+
 	struct Channel {
 		// Allocated when the channel is populated.
-		// Flat array, in order [z][x][y] because it allows faster vertical-wise access (the engine is Y-up).
+		// Flat array, in order [z][x][y] because it allows faster vertical-wise access (the engine is Y-up),
+		// or in bricks of that order, see Layout.
+		// If the channel is palette-compressed, it contains bit-packed indexes in the same order.
+		// Can be shared with other buffers, see make_channel_unique().
 		uint8_t *data;
 
+		// Values referenced by bit-packed indexes. Only allocated if the channel is palette-compressed.
+		uint32_t *palette;
+
 		// Default value when data is null
-		uint8_t defval;
+		uint32_t defval;
+
+		// Size of values, as a Depth
+		uint8_t depth;
+
+		// How many bits are used per palette index, or 0 if the channel is not palette-compressed
+		uint8_t palette_bits;
+
+		// How many entries of the palette are in use. Capacity is always 1 << palette_bits.
+		uint16_t palette_size;
+
+		// How many voxels differ from the default value, if the channel is dense
+		uint32_t non_default_count;
 
 		Channel() :
 				data(NULL),
-				defval(0) {}
+				palette(NULL),
+				defval(0),
+				depth(DEPTH_8_BIT),
+				palette_bits(0),
+				palette_size(0),
+				non_default_count(0) {}
 	};
 
+	// How many voxels use each palette entry
+	static _FORCE_INLINE_ uint32_t *get_palette_counts(const Channel &channel) {
+		return channel.palette + (1 << channel.palette_bits);
+	}
+
+	unsigned int count_row_default_values(const Channel &channel, unsigned int row_index, unsigned int row_length) const;
+
 	// Each channel can store arbitary data.
 	// For example, you can decide to store colors (R, G, B, A), gameplay types (type, state, light) or both.
 	Channel _channels[MAX_CHANNELS];
 
 	// How many voxels are there in the three directions. All populated channels have the same size.
 	Vector3i _size;
+
+	// Order of voxels in all channels
+	Layout _layout;
+
+	// Voxels modified in each channel since the last consume_dirty_region()
+	Rect3i _dirty_regions[MAX_CHANNELS];
 };
 
 VARIANT_ENUM_CAST(VoxelBuffer::ChannelId)
+VARIANT_ENUM_CAST(VoxelBuffer::Compression)
+VARIANT_ENUM_CAST(VoxelBuffer::Depth)
+VARIANT_ENUM_CAST(VoxelBuffer::Layout)
 
 #endif // VOXEL_BUFFER_H
@@ -31,7 +31,7 @@ VoxelLibrary::~VoxelLibrary() {
 
 int VoxelLibrary::get_voxel_count() const {
 	int count = 0;
-	for (int i = 0; i < MAX_VOXEL_TYPES; ++i) {
+	for (int i = 0; i < _voxel_types.size(); ++i) {
 		if (_voxel_types[i].is_valid())
 			++count;
 	}
@@ -79,7 +79,10 @@ Ref<Voxel> VoxelLibrary::create_voxel(int id, String name) {
 	voxel->set_library(Ref<VoxelLibrary>(this));
 	voxel->set_id(id);
 	voxel->set_voxel_name(name);
-	_voxel_types[id] = voxel;
+	if (id >= _voxel_types.size()) {
+		_voxel_types.resize(id + 1);
+	}
+	_voxel_types.write[id] = voxel;
 
 	return voxel;
 }
@@ -94,22 +97,31 @@ void VoxelLibrary::add_voxel(Ref<Voxel> voxel) {
 
 void VoxelLibrary::set_voxel(int id, Ref<Voxel> voxel) {
 	ERR_FAIL_COND(id < 0 || id >= MAX_VOXEL_TYPES);
+	ERR_FAIL_COND(voxel.is_null());
 
 	voxel->set_id(id);
 
-	_voxel_types[id] = voxel;
+	if (id >= _voxel_types.size()) {
+		_voxel_types.resize(id + 1);
+	}
+	_voxel_types.write[id] = voxel;
 }
 
 Ref<Voxel> VoxelLibrary::get_voxel(int id) {
 	ERR_FAIL_COND_V(id < 0 || id >= MAX_VOXEL_TYPES, Ref<Voxel>());
 
+	if (id >= _voxel_types.size()) {
+		return Ref<Voxel>();
+	}
 	return _voxel_types[id];
 }
 
 void VoxelLibrary::remove_voxel(int id) {
 	ERR_FAIL_COND(id < 0 || id >= MAX_VOXEL_TYPES);
 
-	_voxel_types[id] = Ref<Voxel>(NULL);
+	if (id < _voxel_types.size()) {
+		_voxel_types.write[id] = Ref<Voxel>(NULL);
+	}
 }
 
 void VoxelLibrary::rebuild_uvs() {
@@ -164,13 +176,42 @@ void VoxelLibrary::set_is_textured(bool value) {
 }
 
 
-void VoxelLibrary::_validate_property(PropertyInfo &property) const {
-	String prop = property.name;
+// Voxel properties are listed dynamically, because registering all possible IDs would be too many
+bool VoxelLibrary::_set(const StringName &p_name, const Variant &p_value) {
+	String prop = p_name;
 	if (prop.begins_with("Voxel_")) {
-		int frame = prop.get_slicec('/', 0).get_slicec('_', 1).to_int();
-		if (frame >= _voxel_editor_count || frame < ITEMS_PER_PAGE * _voxel_editor_page || frame > ITEMS_PER_PAGE * (_voxel_editor_page + 1)) {
-			property.usage = 0;
+		int id = prop.get_slicec('/', 0).get_slicec('_', 1).to_int();
+		Ref<Voxel> voxel = p_value;
+		if (voxel.is_valid()) {
+			set_voxel(id, voxel);
+		} else {
+			remove_voxel(id);
 		}
+		return true;
+	}
+	return false;
+}
+
+bool VoxelLibrary::_get(const StringName &p_name, Variant &r_ret) const {
+	String prop = p_name;
+	if (prop.begins_with("Voxel_")) {
+		int id = prop.get_slicec('/', 0).get_slicec('_', 1).to_int();
+		if (id >= 0 && id < _voxel_types.size()) {
+			r_ret = _voxel_types[id];
+		} else {
+			r_ret = Ref<Voxel>();
+		}
+		return true;
+	}
+	return false;
+}
+
+void VoxelLibrary::_get_property_list(List<PropertyInfo> *p_list) const {
+	for (int i = 0; i < _voxel_editor_count && i < (int)MAX_VOXEL_TYPES; ++i) {
+		if (i < ITEMS_PER_PAGE * _voxel_editor_page || i > ITEMS_PER_PAGE * (_voxel_editor_page + 1)) {
+			continue;
+		}
+		p_list->push_back(PropertyInfo(Variant::OBJECT, "Voxel_" + itos(i), PROPERTY_HINT_RESOURCE_TYPE, "Voxel", PROPERTY_USAGE_DEFAULT | PROPERTY_USAGE_INTERNAL));
 	}
 }
 
@@ -214,10 +255,5 @@ void VoxelLibrary::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_voxel", "id"), &VoxelLibrary::get_voxel);
 	ClassDB::bind_method(D_METHOD("set_voxel", "id", "voxel"), &VoxelLibrary::set_voxel);
 
-	ADD_GROUP("Voxel", "Voxel");
-	for (int i = 0; i < MAX_VOXEL_TYPES; ++i) {
-		ADD_PROPERTYI(PropertyInfo(Variant::OBJECT, "Voxel_" + itos(i), PROPERTY_HINT_RESOURCE_TYPE, "Voxel", PROPERTY_USAGE_DEFAULT | PROPERTY_USAGE_INTERNAL), "set_voxel", "get_voxel", i);
-	}
-
 	BIND_CONSTANT(MAX_VOXEL_TYPES);
 }
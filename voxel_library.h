@@ -10,7 +10,7 @@ class VoxelLibrary : public Resource {
 	GDCLASS(VoxelLibrary, Resource)
 
 public:
-	static const unsigned int MAX_VOXEL_TYPES = 256; // Required limit because voxel types are stored in 8 bits
+	static const unsigned int MAX_VOXEL_TYPES = 65536; // Required limit because voxel types are stored in at most 16 bits
 	static const unsigned int ITEMS_PER_PAGE = 256; //TODO fix saving items that are not on the currently active page
 
 	VoxelLibrary();
@@ -36,8 +36,8 @@ public:
 	int get_voxel_editor_page();
 	void set_voxel_editor_page(int value);
 
-	_FORCE_INLINE_ bool has_voxel(int id) const { return _voxel_types[id].is_valid(); }
-	_FORCE_INLINE_ const Voxel &get_voxel_const(int id) const { return **_voxel_types[id]; }
+	_FORCE_INLINE_ bool has_voxel(int id) const { return id >= 0 && id < _voxel_types.size() && _voxel_types.ptr()[id].is_valid(); }
+	_FORCE_INLINE_ const Voxel &get_voxel_const(int id) const { return **_voxel_types.ptr()[id]; }
 
 	//Atlas
 	int get_atlas_columns() const { return _atlas_columns; }
@@ -57,14 +57,17 @@ public:
 	static Vector<Vector2> get_uvs_test(float x, float y, float w, float h);
 
 protected:
-	void _validate_property(PropertyInfo &property) const;
+	bool _set(const StringName &p_name, const Variant &p_value);
+	bool _get(const StringName &p_name, Variant &r_ret) const;
+	void _get_property_list(List<PropertyInfo> *p_list) const;
 	static void _bind_methods();
 
 private:
 	int _voxel_editor_count;
 	int _voxel_editor_page;
 
-	Ref<Voxel> _voxel_types[MAX_VOXEL_TYPES];
+	// Grows up to the highest ID in use, so that small libraries don't reserve slots for all possible types
+	Vector<Ref<Voxel> > _voxel_types;
 
 	//atlas
 	int _atlas_columns;
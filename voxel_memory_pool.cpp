@@ -0,0 +1,138 @@
+#include "voxel_memory_pool.h"
+
+namespace {
+VoxelMemoryPool *g_memory_pool = NULL;
+} // namespace
+
+void VoxelMemoryPool::create_singleton() {
+	CRASH_COND(g_memory_pool != NULL);
+	g_memory_pool = memnew(VoxelMemoryPool);
+}
+
+void VoxelMemoryPool::destroy_singleton() {
+	CRASH_COND(g_memory_pool == NULL);
+	VoxelMemoryPool *pool = g_memory_pool;
+	g_memory_pool = NULL;
+	memdelete(pool);
+}
+
+VoxelMemoryPool *VoxelMemoryPool::get_singleton() {
+	CRASH_COND(g_memory_pool == NULL);
+	return g_memory_pool;
+}
+
+uint8_t *VoxelMemoryPool::allocate_block(uint32_t size) {
+	if (g_memory_pool == NULL) {
+		return (uint8_t *)memalloc(size);
+	}
+	return g_memory_pool->allocate(size);
+}
+
+void VoxelMemoryPool::recycle_block(uint8_t *block, uint32_t size) {
+	if (g_memory_pool == NULL) {
+		ERR_FAIL_COND(block == NULL);
+		memfree(block);
+		return;
+	}
+	g_memory_pool->recycle(block, size);
+}
+
+VoxelMemoryPool::VoxelMemoryPool() {
+	_mutex = Mutex::create();
+}
+
+VoxelMemoryPool::~VoxelMemoryPool() {
+	// Blocks still in use will be freed directly, see recycle_block()
+	clear();
+	const uint32_t *key = NULL;
+	while (key = _pools.next(key)) {
+		Pool *pool = _pools.get(*key);
+		memdelete(pool);
+	}
+	_pools.clear();
+	memdelete(_mutex);
+}
+
+uint8_t *VoxelMemoryPool::allocate(uint32_t size) {
+	MutexLock lock(_mutex);
+
+	Pool *pool = get_or_create_pool(size);
+	uint8_t *block;
+
+	if (pool->blocks.size() > 0) {
+		block = pool->blocks[pool->blocks.size() - 1];
+		pool->blocks.resize(pool->blocks.size() - 1);
+		--_stats.pooled_blocks;
+		_stats.pooled_bytes -= size;
+		++_stats.reuse_count;
+	} else {
+		block = (uint8_t *)memalloc(size);
+	}
+
+	++_stats.used_blocks;
+	_stats.used_bytes += size;
+	++_stats.allocation_count;
+
+	return block;
+}
+
+void VoxelMemoryPool::recycle(uint8_t *block, uint32_t size) {
+	ERR_FAIL_COND(block == NULL);
+	MutexLock lock(_mutex);
+
+	--_stats.used_blocks;
+	_stats.used_bytes -= size;
+
+	if (_stats.pooled_bytes + size > MAX_POOLED_BYTES) {
+		memfree(block);
+		return;
+	}
+
+	Pool *pool = get_or_create_pool(size);
+	pool->blocks.push_back(block);
+	++_stats.pooled_blocks;
+	_stats.pooled_bytes += size;
+}
+
+void VoxelMemoryPool::clear() {
+	MutexLock lock(_mutex);
+
+	const uint32_t *key = NULL;
+	while (key = _pools.next(key)) {
+		Pool *pool = _pools.get(*key);
+		for (int i = 0; i < pool->blocks.size(); ++i) {
+			memfree(pool->blocks[i]);
+		}
+		pool->blocks.clear();
+	}
+
+	_stats.pooled_blocks = 0;
+	_stats.pooled_bytes = 0;
+}
+
+VoxelMemoryPool::Pool *VoxelMemoryPool::get_or_create_pool(uint32_t size) {
+	Pool **pptr = _pools.getptr(size);
+	if (pptr) {
+		return *pptr;
+	}
+	Pool *pool = memnew(Pool);
+	_pools.set(size, pool);
+	return pool;
+}
+
+VoxelMemoryPool::Stats VoxelMemoryPool::get_stats() const {
+	MutexLock lock(_mutex);
+	return _stats;
+}
+
+Dictionary VoxelMemoryPool::get_statistics() const {
+	Stats stats = get_stats();
+	Dictionary d;
+	d["used_blocks"] = stats.used_blocks;
+	d["pooled_blocks"] = stats.pooled_blocks;
+	d["used_bytes"] = stats.used_bytes;
+	d["pooled_bytes"] = stats.pooled_bytes;
+	d["allocation_count"] = stats.allocation_count;
+	d["reuse_count"] = stats.reuse_count;
+	return d;
+}
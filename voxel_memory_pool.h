@@ -0,0 +1,69 @@
+#ifndef VOXEL_MEMORY_POOL_H
+#define VOXEL_MEMORY_POOL_H
+
+#include <core/dictionary.h>
+#include <core/hash_map.h>
+#include <core/os/mutex.h>
+#include <core/vector.h>
+
+// Recycles fixed-size allocations of voxel data.
+// Terrains use the same few block sizes over and over, so freed channels are kept by size and handed back
+// to the next request of the same size, instead of going through the general-purpose allocator.
+// Thread-safe, because blocks are allocated by threads and freed on the main thread.
+class VoxelMemoryPool {
+public:
+	// Beyond this amount of memory held for re-use, freed blocks are released to the system
+	static const uint64_t MAX_POOLED_BYTES = 64 * 1024 * 1024;
+
+	struct Stats {
+		uint32_t used_blocks; // Allocations obtained from the pool and not recycled yet
+		uint32_t pooled_blocks; // Allocations available for re-use
+		uint64_t used_bytes;
+		uint64_t pooled_bytes;
+		uint64_t allocation_count;
+		uint64_t reuse_count; // How many allocations were served without using the system allocator
+
+		Stats() :
+				used_blocks(0),
+				pooled_blocks(0),
+				used_bytes(0),
+				pooled_bytes(0),
+				allocation_count(0),
+				reuse_count(0) {}
+	};
+
+	static void create_singleton();
+	static void destroy_singleton();
+	static VoxelMemoryPool *get_singleton();
+
+	// Voxel data can outlive the pool, for example when held by resources released late during shutdown.
+	// These go through the pool if it exists, and through the system allocator otherwise, which the pool also uses.
+	static uint8_t *allocate_block(uint32_t size);
+	static void recycle_block(uint8_t *block, uint32_t size);
+
+	VoxelMemoryPool();
+	~VoxelMemoryPool();
+
+	uint8_t *allocate(uint32_t size);
+	// The size must be the same as the one given when the block was allocated
+	void recycle(uint8_t *block, uint32_t size);
+
+	// Releases all blocks waiting to be re-used
+	void clear();
+
+	Stats get_stats() const;
+	Dictionary get_statistics() const;
+
+private:
+	struct Pool {
+		Vector<uint8_t *> blocks;
+	};
+
+	Pool *get_or_create_pool(uint32_t size);
+
+	HashMap<uint32_t, Pool *> _pools;
+	Stats _stats;
+	Mutex *_mutex;
+};
+
+#endif // VOXEL_MEMORY_POOL_H